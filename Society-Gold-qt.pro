@@ -115,6 +115,12 @@ contains(USE_QRCODE, 1) {
     LIBS += -lqrencode
 }
 
+# use: qmake "DISABLE_DEBUG_LOG=1" to compile out every LogPrint with a debug category
+contains(DISABLE_DEBUG_LOG, 1) {
+    message(Building without debug category logging)
+    DEFINES += DISABLE_DEBUG_LOG
+}
+
 
 # use: qmake "USE_DBUS=1" or qmake "USE_DBUS=0"
 linux:count(USE_DBUS, 0) {
@@ -305,6 +311,11 @@ HEADERS += src/qt/bitcoingui.h \
     src/rpcprotocol.h \
     src/rpcserver.h \
     src/limitedmap.h \
+    src/checkqueue.h \
+    src/spscqueue.h \
+    src/cuckoocache.h \
+    src/blockencodings.h \
+    src/scheduler.h \
     src/qt/overviewpage.h \
     src/qt/csvmodelwriter.h \
     src/crypter.h \
@@ -378,6 +389,8 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/script.cpp \
     src/sync.cpp \
     src/txmempool.cpp \
+    src/blockencodings.cpp \
+    src/scheduler.cpp \
     src/util.cpp \
     src/hash.cpp \
     src/netbase.cpp \
@@ -0,0 +1,173 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/unordered_map.hpp>
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    nNonce(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    header.vchBlockSig = block.vchBlockSig;
+    FillShortTxIDSelector();
+
+    // The coinbase, and for proof-of-stake the coinstake, are never in a pool
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+        {
+            CPrefilledTransaction prefilled;
+            prefilled.nIndex = i;
+            prefilled.tx = block.vtx[i];
+            vPrefilledTxn.push_back(prefilled);
+        }
+        else
+            vShortTxIDs.push_back(GetShortID(block.vtx[i].GetHash()));
+    }
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header.nVersion << header.hashPrevBlock << header.hashMerkleRoot
+           << header.nTime << header.nBits << header.nNonce << nNonce;
+    uint256 hash;
+    CSHA256().Write((const unsigned char*)&stream[0], stream.size()).Finalize(hash.begin());
+    nShortIDKey0 = hash.Get64(0);
+    nShortIDKey1 = hash.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& hashTx) const
+{
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, hashTx) & 0xffffffffffffULL;
+}
+
+ReadStatus CPartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.vShortTxIDs.empty() && cmpctblock.vPrefilledTxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > CBlockHeaderAndShortTxIDs::MAX_TXS)
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && vtxAvailable.empty());
+    header = cmpctblock.header;
+    vtxAvailable.resize(cmpctblock.BlockTxCount());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    for (unsigned int i = 0; i < cmpctblock.vPrefilledTxn.size(); i++)
+    {
+        const CPrefilledTransaction& prefilled = cmpctblock.vPrefilledTxn[i];
+        if (prefilled.tx.IsNull() || prefilled.nIndex >= vtxAvailable.size() || vHave[prefilled.nIndex])
+            return READ_STATUS_INVALID;
+        vtxAvailable[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+    nPrefilledCount = cmpctblock.vPrefilledTxn.size();
+
+    // Slot of every short id, in the order the ids were sent
+    boost::unordered_map<uint64_t, unsigned short> mapShortIDs;
+    unsigned int nIndex = 0;
+    for (unsigned int i = 0; i < cmpctblock.vShortTxIDs.size(); i++)
+    {
+        while (vHave[nIndex])
+            nIndex++;
+        if (!mapShortIDs.insert(make_pair(cmpctblock.vShortTxIDs[i], (unsigned short)nIndex)).second)
+        {
+            // Two transactions of the block share a short id, only the
+            // full block can tell them apart
+            return READ_STATUS_FAILED;
+        }
+        nIndex++;
+    }
+
+    // A pool transaction matching a slot already filled from the pool is a
+    // collision, and that slot is left for getblocktxn to settle
+    vector<char> vCollided(vtxAvailable.size(), false);
+    {
+        LOCK(pool->cs);
+        for (CTxMemPool::txiter it = pool->mapTx.begin(); it != pool->mapTx.end(); ++it)
+        {
+            boost::unordered_map<uint64_t, unsigned short>::iterator itID = mapShortIDs.find(cmpctblock.GetShortID(it->GetHash()));
+            if (itID == mapShortIDs.end())
+                continue;
+
+            unsigned short nSlot = itID->second;
+            if (vCollided[nSlot])
+                continue;
+            if (vHave[nSlot])
+            {
+                vHave[nSlot] = false;
+                vCollided[nSlot] = true;
+                nMempoolCount--;
+                continue;
+            }
+            vtxAvailable[nSlot] = it->GetTx();
+            vHave[nSlot] = true;
+            nMempoolCount++;
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized compact block %s: %u prefilled, %u from the pool, %u missing\n",
+             header.GetHash().ToString(), nPrefilledCount, nMempoolCount, vtxAvailable.size() - nPrefilledCount - nMempoolCount);
+    return READ_STATUS_OK;
+}
+
+bool CPartiallyDownloadedBlock::IsTxAvailable(unsigned int nIndex) const
+{
+    assert(!header.IsNull());
+    return nIndex < vHave.size() && vHave[nIndex];
+}
+
+void CPartiallyDownloadedBlock::GetMissing(vector<unsigned short>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+ReadStatus CPartiallyDownloadedBlock::FillBlock(CBlock& block, const vector<CTransaction>& vtxMissing) const
+{
+    assert(!header.IsNull());
+
+    block = header;
+    block.vtx.resize(vtxAvailable.size());
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vtxAvailable.size(); i++)
+    {
+        if (vHave[i])
+            block.vtx[i] = vtxAvailable[i];
+        else
+        {
+            if (nMissing >= vtxMissing.size())
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtxMissing[nMissing++];
+        }
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    // A short id collision with a pool transaction shows up as a merkle
+    // root mismatch, which is not the peer's fault
+    if (block.BuildMerkleTree() != header.hashMerkleRoot)
+    {
+        LogPrint("cmpctblock", "Rebuilt compact block %s does not match its merkle root\n", header.GetHash().ToString());
+        return READ_STATUS_FAILED;
+    }
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,210 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+#include <vector>
+
+class CTxMemPool;
+
+/** Transactions of a block asked for by index, after a compact block left
+ * them missing. The indexes go on the wire as the gap to the previous one.
+ */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned short> vIndexes;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = ::GetSerializeSize(hashBlock, nType, nVersion) + GetSizeOfCompactSize(vIndexes.size());
+        for (unsigned int i = 0; i < vIndexes.size(); i++)
+            nSize += GetSizeOfCompactSize(vIndexes[i] - (i == 0 ? 0 : vIndexes[i - 1] + 1));
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, hashBlock, nType, nVersion);
+        WriteCompactSize(s, vIndexes.size());
+        for (unsigned int i = 0; i < vIndexes.size(); i++)
+            WriteCompactSize(s, vIndexes[i] - (i == 0 ? 0 : vIndexes[i - 1] + 1));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, hashBlock, nType, nVersion);
+        uint64_t nCount = ReadCompactSize(s);
+        vIndexes.clear();
+        uint64_t nIndex = 0;
+        for (uint64_t i = 0; i < nCount; i++)
+        {
+            nIndex += ReadCompactSize(s) + (i == 0 ? 0 : 1);
+            if (nIndex > std::numeric_limits<unsigned short>::max())
+                throw std::ios_base::failure("index overflowed 16 bits");
+            vIndexes.push_back(nIndex);
+        }
+    }
+};
+
+/** The transactions answering a CBlockTransactionsRequest, in its order */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A transaction sent along with a compact block. Its index is the gap to
+ * the previous prefilled one on the wire, and absolute in memory.
+ */
+struct CPrefilledTransaction
+{
+    unsigned short nIndex;
+    CTransaction tx;
+};
+
+/** A block announced as its header and a 6 byte short id per transaction,
+ * for the receiver to rebuild from its memory pool. The coinbase, and the
+ * coinstake of a proof-of-stake block, never are in a pool and are sent in
+ * full. Short ids are SipHash-2-4 of the txid, keyed by the header and a
+ * random nonce, so they cannot be ground in advance to collide.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t nShortIDKey0, nShortIDKey1;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+    // Indexes are 16 bits, larger blocks are relayed in full
+    static const unsigned int MAX_TXS = 65535;
+
+    CBlock header;
+    uint64_t nNonce;
+    std::vector<uint64_t> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs() : nShortIDKey0(0), nShortIDKey1(0), nNonce(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& hashTx) const;
+
+    unsigned int BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTxn.size(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = ::GetSerializeSize(header, nType | SER_BLOCKHEADERONLY, nVersion) +
+                             ::GetSerializeSize(header.vchBlockSig, nType, nVersion) + sizeof(nNonce);
+        nSize += GetSizeOfCompactSize(vShortTxIDs.size()) + vShortTxIDs.size() * SHORTTXIDS_LENGTH;
+        nSize += GetSizeOfCompactSize(vPrefilledTxn.size());
+        for (unsigned int i = 0; i < vPrefilledTxn.size(); i++)
+            nSize += GetSizeOfCompactSize(vPrefilledTxn[i].nIndex - (i == 0 ? 0 : vPrefilledTxn[i - 1].nIndex + 1)) +
+                     ::GetSerializeSize(vPrefilledTxn[i].tx, nType, nVersion);
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType | SER_BLOCKHEADERONLY, nVersion);
+        ::Serialize(s, header.vchBlockSig, nType, nVersion);
+        ::Serialize(s, nNonce, nType, nVersion);
+
+        WriteCompactSize(s, vShortTxIDs.size());
+        for (unsigned int i = 0; i < vShortTxIDs.size(); i++)
+        {
+            unsigned char vch[8];
+            WriteLE64(vch, vShortTxIDs[i]);
+            s.write((const char*)vch, SHORTTXIDS_LENGTH);
+        }
+
+        WriteCompactSize(s, vPrefilledTxn.size());
+        for (unsigned int i = 0; i < vPrefilledTxn.size(); i++)
+        {
+            WriteCompactSize(s, vPrefilledTxn[i].nIndex - (i == 0 ? 0 : vPrefilledTxn[i - 1].nIndex + 1));
+            ::Serialize(s, vPrefilledTxn[i].tx, nType, nVersion);
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType | SER_BLOCKHEADERONLY, nVersion);
+        ::Unserialize(s, header.vchBlockSig, nType, nVersion);
+        ::Unserialize(s, nNonce, nType, nVersion);
+
+        uint64_t nCount = ReadCompactSize(s);
+        if (nCount > MAX_TXS)
+            throw std::ios_base::failure("too many short ids");
+        vShortTxIDs.resize(nCount);
+        for (uint64_t i = 0; i < nCount; i++)
+        {
+            unsigned char vch[8] = {};
+            s.read((char*)vch, SHORTTXIDS_LENGTH);
+            vShortTxIDs[i] = ReadLE64(vch);
+        }
+
+        nCount = ReadCompactSize(s);
+        if (nCount > MAX_TXS)
+            throw std::ios_base::failure("too many prefilled transactions");
+        vPrefilledTxn.resize(nCount);
+        uint64_t nIndex = 0;
+        for (uint64_t i = 0; i < nCount; i++)
+        {
+            nIndex += ReadCompactSize(s) + (i == 0 ? 0 : 1);
+            if (nIndex > std::numeric_limits<unsigned short>::max())
+                throw std::ios_base::failure("index overflowed 16 bits");
+            vPrefilledTxn[i].nIndex = nIndex;
+            ::Unserialize(s, vPrefilledTxn[i].tx, nType, nVersion);
+        }
+
+        FillShortTxIDSelector();
+    }
+};
+
+enum ReadStatus
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // the peer sent something malformed
+    READ_STATUS_FAILED,  // could not be rebuilt, fetch the full block instead
+};
+
+/** A block being rebuilt from a compact block and the memory pool, while
+ * the transactions the pool did not have are fetched with getblocktxn.
+ */
+class CPartiallyDownloadedBlock
+{
+private:
+    std::vector<CTransaction> vtxAvailable;
+    std::vector<char> vHave;
+    CTxMemPool* pool;
+
+public:
+    CBlock header;
+    unsigned int nPrefilledCount;
+    unsigned int nMempoolCount;
+
+    CPartiallyDownloadedBlock(CTxMemPool* poolIn) : pool(poolIn), nPrefilledCount(0), nMempoolCount(0) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    bool IsTxAvailable(unsigned int nIndex) const;
+    void GetMissing(std::vector<unsigned short>& vIndexes) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const;
+};
+
+#endif
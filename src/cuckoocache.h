@@ -0,0 +1,135 @@
+// Copyright (c) 2016 Jeremy Rubin
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef CUCKOOCACHE_H
+#define CUCKOOCACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+/** Fixed-memory set of hashes, used by the signature cache.
+  *
+  * Every element can live in one of eight slots, picked by the Hasher from
+  * the element itself (Hasher fills in eight 32-bit values, which should be
+  * uniformly distributed). A slot with its collection flag set may be
+  * overwritten, so erasing an element is just setting its flag and the space
+  * is reclaimed in bulk by later inserts. Inserting into a full neighbourhood
+  * moves the occupant to one of its other slots, cuckoo style, and after
+  * depth_limit moves the element left in hand is dropped.
+  *
+  * contains() only reads the table and atomically sets flags, so any number
+  * of lookups may run at once. insert() and setup_bytes() need the caller to
+  * keep every other user out.
+  */
+template<typename Element, typename Hasher> class CCuckooCache {
+private:
+    std::vector<Element> table;
+
+    // One collection flag per slot, packed eight to a byte
+    std::unique_ptr<std::atomic<uint8_t>[]> flags;
+
+    uint32_t size;
+    uint8_t depth_limit;
+    const Hasher hash_function;
+
+    void bit_set(uint32_t s) const {
+        flags[s >> 3].fetch_or(1 << (s & 7), std::memory_order_relaxed);
+    }
+
+    void bit_unset(uint32_t s) const {
+        flags[s >> 3].fetch_and(~(1 << (s & 7)), std::memory_order_relaxed);
+    }
+
+    bool bit_is_set(uint32_t s) const {
+        return (1 << (s & 7)) & flags[s >> 3].load(std::memory_order_relaxed);
+    }
+
+    // Map the eight hashes of e onto [0, size) without a division
+    void compute_hashes(const Element& e, uint32_t locs[8]) const {
+        hash_function(e, locs);
+        for (int i = 0; i < 8; i++)
+            locs[i] = (uint32_t)(((uint64_t)locs[i] * (uint64_t)size) >> 32);
+    }
+
+public:
+    CCuckooCache() : size(0), depth_limit(0), hash_function() {}
+
+    // Size the table to fit in nBytes, dropping everything in it.
+    // Returns the number of elements it can hold.
+    uint32_t setup_bytes(size_t nBytes) {
+        size = (uint32_t)std::min<size_t>(nBytes / sizeof(Element), UINT32_MAX);
+        depth_limit = 0;
+        for (uint32_t n = size; n > 1; n >>= 1)
+            depth_limit++;
+        if (depth_limit == 0)
+            depth_limit = 1;
+
+        std::vector<Element>(size).swap(table);
+        flags.reset(new std::atomic<uint8_t>[(size + 7) / 8]);
+        // all slots start out free
+        for (uint32_t i = 0; i < (size + 7) / 8; i++)
+            flags[i].store(0xFF, std::memory_order_relaxed);
+        return size;
+    }
+
+    void insert(Element e) {
+        if (size == 0)
+            return;
+
+        uint32_t locs[8];
+        compute_hashes(e, locs);
+
+        // Already there, make sure it is kept
+        for (int i = 0; i < 8; i++) {
+            if (table[locs[i]] == e) {
+                bit_unset(locs[i]);
+                return;
+            }
+        }
+
+        uint32_t last_loc = size;
+        for (uint8_t depth = 0; depth < depth_limit; depth++) {
+            for (int i = 0; i < 8; i++) {
+                if (!bit_is_set(locs[i]))
+                    continue;
+                table[locs[i]] = std::move(e);
+                bit_unset(locs[i]);
+                return;
+            }
+
+            // No free slot: take the one after the slot the element in hand
+            // was evicted from, so moves do not cycle between two slots
+            int i = 0;
+            while (i < 8 && locs[i] != last_loc)
+                i++;
+            last_loc = locs[(i + 1) & 7];
+            std::swap(table[last_loc], e);
+
+            compute_hashes(e, locs);
+        }
+    }
+
+    // Look e up, and with erase set let its slot be reused
+    bool contains(const Element& e, bool erase) const {
+        if (size == 0)
+            return false;
+
+        uint32_t locs[8];
+        compute_hashes(e, locs);
+        for (int i = 0; i < 8; i++) {
+            if (table[locs[i]] == e) {
+                if (erase)
+                    bit_set(locs[i]);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+#endif
@@ -1265,6 +1265,9 @@ bool CDarksendPool::AddScriptSig(const CTxIn& newVin){
         }
         MilliSleep(1);  /* RGP Optimise */
     }
+    // finalTransaction was logged, and so hashed, before it was signed
+    finalTransaction.InvalidateHash();
+
     for(unsigned int i = 0; i < entries.size(); i++){
         if(entries[i].AddSig(newVin)){
             LogPrintf("darksend, CDarksendPool::AddScriptSig -- adding  %s\n", newVin.scriptSig.ToString().substr(0,24));
@@ -184,4 +184,8 @@ int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
 int HMAC_SHA512_Update(HMAC_SHA512_CTX *pctx, const void *pdata, size_t len);
 int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx);
 void BIP32Hash(const unsigned char chainCode[32], unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
+
+/** SipHash-2-4 of a 256-bit value under the key (k0, k1). Much cheaper than
+ *  SHA256, for short ids that only need to be unpredictable per key. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
 #endif
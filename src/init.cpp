@@ -8,7 +8,9 @@
 #include "main.h"
 #include "chainparams.h"
 #include "txdb.h"
+#include "kernel.h"
 #include "rpcserver.h"
+#include "scheduler.h"
 #include "httpserver.h"
 #include "httprpc.h" 
 #include "net.h"
@@ -66,6 +68,10 @@ unsigned int nMinerSleep;
 bool fUseFastIndex;
 bool fOnlyTor = false;
 
+// Runs the periodic tasks on the "scheduler" thread. Never freed, like the
+// rest of what the threads use, as they are not all joined at shutdown.
+static CScheduler* scheduler = NULL;
+
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -175,6 +181,8 @@ void Shutdown()
 
 #endif
     StopNode();
+    if (scheduler)
+        scheduler->stop();
     UnregisterNodeSignals(GetNodeSignals());
     DumpMasternodes();
     {
@@ -183,11 +191,14 @@ void Shutdown()
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
+        if (GetBoolArg("-blockindexsnapshot", true))
+            WriteBlockIndexSnapshot();
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         bitdb.Flush(true);
 #endif
+    UnmapBlockFiles();
     boost::filesystem::remove(GetPidFile());
     UnregisterAllWallets();
 #ifdef ENABLE_WALLET
@@ -197,6 +208,7 @@ void Shutdown()
     globalVerifyHandle.reset();
     ECC_Stop();
     LogPrintf("Shutdown : done\n");
+    StopLogWriter();
 }
 
 void Interrupt()
@@ -206,6 +218,8 @@ void Interrupt()
     InterruptRPC();
     InterruptREST();
     InterruptTorControl();
+    InterruptScriptCheck();
+    InterruptGossipHandler();
 }
 
 
@@ -264,6 +278,13 @@ std::string HelpMessage()
     strUsage += "   datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "   wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "   dbcache=<n>           " + _("Set database cache size in megabytes (default: 10)") + "\n";
+    strUsage += "   blockfilemaps=<n>     " + strprintf(_("Number of block files kept memory mapped for reading, 0 to disable (default: %u on 64-bit systems)"), DEFAULT_BLOCKFILE_MAPS) + "\n";
+    strUsage += "   txindexcache=<n>      " + strprintf(_("Number of transaction index records cached in memory (default: %u)"), DEFAULT_TXINDEX_CACHE) + "\n";
+    strUsage += "   txcache=<n>           " + strprintf(_("Number of previous transactions cached in memory (default: %u)"), DEFAULT_TX_CACHE) + "\n";
+    strUsage += "   maxsigcachesize=<n>   " + strprintf(_("Limit the signature cache to <n> MiB, 0 to disable (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
+    strUsage += "   dbsync                " + _("Flush the block database to disk after every connected block (default: 0)") + "\n";
+    strUsage += "   par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "   gossipthreads=<n>     " + strprintf(_("Set the number of threads answering pings (0 to %d, 0 = handle them with all other messages, default: %d)"), MAX_GOSSIP_THREADS, DEFAULT_GOSSIP_THREADS) + "\n";
     strUsage += "   dbwalletcache=<n>     " + _("Set wallet database cache size in megabytes (default: 1)") + "\n";
     strUsage += "   dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
     strUsage += "   timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
@@ -287,6 +308,7 @@ std::string HelpMessage()
     strUsage += "   bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
     strUsage += "   maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "   maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "   socketevents=<mode>   " + _("Socket readiness backend, epoll or select (default: epoll where available)") + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += "   upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n";
@@ -334,12 +356,19 @@ std::string HelpMessage()
     strUsage += "   upgradewallet         " + _("Upgrade wallet to latest format") + "\n";
     strUsage += "   createwalletbackups=<n> " + _("Number of automatic wallet backups (default: 10)") + "\n";
     strUsage += "   keypool=<n>           " + _("Set key pool size to <n> (default: 100) (litemode: 10)") + "\n";
+    strUsage += "   stakethreads=<n>      " + strprintf(_("Set the number of stake kernel search threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_STAKE_THREADS, DEFAULT_STAKE_THREADS) + "\n";
     strUsage += "   rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n";
     strUsage += "   salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
     strUsage += "   checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
     strUsage += "   checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
+    strUsage += "   checkblocksbackground " + strprintf(_("Verify the checkblocks after the node has started, at checklevel %d at most (default: 0)"), MAX_BACKGROUND_CHECKLEVEL) + "\n";
+    strUsage += "   blockindexsnapshot    " + _("Save the block index at shutdown and load it from there at the next startup (default: 1)") + "\n";
     strUsage += "   loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
+    strUsage += "   reindexaddr           " + _("Rebuild the address index from the blk000?.dat files on startup") + "\n";
     strUsage += "   maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "   maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "   mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the memory pool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
+    strUsage += "   headerssync           " + _("Download headers first and fetch blocks from several peers in parallel (default: 1)") + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "   blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -640,6 +669,20 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     fConfChange = GetBoolArg("confchange", false);
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    nGossipThreads = std::max(0, std::min((int)GetArg("-gossipthreads", DEFAULT_GOSSIP_THREADS), MAX_GOSSIP_THREADS));
+
+    fHeadersFirstSync = GetBoolArg("-headerssync", true);
+    fTxDBSync = GetBoolArg("-dbsync", false);
+
 #ifdef ENABLE_WALLET
     if (mapArgs.count("mininput"))
     {
@@ -679,6 +722,7 @@ printf("RGP init.cpp %s  \n", strDataDir );
 
     if (GetBoolArg("shrinkdebugfile", !fDebug))
         ShrinkDebugFile();
+    StartLogWriter();
 
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("Bank Society Gold version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
@@ -689,6 +733,20 @@ printf("RGP init.cpp %s  \n", strDataDir );
     LogPrintf("Used data directory %s\n", strDataDir);
     std::ostringstream strErrors;
 
+    InitSignatureCache();
+
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
+    if (nGossipThreads) {
+        LogPrintf("Using %u threads for gossip messages\n", nGossipThreads);
+        for (int i=0; i<nGossipThreads; i++)
+            threadGroup.create_thread(&ThreadGossipHandler);
+    }
+
     if (mapArgs.count("masternodepaymentskey")) // masternode payments priv key
     {
         if (!masternodePayments.SetPrivKey(GetArg("masternodepaymentskey", "")))
@@ -1035,6 +1093,20 @@ LogPrintf("RGP Debug 006g \n");
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    // Verify the top of the best chain now, or once the node is up with
+    // -checkblocksbackground. cs_main is free, which the checks need.
+    if (!GetBoolArg("-checkblocksbackground", false))
+    {
+        uiInterface.InitMessage(_("Verifying blocks..."));
+        if (!VerifyBestChain(GetArg("-checklevel", DEFAULT_CHECKLEVEL), GetArg("-checkblocks", DEFAULT_CHECKBLOCKS), false))
+            return InitError(_("Error loading block database"));
+        if (fRequestShutdown)
+        {
+            LogPrintf("Shutdown requested. Exiting.\n");
+            return false;
+        }
+    }
+
     if (GetBoolArg("printblockindex", false) || GetBoolArg("printblocktree", false))
     {
         PrintBlockTree();
@@ -1136,7 +1208,7 @@ LogPrintf("RGP Debug 006h \n");
         RegisterWallet(pwalletMain);
 
         CBlockIndex *pindexRescan = pindexBest;
-        if (GetBoolArg("rescan", false))
+        if (GetBoolArg("-rescan", false))
             pindexRescan = pindexGenesisBlock;
         else
         {
@@ -1154,6 +1226,9 @@ LogPrintf("RGP Debug 006h \n");
             nStart = GetTimeMillis();
             pwalletMain->ScanForWalletTransactions(pindexRescan, true);
             LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
+            // An interrupted rescan picks up from the wallet's best block next time
+            if (ShutdownRequested())
+                return false;
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
             nWalletDBUpdated++;
         }
@@ -1363,23 +1438,19 @@ printf("RGP DEBUG Init MasterNode IP  addr %s\n", MasterNode_Address.c_str() );
 
     RandAddSeedPerfmon();
 
-    // reindex addresses found in blockchain
-    if(GetBoolArg("reindexaddr", false))
+    // reindex addresses found in blockchain, or index them in the current format
+    bool fReindexAddr = GetBoolArg("-reindexaddr", false);
+    if (!fReindexAddr && GetBoolArg("-addrindex", true))
     {
-        uiInterface.InitMessage(_("Rebuilding address index..."));
-        CBlockIndex *pblockAddrIndex = pindexBest;
-	    CTxDB txdbAddr("rw");
-	
-        while ( pblockAddrIndex )
-	    {
-	          uiInterface.InitMessage(strprintf("Rebuilding address index, block %i", pblockAddrIndex->nHeight));
-	          bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
-	          CBlock pblockAddr;
-	          if ( pblockAddr.ReadFromDisk(pblockAddrIndex, true))
-	             pblockAddr.RebuildAddressIndex(txdbAddr);
-	             
-              pblockAddrIndex = pblockAddrIndex->pprev;
-	    }
+        int nAddrIndexVersion;
+        CTxDB txdbAddr("r");
+        fReindexAddr = !txdbAddr.ReadAddrIndexVersion(nAddrIndexVersion) || nAddrIndexVersion < ADDRINDEX_VERSION;
+    }
+    if (fReindexAddr && !ReindexAddresses())
+    {
+        if (ShutdownRequested())
+            return false;
+        return InitError(_("Error rebuilding the address index"));
     }
 
     //// debug print
@@ -1393,7 +1464,14 @@ printf("RGP DEBUG Init MasterNode IP  addr %s\n", MasterNode_Address.c_str() );
 
 //AddToWallet
 
-    StartNode(threadGroup);
+    scheduler = new CScheduler();
+    CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, scheduler);
+    threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
+
+    StartNode(threadGroup, *scheduler);
+
+    if (GetBoolArg("-checkblocksbackground", false))
+        threadGroup.create_thread(boost::bind(&ThreadVerifyBestChain, GetArg("-checklevel", DEFAULT_CHECKLEVEL), GetArg("-checkblocks", DEFAULT_CHECKBLOCKS)));
 #ifdef ENABLE_WALLET
     // InitRPCMining is needed here so getwork/getblocktemplate in the GUI debug console works properly.
     InitRPCMining();
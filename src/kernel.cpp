@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
 
 #include "kernel.h"
 #include "txdb.h"
@@ -357,6 +358,188 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
     return CheckStakeKernelHash(pindexPrev, nBits, block.GetBlockTime(), txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
 
+void PrepareStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, const COutPoint& prevout, int64_t nValueIn, CStakeKernel& kernel)
+{
+    kernel.prevout = prevout;
+    kernel.nTimeBlockFrom = nTimeBlockFrom;
+    kernel.nTimeTxPrev = nTimeTxPrev;
+
+    // Same weighted target as CheckStakeKernelHash. A target at or above
+    // 2^256 is met by every hash, so it saturates instead of overflowing.
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    bnTarget *= CBigNum(nValueIn);
+    if (bnTarget >= (CBigNum(1) << 256))
+        kernel.hashTarget = ~uint256(0);
+    else
+        kernel.hashTarget = bnTarget.getuint256();
+
+    // Serialize the fixed part exactly as CheckStakeKernelHash does, the
+    // last four bytes are filled in with each timestamp tried
+    CDataStream ss(SER_GETHASH, 0);
+    ss << pindexPrev->nStakeModifier << nTimeBlockFrom << nTimeTxPrev << prevout.hash << prevout.n << (unsigned int)0;
+    assert(ss.size() == sizeof(kernel.vchData));
+    memcpy(kernel.vchData, &ss[0], sizeof(kernel.vchData));
+}
+
+namespace {
+
+// Work shared by the threads of one SearchStakeKernels call
+struct CStakeSearch
+{
+    const CBlockIndex* pindexPrev;
+    const std::vector<CStakeKernel>* pvKernels;
+    unsigned int nTimeTx;
+    unsigned int nSteps;
+
+    boost::mutex mutex;
+    size_t nNext;              // next kernel to hand out
+    size_t nBest;              // lowest kernel with a hit so far
+    unsigned int nTimeBest;
+    uint256 hashBest;
+    uint64_t nTried;
+    bool fAbort;
+};
+
+// Kernels handed to a thread at a time
+static const size_t STAKE_SEARCH_BATCH = 64;
+
+CCriticalSection cs_stakestats;
+CStakeSearchStats stakestats = {};
+
+void StakeSearchThread(CStakeSearch* psearch)
+{
+    const std::vector<CStakeKernel>& vKernels = *psearch->pvKernels;
+    uint64_t nTried = 0;
+    while (true)
+    {
+        size_t nBegin, nEnd;
+        {
+            boost::unique_lock<boost::mutex> lock(psearch->mutex);
+            // Kernels after the best hit cannot change the result
+            if (psearch->fAbort || psearch->nNext >= std::min(psearch->nBest, vKernels.size()))
+                break;
+            if (psearch->pindexPrev != pindexBest)
+            {
+                psearch->fAbort = true;
+                break;
+            }
+            nBegin = psearch->nNext;
+            nEnd = std::min(nBegin + STAKE_SEARCH_BATCH, vKernels.size());
+            psearch->nNext = nEnd;
+        }
+
+        for (size_t i = nBegin; i < nEnd; i++)
+        {
+            CStakeKernel kernel = vKernels[i];
+            for (unsigned int n = 0; n < psearch->nSteps; n++)
+            {
+                unsigned int nTimeTx = psearch->nTimeTx - n;
+                // Timestamps only get smaller, so once the time checks of
+                // CheckKernel and CheckStakeKernelHash fail they keep failing
+                if (nTimeTx < kernel.nTimeTxPrev || kernel.nTimeBlockFrom + nStakeMinAge > nTimeTx)
+                    break;
+
+                memcpy(&kernel.vchData[52], &nTimeTx, sizeof(nTimeTx));
+                uint256 hashProofOfStake = Hash(BEGIN(kernel.vchData), END(kernel.vchData));
+                nTried++;
+                if (hashProofOfStake > kernel.hashTarget)
+                    continue;
+
+                boost::unique_lock<boost::mutex> lock(psearch->mutex);
+                if (i < psearch->nBest)
+                {
+                    psearch->nBest = i;
+                    psearch->nTimeBest = nTimeTx;
+                    psearch->hashBest = hashProofOfStake;
+                }
+                break;
+            }
+        }
+    }
+
+    boost::unique_lock<boost::mutex> lock(psearch->mutex);
+    psearch->nTried += nTried;
+}
+
+} // anon namespace
+
+int GetStakeSearchThreads()
+{
+    // -stakethreads=0 means autodetect, <0 leaves that many cores free
+    int nThreads = GetArg("-stakethreads", DEFAULT_STAKE_THREADS);
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    return std::max(1, std::min(nThreads, MAX_STAKE_THREADS));
+}
+
+bool SearchStakeKernels(const CBlockIndex* pindexPrev, const std::vector<CStakeKernel>& vKernels, unsigned int nTimeTx, unsigned int nSteps, int nThreads, int& nKernelRet, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet)
+{
+    int64_t nStart = GetTimeMicros();
+
+    CStakeSearch search;
+    search.pindexPrev = pindexPrev;
+    search.pvKernels = &vKernels;
+    search.nTimeTx = nTimeTx;
+    search.nSteps = nSteps;
+    search.nNext = 0;
+    search.nBest = vKernels.size();
+    search.nTimeBest = 0;
+    search.nTried = 0;
+    search.fAbort = false;
+
+    // Not worth starting threads for a handful of outputs
+    nThreads = std::max(1, std::min(nThreads, (int)((vKernels.size() + STAKE_SEARCH_BATCH - 1) / STAKE_SEARCH_BATCH)));
+    if (nThreads == 1)
+        StakeSearchThread(&search);
+    else
+    {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&StakeSearchThread, &search));
+        try {
+            threadGroup.join_all();
+        } catch (boost::thread_interrupted&) {
+            // The workers point into this stack frame, stop them before unwinding
+            {
+                boost::unique_lock<boost::mutex> lock(search.mutex);
+                search.fAbort = true;
+            }
+            threadGroup.join_all();
+            throw;
+        }
+    }
+
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    bool fFound = !search.fAbort && search.nBest < vKernels.size();
+    {
+        LOCK(cs_stakestats);
+        stakestats.nSearches++;
+        if (fFound)
+            stakestats.nKernelsFound++;
+        stakestats.nKernelsTried += search.nTried;
+        stakestats.nLastKernelsTried = search.nTried;
+        stakestats.nLastSearchMicros = nElapsed;
+        stakestats.nTotalSearchMicros += nElapsed;
+        stakestats.nLastThreads = nThreads;
+    }
+    LogPrint("coinstake", "SearchStakeKernels : %u kernels, %u hashes on %d threads in %dus\n", vKernels.size(), search.nTried, nThreads, nElapsed);
+
+    if (!fFound)
+        return false;
+
+    nKernelRet = search.nBest;
+    nTimeTxRet = search.nTimeBest;
+    hashProofOfStakeRet = search.hashBest;
+    return true;
+}
+
+void GetStakeSearchStats(CStakeSearchStats& stats)
+{
+    LOCK(cs_stakestats);
+    stats = stakestats;
+}
+
 
 bool CheckProofOfStakeMod ( const CBlock block, uint256& hashProofOfStake, std::unique_ptr< CStakeInput >& stake )
 {
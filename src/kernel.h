@@ -39,4 +39,46 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// Default and maximum number of threads used to search for a stake kernel
+static const int DEFAULT_STAKE_THREADS = 0;
+static const int MAX_STAKE_THREADS = 16;
+
+// Timestamp independent part of a stake kernel. Prepared once per staked
+// output so that trying a timestamp costs a single double SHA256 over a
+// fixed buffer instead of disk reads and a stream serialization.
+struct CStakeKernel
+{
+    COutPoint prevout;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTxPrev;
+    uint256 hashTarget;              // weighted target, saturated at 2^256-1
+    unsigned char vchData[56];       // modifier, block time, tx time, prevout, nTimeTx
+};
+
+// Fill in kernel for prevout, staked on top of pindexPrev
+void PrepareStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, const COutPoint& prevout, int64_t nValueIn, CStakeKernel& kernel);
+
+// Search the timestamps nTimeTx, nTimeTx-1, ... nTimeTx-nSteps+1 of every
+// kernel on up to nThreads threads. On success returns the first kernel in
+// vKernels with a hit, and its latest timestamp, the same result a serial
+// search in that order would produce. Gives up if pindexPrev stops being
+// the best block.
+bool SearchStakeKernels(const CBlockIndex* pindexPrev, const std::vector<CStakeKernel>& vKernels, unsigned int nTimeTx, unsigned int nSteps, int nThreads, int& nKernelRet, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet);
+
+// Number of threads -stakethreads asks for
+int GetStakeSearchThreads();
+
+struct CStakeSearchStats
+{
+    uint64_t nSearches;
+    uint64_t nKernelsFound;
+    uint64_t nKernelsTried;
+    uint64_t nLastKernelsTried;
+    int64_t nLastSearchMicros;
+    int64_t nTotalSearchMicros;
+    int nLastThreads;
+};
+
+void GetStakeSearchStats(CStakeSearchStats& stats);
+
 #endif // PPCOIN_KERNEL_H
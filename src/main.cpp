@@ -19,11 +19,14 @@
    ----------------------------------------------------------- */
 
 #include "main.h"
+#include <atomic>
+#include <deque>
 #include <iostream>
 #include <limits>
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "db.h"
@@ -41,6 +44,13 @@
 #include "smessage.h"
 #include "util.h"
 #include "rpcserver.h"
+#include "checkqueue.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -114,6 +124,14 @@ bool fImporting = false;
 bool fReindex = false;
 bool fAddrIndex = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
+int nGossipThreads = 0;
+std::atomic<uint64_t> nTxHashesComputed(0);
+std::atomic<uint64_t> nTxHashesCached(0);
+bool fHeadersFirstSync = true;
+
+// Signature checks handed off by ConnectBlock, run by the -par worker threads
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
 /* RGP, static Inventory structure using with AskFor()
    to request investory data                           */
@@ -225,15 +243,60 @@ struct CNodeState {
     // Whether this peer should be disconnected and banned.
     bool fShouldBan;
     std::string name;
+    // Number of blocks requested from this peer by the headers-first download.
+    int nBlocksInFlight;
+    // Whether a getheaders request to this peer is outstanding, and since when.
+    bool fHeadersRequested;
+    int64_t nHeadersRequestTime;
+    // Whether this peer has no further headers for us.
+    bool fHeadersDone;
+    // Last header of the header chain this peer sent us. Only peers that
+    // announced a header are asked for its block.
+    uint256 hashHeadersAnnounced;
+    // Compact block from this peer waiting on a blocktxn answer.
+    boost::shared_ptr<CPartiallyDownloadedBlock> pPartialBlock;
+    // Parent of the last compact block rebuilt from our pool for this peer.
+    uint256 hashLastCmpctBlockPrev;
 
     CNodeState() {
         nMisbehavior = 0;
         fShouldBan = false;
+        nBlocksInFlight = 0;
+        fHeadersRequested = false;
+        nHeadersRequestTime = 0;
+        fHeadersDone = false;
     }
 };
 
 map<NodeId, CNodeState> mapNodeState;
 
+// Headers-first synchronization state, protected by cs_main.
+// vHeadersChain holds the best validated header chain that is not yet fully
+// connected. Its front links to a block of the main chain. Block bodies are
+// requested for a window above pindexBest from the peers that announced the
+// headers, parked in mapBlocksDownloaded and connected in header chain order.
+struct CHeaderSyncEntry {
+    uint256 hash;
+    uint256 hashPrev;
+    int nHeight;
+    uint256 nChainTrust;
+};
+
+struct CBlockInFlight {
+    NodeId nodeid;
+    int64_t nTime;
+};
+
+std::deque<CHeaderSyncEntry> vHeadersChain;
+map<uint256, int> mapHeadersChainHeight;
+map<uint256, CBlockInFlight> mapBlocksInFlight;
+map<uint256, pair<NodeId, CBlock> > mapBlocksDownloaded;
+// Peer currently asked for headers, only one at a time
+NodeId nHeadersSyncNode = -1;
+// Height of the header chain tip, 0 if there is none. Also read without cs_main.
+int nHeadersTipHeight = 0;
+int64_t nHeadersSyncLastProgress = 0;
+
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
@@ -266,9 +329,41 @@ void InitializeNode(NodeId nodeid, const CNode *pnode) {
 
 void FinalizeNode(NodeId nodeid) {
     LOCK(cs_main);
+    // Hand the peer's outstanding block requests back to the download window
+    for (map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); )
+    {
+        if (it->second.nodeid == nodeid)
+            mapBlocksInFlight.erase(it++);
+        else
+            ++it;
+    }
+    if (nHeadersSyncNode == nodeid)
+        nHeadersSyncNode = -1;
     mapNodeState.erase(nodeid);
 }
 
+// Requires cs_main. Also used to release a block requested from a stalling peer.
+void MarkBlockAsReceived(const uint256& hash) {
+    map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.find(hash);
+    if (it == mapBlocksInFlight.end())
+        return;
+    CNodeState *state = State(it->second.nodeid);
+    if (state != NULL)
+        state->nBlocksInFlight--;
+    mapBlocksInFlight.erase(it);
+}
+
+// Requires cs_main.
+void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash) {
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+    CBlockInFlight inflight;
+    inflight.nodeid = nodeid;
+    inflight.nTime = GetTime();
+    mapBlocksInFlight[hash] = inflight;
+    state->nBlocksInFlight++;
+}
+
 }
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -277,6 +372,7 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     if (state == NULL)
         return false;
     stats.nMisbehavior = state->nMisbehavior;
+    stats.nBlocksInFlight = state->nBlocksInFlight;
     return true;
 }
 
@@ -382,7 +478,6 @@ uint256 randomhash;
         EraseOrphanTx(it->first);
         ++nEvicted;
 
-        MilliSleep(1); /* RGP Optimize */
 
     }
 
@@ -400,15 +495,12 @@ int read_status;
 
     //SetNull();
 
-MilliSleep(1);
 
     if (!txdb.ReadTxIndex(hash, txindexRet))
     {
-        MilliSleep( 5 );
         return false;
     }	
 
-    MilliSleep(1);
 
     read_status = false;
 
@@ -418,7 +510,6 @@ MilliSleep(1);
 
         read_status = ReadFromDisk(txindexRet.pos );
         read_status = true;
-        MilliSleep(1);
     }
     catch (std::ios_base::failure& e)
     {
@@ -451,7 +542,6 @@ LogPrintf("RGP CTransaction::ReadFromDisk Entry 004 %s HASH disk pos %d \n", has
 bool CTransaction::ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txindexRet)
 {
 
-    MilliSleep(1);
 
 
     if (!ReadFromDisk(txdb, prevout.hash, txindexRet))
@@ -936,10 +1026,50 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
 }
 
 
+// Coin age priority, sum(valuein * confirmations) / size. Inputs still in
+// the memory pool have no confirmations and are left out of nInChainValueRet.
+static double GetPriority(const CTxMemPool& pool, const CTransaction& tx, const MapPrevTx& inputs,
+                          unsigned int nTxSize, int64_t& nInChainValueRet)
+{
+    double dPriority = 0;
+    nInChainValueRet = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        MapPrevTx::const_iterator mi = inputs.find(txin.prevout.hash);
+        if (mi == inputs.end() || txin.prevout.n >= mi->second.second.vout.size() || pool.exists(txin.prevout.hash))
+            continue;
+        int64_t nValueIn = mi->second.second.vout[txin.prevout.n].nValue;
+        nInChainValueRet += nValueIn;
+        dPriority += (double)nValueIn * mi->second.first.GetDepthInMainChain();
+    }
+    return dPriority / nTxSize;
+}
+
+// Txids hashed and served from the cache while a transaction is accepted or
+// a block connected, logged under -debug=bench to show the hashing the cache
+// saves. The counters are process wide, hashing by other threads at the same
+// time shows up too.
+class CTxHashBench
+{
+private:
+    uint64_t nComputedStart;
+    uint64_t nCachedStart;
+
+public:
+    CTxHashBench() : nComputedStart(nTxHashesComputed), nCachedStart(nTxHashesCached) {}
+
+    void Log(const char* pszFunc, const uint256& hash) const
+    {
+        LogPrint("bench", "%s : %s, %u txids hashed, %u served from cache\n", pszFunc, hash.ToString(),
+                 nTxHashesComputed - nComputedStart, nTxHashesCached - nCachedStart);
+    }
+};
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
 {
 extern CTransaction other_copy;
+CTxHashBench hashBench;
 
     CTransaction test_tx(tx);        /* using a global now */
     other_copy = test_tx;
@@ -1100,6 +1230,14 @@ LogPrintf("RGP AcceptToMemoryPool, before FetchInputs \n");
                          hash.ToString(),
                          nFees, MIN_RELAY_TX_FEE * 10000);
 
+        int64_t nInChainValue;
+        double dPriority = GetPriority(pool, tx, mapInputs, nSize, nInChainValue);
+        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, pindexBest->nHeight, nInChainValue, nSigOps_Special);
+
+        // A full pool only takes transactions paying more per byte than the ones it would evict
+        if (!pool.HasRoomFor(entry, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000))
+            return error("AcceptToMemoryPool : mempool full, %s fee %d too low", hash.ToString(), nFees);
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS))
@@ -1120,10 +1258,18 @@ LogPrintf("RGP AcceptToMemoryPool, before FetchInputs \n");
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+
+        // Store transaction in memory
+        pool.addUnchecked(hash, entry);
     }
 
-    // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    int nExpired = pool.Expire(GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    if (nExpired)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", nExpired);
+    pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+    if (!pool.exists(hash))
+        return error("AcceptToMemoryPool : mempool full, %s evicted", hash.ToString());
+
     setValidatedTx.insert(hash);
 
     SyncWithWallets(tx, NULL);
@@ -1132,6 +1278,7 @@ LogPrintf("RGP AcceptToMemoryPool, before FetchInputs \n");
            hash.ToString(),
            pool.mapTx.size());
 
+    hashBench.Log("AcceptToMemoryPool()", hash);
     return true;
 }
 
@@ -1196,7 +1343,6 @@ LogPrintf("RGP AcceptableInputs tx(txo) %s \n", tx.ToString() );
                 return tx.DoS(0, error("AcceptableInputs : conflicts with existing transaction lock: %s", reason));
             }
         }
-        MilliSleep(1); /* RGP Optimise */
     }
 
     // Check for conflicts with in-memory transactions
@@ -1210,7 +1356,6 @@ LogPrintf("RGP AcceptableInputs tx(txo) %s \n", tx.ToString() );
             // Disable replacement feature for now
             return false;
         }
-        MilliSleep(1); /* RGP Optimise */
     }
     }
 
@@ -1663,39 +1808,31 @@ LogPrintf("RGP MAIN GetTransaction hash used is %s \n", hash.ToString() );
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
-{
-CBlockIndex *pblockindex;
-
-    if (nHeight < nBestHeight / 2)
-    {
-        pblockindex = pindexGenesisBlock;
-    }
-    else
-    {
-        pblockindex = pindexBest;
-    }
-
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-    {
-        pblockindex = pblockindexFBBHLast;
-    }
-    while (pblockindex->nHeight > nHeight)
-    {
-        pblockindex = pblockindex->pprev;
-        //MilliSleep(1); /* RGP Optimize */
-    }
+// Best chain by height, kept in step with pindexBest by SetBestChainHeightIndex()
+static CCriticalSection cs_vBestChain;
+static std::vector<CBlockIndex*> vBestChain;
 
-    while (pblockindex->nHeight < nHeight)
+void SetBestChainHeightIndex(CBlockIndex* pindexNew)
+{
+    LOCK(cs_vBestChain);
+    if (pindexNew == NULL)
     {
-        pblockindex = pblockindex->pnext;
-        //MilliSleep(1); /* RGP Optimize */
+        vBestChain.clear();
+        return;
     }
 
-    pblockindexFBBHLast = pblockindex;
+    // Only the heights above the fork with the previous best chain change
+    vBestChain.resize(pindexNew->nHeight + 1);
+    for (CBlockIndex* pindex = pindexNew; pindex && vBestChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBestChain[pindex->nHeight] = pindex;
+}
 
-    return pblockindex;
+CBlockIndex* FindBlockByHeight(int nHeight)
+{
+    LOCK(cs_vBestChain);
+    if (nHeight < 0 || nHeight >= (int)vBestChain.size())
+        return NULL;
+    return vBestChain[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1732,7 +1869,6 @@ uint256 static GetOrphanRoot(const uint256& hash)
         }
 
         it = it2;
-        MilliSleep(1); /* RGP Optimize */
 
     } while ( true );
 }
@@ -1743,7 +1879,6 @@ uint256 WantedByOrphan(const COrphanBlock* pblockOrphan)
     // Work back to the first block in the orphan chain
     while (mapOrphanBlocks.count(pblockOrphan->hashPrev))
     {
-        MilliSleep(1); /* RGP Optimize */
         pblockOrphan = mapOrphanBlocks[pblockOrphan->hashPrev];
     }
     return pblockOrphan->hashPrev;
@@ -1764,7 +1899,6 @@ void static PruneOrphanBlocks()
     while (pos--)
     {
         it++;
-        MilliSleep(1); /* RGP Optimize */
     }
 
     // As long as this block has other orphans depending on it, move to one of those successors.
@@ -1774,7 +1908,6 @@ void static PruneOrphanBlocks()
             break;
         it = it2;
 
-        MilliSleep(1); /* RGP Optimize */
 
     } while(1);
 
@@ -2124,7 +2257,6 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
         pindex = pindex->pprev;
 
     }
-    MilliSleep(1); /* RGP Optimize */
     return pindex;
 }
 
@@ -2368,7 +2500,7 @@ LogPrintf("RGP CTransaction::DisconnectInputs erasing TX index  \n");
    -------------------------------------------------------------------------- */
 
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const
 {
 uint256 hashblock;
 bool fFound = false;
@@ -2383,7 +2515,6 @@ extern CTransaction other_copy;
     // be dropped).  If tx is definitely invalid, fInvalid will be set to true.
     fInvalid = false;
 
-    MilliSleep(1); /* RGP Optimise */
 
     if (IsCoinBase())
     {
@@ -2420,7 +2551,6 @@ LogPrintf("RGP FetchInputs not found \n");
             continue;
         }
 
-        MilliSleep(5); /* RGP Optimise */
 
         /* RGP inputsRet[prevout.hash].second is failing as there is nothing in inputsRet */
         CTransaction& txPrev = inputsRet[prevout.hash].second;
@@ -2447,7 +2577,6 @@ LogPrintf("RGP FetchInputs Debug 003.1 \n");
                // Do nothing
                //LogPrintf("RGP Debug FetchInputs() %d fBlock %d fMiner BlockPos is ZERO FIX and Resolve \n", fBlock, fMiner);
 LogPrintf("RGP FetchInputs Debug 004xy \n");
-MilliSleep(1);
                continue; /* RGP Ignore */
                //return false;
                //return true;
@@ -2465,7 +2594,6 @@ MilliSleep(1);
             }
         }
 
-	MilliSleep(2); /* RGP Optimise */
     }
 
 
@@ -2495,7 +2623,6 @@ LogPrintf("RGP FetchInputs ReadTXIndex FAILED \n");
             continue;
         }
         
-        MilliSleep(2); /* RGP Optimise */
     }
 
     // LogPrintf("RGP Debug FetchInputs() Successfull \n");
@@ -2676,7 +2803,8 @@ CTxOut outputs;
        --------------------------------------------------------------------------------------- */
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig,
+    std::vector<CScriptCheck> *pvChecks) const
 {
 int error_filter = 0;
 
@@ -2791,13 +2919,15 @@ LogPrintf("RGP ConnectInputs Debug 004.2 \n");
                 }
 
            }
-           MilliSleep( 2 );
 
         }
 
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        // Inputs share one serialization of the transaction for their
+        // signature hashes, built the first time one is checked.
+        boost::shared_ptr<const CSignatureHashCache> pSigHashCache;
         for (unsigned int i = 0; i < vin.size(); i++)
         {
 //LogPrintf("RGP ConnectInputs Debug 006 \n");
@@ -2859,8 +2989,19 @@ LogPrintf("RGP ConnectInputs Debug 006.6 \n");
                 // still computed and checked, and any change will be caught at the next checkpoint.
                 if (!(fBlock && !IsInitialBlockDownload()))
                 {
+                    if (!pSigHashCache && vin.size() > 1)
+                        pSigHashCache.reset(new CSignatureHashCache(*this));
+
+                    // Defer to the caller's check queue; the non-mandatory retry below
+                    // only matters for mempool flags, which never come with pvChecks.
+                    if (pvChecks && prevout.n < txPrev.vout.size())
+                    {
+                        pvChecks->push_back(CScriptCheck());
+                        CScriptCheck check(txPrev, *this, i, flags, 0, pSigHashCache);
+                        check.swap(pvChecks->back());
+                    }
                     // Verify signature
-                    if (!VerifySignature(txPrev, *this, i, flags, 0))
+                    else if (!VerifySignature(txPrev, *this, i, flags, 0, pSigHashCache.get()))
                     {
 LogPrintf("RGP ConnectInputs Debug 006.7 \n");
                         if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
@@ -2909,7 +3050,6 @@ LogPrintf("RGP ConnectInputs Debug 006.8 \n");
                 mapTestPool[prevout.hash] = txindex;
             }
 
-            MilliSleep( 2 );
         }
 //LogPrintf("RGP ConnectInputs Debug 011 \n");
         if (!IsCoinStake())
@@ -2947,11 +3087,18 @@ LogPrintf("RGP ConnectInputs Debug 006.8 \n");
     return true;
 }
 
+static void GetBlockAddrIndexEntries(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex, std::vector<CAddrIndexEntry>& vEntries);
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
 
 LogPrintf("RGP Debug DisconnectBlock pindex %s \n ", pindex->ToString() );
 
+    // The spent transactions are still indexed before DisconnectInputs
+    std::vector<CAddrIndexEntry> vAddrEntries;
+    if (GetBoolArg("-addrindex", true))
+        GetBlockAddrIndexEntries(txdb, *this, pindex, vAddrEntries);
+
     // Disconnect in reverse order
     
 LogPrintf("RGP DEBUG DisconnectBlock check of DisconnectInputs logic %d vtx size \n", vtx.size() );
@@ -2981,6 +3128,11 @@ LogPrintf(" RGP Debug DisconnectBlock pindex->pprev is not zero \n");
         }
     }
 LogPrintf(" RGP Debug DisconnectBlock after write block index \n");
+
+    BOOST_FOREACH(const CAddrIndexEntry& entry, vAddrEntries)
+        if (!txdb.EraseAddrIndex(entry.key))
+            return error("DisconnectBlock() : EraseAddrIndex failed");
+
     // ppcoin: clean up wallet after disconnecting coinstake
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, false);
@@ -3034,49 +3186,68 @@ CBlockIndex* pblockindex;
 
 
 
+// Fill addrIds with the ids a script is indexed under: every push of at least
+// 8 bytes (padded, or hashed when longer than 20), or the hash of the script
+// itself when there is none. The pushes are read in place rather than copied
+// out through GetOp, and a truncated push resumes after its length prefix as
+// GetOp does, so the ids stay those written by earlier versions.
 bool static BuildAddrIndex(const CScript &script, std::vector<uint160>& addrIds)
 {
-CScript::const_iterator pc = script.begin();
-CScript::const_iterator pend = script.end();
-std::vector<unsigned char> data;
-opcodetype opcode;
-bool fHaveData = false;
-uint160 addrid = 0;
+    addrIds.clear();
 
+    CScript::const_iterator pc = script.begin();
+    CScript::const_iterator pend = script.end();
     while (pc < pend)
     {
-        script.GetOp(pc, opcode, data);
-        if (0 <= opcode && opcode <= OP_PUSHDATA4 && data.size() >= 8) { // data element
-            addrid = 0;
-            if (data.size() <= 20) {
-                memcpy(&addrid, &data[0], data.size());
-            } else {
-                addrid = Hash160(data);
-            }
-            addrIds.push_back(addrid);
-            fHaveData = true;
+        unsigned int opcode = *pc++;
+        if (opcode > OP_PUSHDATA4)
+            continue;
+
+        unsigned int nSize = 0;
+        if (opcode < OP_PUSHDATA1)
+            nSize = opcode;
+        else if (opcode == OP_PUSHDATA1)
+        {
+            if (pend - pc < 1)
+                continue;
+            nSize = *pc++;
+        }
+        else if (opcode == OP_PUSHDATA2)
+        {
+            if (pend - pc < 2)
+                continue;
+            memcpy(&nSize, &pc[0], 2);
+            pc += 2;
+        }
+        else
+        {
+            if (pend - pc < 4)
+                continue;
+            memcpy(&nSize, &pc[0], 4);
+            pc += 4;
         }
+        if ((unsigned int)(pend - pc) < nSize)
+            continue;
 
+        if (nSize >= 8)
+        {
+            uint160 addrid = 0;
+            if (nSize <= 20)
+                memcpy(&addrid, &pc[0], nSize);
+            else
+                addrid = Hash160(pc, pc + nSize);
+            addrIds.push_back(addrid);
+        }
+        pc += nSize;
     }
 
-    MilliSleep(1); /* RGP Optimize */
-
-    if (!fHaveData)
-    {
-        uint160 addrid = Hash160(script);
-        addrIds.push_back(addrid);
-        return true;
-    }
-    else
-    {
-    if(addrIds.size() > 0)
-        return true;
-    else
-        return false;
-    }
+    if (addrIds.empty())
+        addrIds.push_back(Hash160(script));
+    return true;
 }
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash) {
+bool FindTransactionsByDestination(const CTxDestination &dest, unsigned int nHeightStart, unsigned int nTxIndexStart, unsigned int nHeightEnd,
+                                   int nSkip, unsigned int nCount, std::vector<CAddrIndexEntry>& vEntries, bool& fMore) {
     uint160 addrid = 0;
     const CKeyID *pkeyid = boost::get<CKeyID>(&dest);
     if (pkeyid)
@@ -3092,9 +3263,8 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
         return false;
     }
 
-    LOCK(cs_main);
     CTxDB txdb("r");
-    if(!txdb.ReadAddrIndex(addrid, vtxhash))
+    if(!txdb.ReadAddrIndex(CAddrIndexKey(addrid, nHeightStart, nTxIndexStart), nHeightEnd, nSkip, nCount, vEntries, fMore))
     {
         LogPrintf("FindTransactionsByDestination(): txdb.ReadAddrIndex failed\n");
         return false;
@@ -3102,52 +3272,146 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
     return true;
 }
 
-void CBlock::RebuildAddressIndex(CTxDB& txdb)
+// Append the address index entries of a block to vEntries. A transaction is
+// filed under the ids of its outputs and of the outputs it spends. Inputs
+// whose previous output cannot be found are logged and left out, the index
+// is a lookup aid and must never stop a block from connecting.
+static void GetBlockAddrIndexEntries(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex, std::vector<CAddrIndexEntry>& vEntries)
 {
-    BOOST_FOREACH(CTransaction& tx, vtx)
+    std::vector<uint160> addrIds;
+    CTransaction txPrev;
+    uint256 hashPrev = 0;
+    unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        uint256 hashTx = tx.GetHash();
-        // inputs
-        if(!tx.IsCoinBase())
-        {
-            MapPrevTx mapInputs;
-            map<uint256, CTxIndex> mapQueuedChangesT;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-                return;
+        const CTransaction& tx = block.vtx[i];
+        CAddrIndexEntry entry(CAddrIndexKey(0, pindex->nHeight, i), tx.GetHash(), CDiskTxPos(pindex->nFile, pindex->nBlockPos, nTxPos));
+        nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
 
-            MapPrevTx::const_iterator mi;
-            for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
+        // Ids repeated within the transaction map to the same key, and LevelDB keeps one
+        if (!tx.IsCoinBase())
+        {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
             {
-                BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
+                if (txin.prevout.hash != hashPrev)
                 {
-                    std::vector<uint160> addrIds;
-                    if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                    {
-                        BOOST_FOREACH(uint160 addrId, addrIds)
-                        {
-                            if(!txdb.WriteAddrIndex(addrId, hashTx))
-                                LogPrintf("RebuildAddressIndex(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                        }
-                    }
+                    hashPrev = txin.prevout.hash;
+                    if (!txdb.ReadDiskTx(txin.prevout.hash, txPrev))
+                        LogPrint("addrindex", "GetBlockAddrIndexEntries() : %s spends unknown tx %s\n", entry.hashTx.ToString(), txin.prevout.hash.ToString());
+                }
+                if (txin.prevout.n >= txPrev.vout.size())
+                    continue;
+
+                BuildAddrIndex(txPrev.vout[txin.prevout.n].scriptPubKey, addrIds);
+                BOOST_FOREACH(const uint160& addrId, addrIds)
+                {
+                    entry.key.addrHash = addrId;
+                    vEntries.push_back(entry);
                 }
             }
         }
-        // outputs
-        BOOST_FOREACH(const CTxOut &atxout, tx.vout) {
-            std::vector<uint160> addrIds;
-            if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            BuildAddrIndex(txout.scriptPubKey, addrIds);
+            BOOST_FOREACH(const uint160& addrId, addrIds)
             {
-                BOOST_FOREACH(uint160 addrId, addrIds)
-                {
-                    if(!txdb.WriteAddrIndex(addrId, hashTx))
-                        LogPrintf("RebuildAddressIndex(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                }
+                entry.key.addrHash = addrId;
+                vEntries.push_back(entry);
             }
         }
     }
 }
 
+// Blocks handed out to the reindex workers at a time
+static const int ADDRINDEX_WINDOW = 1000;
+// Entries held in memory before they are written out
+static const size_t ADDRINDEX_FLUSH_ENTRIES = 2000000;
+
+// Reads and parses the blocks of a window, taking the next unclaimed slot
+// until none are left. Every worker writes only the slots it claimed.
+static void ThreadReindexAddresses(const std::vector<CBlockIndex*>* pvWindow,
+                                   std::vector<std::vector<CAddrIndexEntry> >* pvResults,
+                                   std::atomic<int>* pnNext)
+{
+    CTxDB txdb("r");
+    CBlock block;
+    int i;
+    while ((i = pnNext->fetch_add(1)) < (int)pvWindow->size())
+    {
+        if (!block.ReadFromDisk((*pvWindow)[i], true))
+        {
+            LogPrintf("ReindexAddresses() : cannot read block %d, not indexed\n", (*pvWindow)[i]->nHeight);
+            continue;
+        }
+        GetBlockAddrIndexEntries(txdb, block, (*pvWindow)[i], (*pvResults)[i]);
+    }
+}
+
+bool ReindexAddresses()
+{
+    // Keeps blocks from being connected, and indexed, underneath the loader
+    LOCK(cs_main);
+    if (pindexGenesisBlock == NULL)
+        return true;
+
+    LogPrintf("Rebuilding address index up to height %d\n", nBestHeight);
+    uiInterface.InitMessage(_("Rebuilding address index..."));
+    int64_t nStart = GetTimeMillis();
+
+    CTxDB txdb("r+");
+    if (!txdb.EraseAddrIndex())
+        return false;
+
+    int nThreads = std::max(nScriptCheckThreads, 1);
+    std::vector<CBlockIndex*> vWindow;
+    vWindow.reserve(ADDRINDEX_WINDOW);
+    std::vector<std::vector<CAddrIndexEntry> > vResults(ADDRINDEX_WINDOW);
+    std::vector<CAddrIndexEntry> vPending;
+    uint64_t nTotal = 0;
+
+    CBlockIndex* pindex = pindexGenesisBlock;
+    while (pindex)
+    {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            return false;
+
+        vWindow.clear();
+        for (; pindex && vWindow.size() < (size_t)ADDRINDEX_WINDOW; pindex = pindex->pnext)
+            vWindow.push_back(pindex);
+
+        std::atomic<int> nNext(0);
+        boost::thread_group workers;
+        for (int i = 0; i < nThreads; i++)
+            workers.create_thread(boost::bind(&ThreadReindexAddresses, &vWindow, &vResults, &nNext));
+        workers.join_all();
+
+        for (unsigned int i = 0; i < vWindow.size(); i++)
+        {
+            vPending.insert(vPending.end(), vResults[i].begin(), vResults[i].end());
+            nTotal += vResults[i].size();
+            std::vector<CAddrIndexEntry>().swap(vResults[i]);
+        }
+
+        if (vPending.size() >= ADDRINDEX_FLUSH_ENTRIES || pindex == NULL)
+        {
+            if (!txdb.WriteAddrIndexBatch(vPending))
+                return false;
+            vPending.clear();
+        }
+
+        int nHeight = vWindow.back()->nHeight;
+        uiInterface.InitMessage(strprintf(_("Rebuilding address index... (%d%%)"), nBestHeight > 0 ? nHeight * 100 / nBestHeight : 100));
+        LogPrint("addrindex", "ReindexAddresses() : indexed up to height %d, %u entries\n", nHeight, nTotal);
+    }
+
+    if (!txdb.WriteAddrIndexVersion(ADDRINDEX_VERSION))
+        return false;
+
+    LogPrintf("Rebuilt address index, %u entries in %dms\n", nTotal, GetTimeMillis() - nStart);
+    return true;
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
 int64_t nFees = 0;
@@ -3156,6 +3420,7 @@ int64_t long nValueOut = 0;
 int64_t nStakeReward = 0;
 unsigned int nSigOps = 0;
 int nInputs = 0;
+CTxHashBench hashBench;
 
 //LogPrintf("RGP CBlock::ConnectBlock() Start \n");
 
@@ -3180,6 +3445,7 @@ LogPrintf("RGP ConnectBlock CheckBlock failed \n");
     }
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
     nFees = 0;
     nValueIn = 0;
     nValueOut = 0;
@@ -3272,22 +3538,22 @@ LogPrintf("RGP ConnectBlock NOT COINSTAKE calculating fees %d nTxValueOut  %d nT
                 }
             }
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, true, nScriptCheckThreads ? &vChecks : NULL))
             {
                 if ( tx.vin.size() < 3 )
                     return false;
                 else
                     return true;
             }
+            control.Add(vChecks);
         }
 
         /* RGP what is this ? */
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
 
-        MilliSleep( 1 );
     }
 
-MilliSleep(1);
     /* PoW Validation against Acual and Calculated rewards */
 
     /* -------------------------------------------------------
@@ -3457,6 +3723,11 @@ MilliSleep(1);
     LogPrintf("RGP Moneysupply %d mint %d  \n", FormatMoney( pindex->nMoneySupply ), FormatMoney( pindex->nMint ) );
 
 #endif
+    // All queued signature checks must be done before the block is committed.
+    // A failure is only logged, the same as the serial path in ConnectInputs.
+    if (!control.Wait())
+        LogPrintf("ConnectBlock() : script verification failed for block %s\n", GetHash().ToString());
+
 //LogPrintf("RGP ConnectBlock Debug 010 \n");
     if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindex)))
         return error("Connect() : WriteBlockIndex for pindex failed");
@@ -3469,7 +3740,6 @@ MilliSleep(1);
     {
         if (!txdb.UpdateTxIndex((*mi).first, (*mi).second))
             return error("ConnectBlock() : UpdateTxIndex failed");
-        MilliSleep( 1 );
     }
 
     /* -------------------------------------------------------------------
@@ -3480,65 +3750,12 @@ MilliSleep(1);
     if(GetBoolArg("-addrindex", true))
     {
         // Write Address Index
-        BOOST_FOREACH(CTransaction& tx, vtx)
+        std::vector<CAddrIndexEntry> vAddrEntries;
+        GetBlockAddrIndexEntries(txdb, *this, pindex, vAddrEntries);
+        BOOST_FOREACH(const CAddrIndexEntry& entry, vAddrEntries)
         {
-
-            uint256 hashTx = tx.GetHash();
-            // inputs
-            if(!tx.IsCoinBase())
-            {
-
-                MapPrevTx mapInputs;
-                map<uint256, CTxIndex> mapQueuedChangesT;
-                bool fInvalid;
-
-                if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-                    return false;
-
-                MapPrevTx::const_iterator mi;
-                for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-                {
-                    BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-                    {
-
-                        std::vector<uint160> addrIds;
-                        if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                        {
-                            BOOST_FOREACH(uint160 addrId, addrIds)
-                            {
-                                if(!txdb.WriteAddrIndex(addrId, hashTx))
-                                    LogPrintf("ConnectBlock(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                                    
-                                MilliSleep( 1 );
-                            }
-                        }
-                        
-                        MilliSleep( 1 );
-                    }
-                    
-                    MilliSleep( 1 );
-                }
-            }
-
-            // outputs
-            BOOST_FOREACH(const CTxOut &atxout, tx.vout)
-            {
-
-                std::vector<uint160> addrIds;
-                if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                {
-
-                    BOOST_FOREACH(uint160 addrId, addrIds)
-                    {
-
-                        if(!txdb.WriteAddrIndex(addrId, hashTx))
-                            LogPrintf("ConnectBlock(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                        MilliSleep( 1 );
-                    }
-                }
-                MilliSleep( 2 );
-            }
-            MilliSleep( 2 );
+            if (!txdb.WriteAddrIndex(entry))
+                LogPrintf("ConnectBlock(): WriteAddrIndex failed addrId: %s txhash: %s\n", entry.key.addrHash.ToString(), entry.hashTx.ToString());
         }
     }
     else
@@ -3563,8 +3780,9 @@ MilliSleep(1);
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         SyncWithWallets(tx, this);
-        MilliSleep( 1 );
     }
+
+    hashBench.Log("ConnectBlock()", pindex->GetBlockHash());
     return true;
 }
 
@@ -3591,7 +3809,6 @@ LogPrintf("RGP Debug Reorganize entry pindexNew %s   \n",  pindexNew->ToString()
         /* Always true when called from Reorganize() */
         while (plonger->nHeight > pfork->nHeight)
         {
-            MilliSleep(1); /* RGP Optimize */
             if (!(plonger = plonger->pprev))
                 return error("Reorganize() : plonger->pprev is null");
         }
@@ -3607,7 +3824,6 @@ LogPrintf("RGP Debug Reorganize entry pindexNew %s   \n",  pindexNew->ToString()
         if (!(pfork = pfork->pprev))
             return error("Reorganize() : pfork->pprev is null");
 
-        MilliSleep(1); /* RGP Optimize */
     }
 
 LogPrintf("RGP debug Reorganize Debug 100 \n");
@@ -3713,7 +3929,7 @@ LogPrintf("RGP CTxIndex::GetDepthInMainChain before ReadFromDisk Debug 200 \n");
         return error("Reorganize() : WriteHashBestChain failed");
 
     // Make sure it's successfully written to disk before changing memory structure
-    if (!txdb.TxnCommit())
+    if (!txdb.TxnCommit(fTxDBSync))
         return error("Reorganize() : TxnCommit failed");
 
     // Disconnect shorter branch
@@ -3892,9 +4108,20 @@ LogPrintf("RGP DeleteBadBlock before ReadFromDisk Debug 200 \n");
 
 
 
+// The index record of a block that extends the best chain is written in the
+// batch that connects it. When that batch is abandoned or fails to commit,
+// write the record on its own so the block is still known after a restart.
+static void WriteBlockIndexOutsideTxn(CTxDB& txdb, CBlockIndex* pindexNew)
+{
+    txdb.TxnAbort();
+    if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew)))
+        LogPrintf("WriteBlockIndexOutsideTxn() : WriteBlockIndex failed for %s\n", pindexNew->GetBlockHash().ToString());
+}
+
 // Called from inside SetBestChain: attaches a block to the new best chain being built
 bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 {
+    int64_t nTimeStart = GetTimeMicros();
     uint256 hash = GetHash();
 
 //LogPrintf("RGP CBlock::SetBestChainInner Start hash %s \n", hash.ToString() );
@@ -3905,7 +4132,6 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
        -- create the file IO error?                                        --
        -- THIS CAUSED AN ERROR STOPPING AND RESTARTING, REMOVE THIS FIX    --
        ---------------------------------------------------------------------- */
-    MilliSleep(1); /* RGP Optimize */
 
     // Adding to current best branch
     if(!ConnectBlock(txdb, pindexNew) || !txdb.WriteHashBestChain(hash))
@@ -3914,18 +4140,17 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
         if ( !txdb.WriteHashBestChain(hash) )
         {
 
-           MilliSleep(2);
-           txdb.TxnAbort();
+           WriteBlockIndexOutsideTxn(txdb, pindexNew);
            InvalidChainFound(pindexNew);
 LogPrintf("RGP CBlock::SetBestChainInner failed to write best hash %s \n", hash.ToString() );
            return false;
         }
 
-        MilliSleep(1);
     }
     
-    if (!txdb.TxnCommit())
+    if (!txdb.TxnCommit(fTxDBSync))
     {
+        WriteBlockIndexOutsideTxn(txdb, pindexNew);
         return error("SetBestChainInner() : TxnCommit failed");
     }
 
@@ -3937,9 +4162,9 @@ LogPrintf("RGP CBlock::SetBestChainInner failed to write best hash %s \n", hash.
     {
 //LogPrintf("RGP SetBestChainInner remove Mempool %s \n", vtx.ToString() );
         mempool.remove(tx);
-        MilliSleep(1);
     }
 
+    LogPrint("bench", "SetBestChainInner() : connected block %d (%u txs) in %.2fms\n", pindexNew->nHeight, vtx.size(), (GetTimeMicros() - nTimeStart) * 0.001);
     return true;
 }
 
@@ -3969,18 +4194,29 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     }
 
     if (!txdb.TxnBegin())
+    {
+        WriteBlockIndexOutsideTxn(txdb, pindexNew);
         return error("SetBestChain() : TxnBegin failed");
+    }
+
+    // The index record of the new block is committed in the same batch as
+    // its tx index, address index and best chain updates
+    if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew)))
+    {
+        WriteBlockIndexOutsideTxn(txdb, pindexNew);
+        return error("SetBestChain() : WriteBlockIndex failed");
+    }
 
 //LogPrintf("RGP CBlock::SetBestChain Debug 002 \n");
 
-    MilliSleep(1);
 
     if (pindexGenesisBlock == NULL && hash == Params().HashGenesisBlock())
     { 
 
         txdb.WriteHashBestChain(hash);
-        if (!txdb.TxnCommit())
+        if (!txdb.TxnCommit(fTxDBSync))
         {
+            WriteBlockIndexOutsideTxn(txdb, pindexNew);
             return error("SetBestChain() : TxnCommit failed");
         }
         pindexGenesisBlock = pindexNew;
@@ -3997,7 +4233,6 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     {
 
 LogPrintf("RGP CBlock::SetBestChain Debug 003 \n");
-        MilliSleep(1);
 
         // the first block in the new chain that will cause it to become the new best chain
         CBlockIndex *pindexIntermediate = pindexNew;
@@ -4017,7 +4252,6 @@ LogPrintf("RGP CBlock::SetBestChain Debug 003 \n");
             if ( pindexIntermediate->ToString() == "5d7c9f594c3cd222e59ea68e902a60e66941f7aa0e72d44bb8bb2758971f9a41" )
             {
                // no Pushback
-               MilliSleep(1);
             }
             else
             {
@@ -4025,13 +4259,11 @@ LogPrintf("RGP CBlock::SetBestChain Debug 003 \n");
                vpindexSecondary.push_back(pindexIntermediate);
                pindexIntermediate = pindexIntermediate->pprev;
 //LogPrintf("RGP DEBUG SetBest Chain pindexIntermediate LOOP %s pindexIntermediate->pprev->nChainTrust %s pindexBest->nChainTrust \n", pindexIntermediate->pprev->nChainTrust.ToString(), pindexBest->nChainTrust.ToString() );
-               MilliSleep(1); /* RGP Optimize */
             
             }
         }
 
 LogPrintf("RGP CBlock::SetBestChain Debug 004 \n");
-        MilliSleep(2);
         
 	//
 	// RGP now it checks the size of vpindexSecondary
@@ -4050,7 +4282,6 @@ LogPrintf("RGP CBlock::SetBestChain Debug 004 \n");
             return false;
         }
       
-        MilliSleep(1);
 LogPrintf("RGP CBlock::SetBestChain Debug 006 \n");
         // Connect further blocks
         BOOST_REVERSE_FOREACH(CBlockIndex *pindex, vpindexSecondary)
@@ -4074,7 +4305,6 @@ LogPrintf("RGP CBlock::SetBestChain Debug 006 \n");
             if (!block.SetBestChainInner(txdb, pindex))
                 break;
             
-            MilliSleep(1);
         }
     }
 //LogPrintf("RGP CBlock::SetBestChain Debug 007 \n");
@@ -4087,12 +4317,11 @@ LogPrintf("RGP CBlock::SetBestChain Debug 006 \n");
         g_signals.SetBestChain(locator);
     }
 
-    MilliSleep(1);
 
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    SetBestChainHeightIndex(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -4105,7 +4334,6 @@ LogPrintf("RGP CBlock::SetBestChain Debug 006 \n");
 
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
     
-    MilliSleep(1);
 
     if (fDebug )
     {
@@ -4145,7 +4373,6 @@ LogPrintf("RGP CBlock::SetBestChain Debug 006 \n");
         boost::thread t(runCommand, strCmd); // thread runs free
     }
 
-    MilliSleep(1);
 
     return true;
 }
@@ -4222,7 +4449,6 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 
         PushGetBlocks(From_Node, pindexBest,  pindexBest->GetBlockHash() );
         
-        MilliSleep(5);
    
         return error("AddtoBlockIndex() : Invalid Block\n");
     }        
@@ -4258,7 +4484,6 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
     
-    MilliSleep(1);
     
     // Add to mapBlockIndex
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
@@ -4266,28 +4491,30 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
 
-    MilliSleep(2);
 
-    // Write to disk block index
+    // Write to disk block index, unless the block extends the best chain.
+    // SetBestChain then writes it in the same batch as the block's connect.
     CTxDB txdb;
-    if (!txdb.TxnBegin())
+    if (pindexNew->nChainTrust <= nBestChainTrust || hashPrevBlock != hashBestChain)
     {
-        LogPrintf("RGP AddToBlockIndex txdb Begin FAILED \n" );
+        if (!txdb.TxnBegin())
+        {
+            LogPrintf("RGP AddToBlockIndex txdb Begin FAILED \n" );
 
-        return false;
-    }
-   
-    txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
+            return false;
+        }
 
-    if (!txdb.TxnCommit())
-    {
+        txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
 
-        LogPrintf("RGP AddToBlockIndex TxnCommit failed \n" );
+        if (!txdb.TxnCommit())
+        {
 
-        return false;
+            LogPrintf("RGP AddToBlockIndex TxnCommit failed \n" );
+
+            return false;
+        }
     }
 
-    MilliSleep(1);
 
     // New best
     if (pindexNew->nChainTrust > nBestChainTrust)
@@ -4313,7 +4540,6 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     else
         LogPrintf("RGP AddToBlockIndex failed last check \n");
 
-    MilliSleep(1);
 //LogPrintf("RGP AddToBlockIndex END \n");
     return true;
 }
@@ -4605,7 +4831,6 @@ int array_entry_to_free;
         /* We have the new block, try to get blocks from pindexbest */        
         PushGetBlocks(From_Node, pindexBest, pindexBest->GetBlockHash() ); /* ask for again from best block */
         
-        MilliSleep( 5 );
 
         return error("AcceptBlock() : block already in mapBlockIndex");
         //return false;
@@ -4648,7 +4873,6 @@ int array_entry_to_free;
 
             //PushGetBlocks(From_Node, pindexBest, uint256(0) );
             // From_Node->fDisconnect = true;
-            MilliSleep( 2 );
 	        LogPrintf("RGP Can't find previous block %s current has %s current %s \n", current_previous_hash.ToString(), hash.ToString(), hashBestChain.ToString() );
             LogPrintf("RGP Sanity check pindex best is %s prevhash is %s \n", pindexBest->GetBlockHash().ToString(), current_previous_hash.ToString() );
 	    
@@ -4710,7 +4934,6 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
                  // last_block_time_check = 0;
 
                }
-               MilliSleep( 10 );
 
             }
 
@@ -4740,7 +4963,6 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
 		//LogPrintf("RGP hashBestChain is %s Height is %d \n \n \n", hashBestChain.ToString(), GetHeight() );
 
 
-		   MilliSleep(2);
 	    }       
 	    else
 	    {
@@ -4758,7 +4980,6 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
 	    }
    }
 
-   MilliSleep(5);
 
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
     CBlockIndex* pindexPrev = (*mi).second;
@@ -4789,7 +5010,6 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
         return false;
     }
 
-    MilliSleep(2);
 
     if (IsProofOfStake() && nHeight < Params().POSStartBlock())
         return DoS(100, error("AcceptBlock() : reject proof-of-stake at height <= %d", nHeight));
@@ -4815,7 +5035,6 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
 
     }
 
-    MilliSleep(2);
     
     // Check proof-of-work or proof-of-stake
     if (nBits != GetNextTargetRequired(pindexPrev, IsProofOfStake()) && hash != uint256("0x474619e0a58ec88c8e2516f8232064881750e87acac3a416d65b99bd61246968") && hash != uint256("0x4f3dd45d3de3737d60da46cff2d36df0002b97c505cdac6756d2d88561840b63") && hash != uint256("0x274996cec47b3f3e6cd48c8f0b39c32310dd7ddc8328ae37762be956b9031024"))
@@ -4834,7 +5053,6 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
         return false;
     }
 
-    MilliSleep(1);
 
     // Check that all transactions are finalized
     BOOST_FOREACH(const CTransaction& tx, vtx)
@@ -4842,14 +5060,12 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
         if (!IsFinalTx(tx, nHeight, GetBlockTime()))
             return DoS(10, error("AcceptBlock() : contains a non-final transaction"));
 
-        MilliSleep(1);
     }
 
     // Check that the block chain matches the known block chain up to a checkpoint
     if (!Checkpoints::CheckHardened(nHeight, hash))
         return DoS(100, error("AcceptBlock() : rejected by hardened checkpoint lock-in at %d", nHeight));
 
-    MilliSleep(1);
 
     // Verify hash target and signature of coinstake tx
     // ------------------------------------------------------------------------
@@ -4927,7 +5143,6 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
         }
 
         //LogPrintf("RGP IsProofOfStake current hash being processed %s \n",  hash.ToString() );
-        MilliSleep(2);
 
        
         
@@ -4949,7 +5164,6 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
         if ( pindexPrev->IsProofOfWork() )
         {
  
-            MilliSleep(5);
         }
         else
         {
@@ -4960,22 +5174,18 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
             if ( vtx.size() > 1 )
             {
                 //LogPrintf("RGP Previous block Valid vtx size \n");
-                MilliSleep( 5 );
             }
             else
             {
                 //LogPrintf("RGP Previous block INVALID vtx size %d \n", vtx.size());
-                MilliSleep( 5 );
                 return false;
             }
             uint256 targetProofOfStake;
             //LogPrintf("Current hash to process > %s \n",  hash.ToString() );
-            MilliSleep( 5 );
 
         }
        
        // LogPrintf("RGP AcceptBlock VerifySignature Success \n");
-       MilliSleep( 5 );
  
     }
 
@@ -4998,7 +5208,6 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
         !std::equal(expect.begin(), expect.end(), vtx[0].vin[0].scriptSig.begin()))
         return DoS(100, error("AcceptBlock() : block height mismatch in coinbase"));
         
-    MilliSleep(1);
 
     // Write block to history file
     if (!CheckDiskSpace(::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION)))
@@ -5029,7 +5238,6 @@ LogPrintf("RGP AcceptBlock check for 5 new blocks until undating \n");
 LogPrintf("RGP CANDIDATE Hash written %s \n", hash.ToString() );    
     //last_block_time_check = 0; /* zero this check, as a block was just written to the chain */
 
-    MilliSleep(5);
 
     if (!AddToBlockIndex(nFile, nBlockPos, hashProof))
     {
@@ -5041,16 +5249,21 @@ LogPrintf("RGP CANDIDATE Hash written %s \n", hash.ToString() );
         return false;
     }
 
-    MilliSleep(1);
 
     // Relay inventory, but don't relay old inventory during initial block download
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     
-    MilliSleep(1);
 
     if (hashBestChain == hash)
     {
- 
+        // Peers on the compact block protocol get the block pushed as short
+        // ids straight away, saving the inv/getdata round trip and most of
+        // the transaction bytes they already hold in their pool
+        boost::shared_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+        if (vtx.size() <= CBlockHeaderAndShortTxIDs::MAX_TXS)
+            pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*this));
+        CInv inv(MSG_BLOCK, hash);
+
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
         {
@@ -5058,8 +5271,13 @@ LogPrintf("RGP CANDIDATE Hash written %s \n", hash.ToString() );
             // Push Inventory to CNode
             if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
             {
-
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+                if (pcmpctblock && pnode->nVersion >= COMPACT_BLOCKS_VERSION)
+                {
+                    if (pnode->AddInventoryKnownIfNew(inv))
+                        pnode->PushMessage("cmpctblock", *pcmpctblock);
+                }
+                else
+                    pnode->PushInventory(inv);
             }
 
             // Push Inventory Height to CNode Data Cache
@@ -5068,12 +5286,10 @@ LogPrintf("RGP CANDIDATE Hash written %s \n", hash.ToString() );
                 pnode->nSyncHeight = nHeight;
             }
             
-            MilliSleep( 1 );
         }
 
     }
 
-    MilliSleep(2);
 
     return true;
 }
@@ -5089,11 +5305,42 @@ uint256 CBlockIndex::GetBlockTrust() const
     return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
 }
 
+// True while the header chain is ahead of the best block and the blocks are
+// fetched by the headers-first download rather than by getblocks/inv.
+static bool IsHeadersSyncActive()
+{
+    return fHeadersFirstSync && nHeadersTipHeight > nBestHeight;
+}
+
+// Height of the last header chain entry the peer announced, 0 if none of the
+// current header chain came from it. Requires cs_main.
+static int GetHeadersAnnouncedHeight(const CNodeState* state)
+{
+    map<uint256, int>::iterator mi = mapHeadersChainHeight.find(state->hashHeadersAnnounced);
+    if (mi == mapHeadersChainHeight.end())
+        return 0;
+    return (*mi).second;
+}
+
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
 {
 static char filter_counter = 0;
 static bool tester = true;
 
+    // Don't solicit inventories from a peer the headers-first download is
+    // fetching blocks from. The header chain above the first proof-of-stake
+    // height is unverified, so other peers are still asked.
+    if (IsHeadersSyncActive())
+    {
+        TRY_LOCK(cs_main, lockMain);
+        if (lockMain)
+        {
+            CNodeState *state = State(pnode->GetId());
+            if (state != NULL && GetHeadersAnnouncedHeight(state) > nBestHeight)
+                return;
+        }
+    }
+
     if (tester == true )
     {
 
@@ -5141,23 +5388,394 @@ static bool tester = true;
 
 }
 
-bool static IsCanonicalBlockSignature(CBlock* pblock)
+// Drop the header chain from nHeight upwards, together with the bodies
+// downloaded for it.
+static void TruncateHeadersChain(int nHeight)
 {
-    if (pblock->IsProofOfWork()) {
-        return pblock->vchBlockSig.empty();
+    AssertLockHeld(cs_main);
+    while (!vHeadersChain.empty() && vHeadersChain.back().nHeight >= nHeight)
+    {
+        mapHeadersChainHeight.erase(vHeadersChain.back().hash);
+        mapBlocksDownloaded.erase(vHeadersChain.back().hash);
+        vHeadersChain.pop_back();
     }
+    nHeadersTipHeight = vHeadersChain.empty() ? 0 : vHeadersChain.back().nHeight;
+}
 
-    return IsDERSignature(pblock->vchBlockSig, false);
+// Forget headers whose blocks are connected. If the chain no longer links to
+// pindexBest the main chain moved elsewhere and the headers are discarded.
+static void PruneHeadersChain()
+{
+    AssertLockHeld(cs_main);
+    while (!vHeadersChain.empty() && vHeadersChain.front().nHeight <= nBestHeight)
+    {
+        mapHeadersChainHeight.erase(vHeadersChain.front().hash);
+        mapBlocksDownloaded.erase(vHeadersChain.front().hash);
+        vHeadersChain.pop_front();
+    }
+    if (!vHeadersChain.empty() && vHeadersChain.front().hashPrev != hashBestChain)
+    {
+        LogPrintf("headers sync: header chain no longer extends best block %s, discarding it\n", hashBestChain.ToString());
+        TruncateHeadersChain(0);
+    }
+    if (vHeadersChain.empty())
+    {
+        mapBlocksDownloaded.clear();
+        nHeadersTipHeight = 0;
+    }
 }
 
-void Misbehaving(NodeId pnode, int howmuch)
+// Proof check for a header without its body. Blocks below the first
+// proof-of-stake height must meet their proof-of-work target. Above it a
+// header that misses its target is taken as proof-of-stake: the kernel needs
+// the coinstake and is checked by AcceptBlock, only the target range is
+// checked here.
+static bool CheckHeaderProof(const CBlock& header, const uint256& hash, int nHeight)
 {
-    if (howmuch == 0)
-        return;
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    if (bnTarget <= 0)
+        return false;
 
-    CNodeState *state = State(pnode);
-    if (state == NULL)
-        return;
+    if (bnTarget <= Params().ProofOfWorkLimit() && hash <= bnTarget.getuint256())
+        return true;
+
+    if (nHeight < Params().POSStartBlock())
+        return false;
+
+    return bnTarget <= bnProofOfStakeLimit;
+}
+
+// Validate a batch of headers and splice it into the header chain. A batch
+// forking off the current header chain replaces it only if it has more
+// cumulative trust, and any header chain needs more trust than the best chain.
+static bool AcceptHeaders(CNode* pfrom, const vector<CBlock>& vHeaders)
+{
+    AssertLockHeld(cs_main);
+
+    if (vHeaders.empty())
+        return true;
+
+    // Find the block the batch attaches to
+    const uint256 hashFirstPrev = vHeaders[0].hashPrevBlock;
+    int nHeight;
+    uint256 nChainTrust;
+    map<uint256, int>::iterator mi = mapHeadersChainHeight.find(hashFirstPrev);
+    if (mi != mapHeadersChainHeight.end())
+    {
+        nHeight = (*mi).second + 1;
+        nChainTrust = vHeadersChain[(*mi).second - vHeadersChain.front().nHeight].nChainTrust;
+    }
+    else
+    {
+        map<uint256, CBlockIndex*>::iterator bi = mapBlockIndex.find(hashFirstPrev);
+        if (bi == mapBlockIndex.end() || !(*bi).second->IsInMainChain())
+            return error("AcceptHeaders() : headers from %s do not connect to our chain", pfrom->addr.ToString());
+        nHeight = (*bi).second->nHeight + 1;
+        nChainTrust = (*bi).second->nChainTrust;
+    }
+
+    vector<CHeaderSyncEntry> vNew;
+    vNew.reserve(vHeaders.size());
+    uint256 hashPrev = hashFirstPrev;
+    int64_t nMaxTime = FutureDrift(GetAdjustedTime());
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+    {
+        uint256 hash = header.GetHash();
+        if (header.hashPrevBlock != hashPrev)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("AcceptHeaders() : non-continuous headers sequence from %s", pfrom->addr.ToString());
+        }
+        if (header.GetBlockTime() > nMaxTime)
+            return error("AcceptHeaders() : header %s timestamp too far in the future", hash.ToString());
+        if (!Checkpoints::CheckHardened(nHeight, hash))
+        {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("AcceptHeaders() : header %s rejected by checkpoint at height %d", hash.ToString(), nHeight);
+        }
+        if (!CheckHeaderProof(header, hash, nHeight))
+        {
+            Misbehaving(pfrom->GetId(), 50);
+            return error("AcceptHeaders() : header %s at height %d has invalid proof", hash.ToString(), nHeight);
+        }
+
+        // Same trust as CBlockIndex::GetBlockTrust, CheckHeaderProof ensured a positive target
+        CBigNum bnTarget;
+        bnTarget.SetCompact(header.nBits);
+        nChainTrust += ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+
+        CHeaderSyncEntry entry;
+        entry.hash = hash;
+        entry.hashPrev = hashPrev;
+        entry.nHeight = nHeight;
+        entry.nChainTrust = nChainTrust;
+        vNew.push_back(entry);
+
+        hashPrev = hash;
+        nHeight++;
+    }
+
+    const uint256 nHeadersTipTrust = vHeadersChain.empty() ? 0 : vHeadersChain.back().nChainTrust;
+    if (nChainTrust > nHeadersTipTrust && nChainTrust > nBestChainTrust)
+    {
+        TruncateHeadersChain(vNew.front().nHeight);
+        if (!vHeadersChain.empty() && vHeadersChain.back().hash != hashFirstPrev)
+            TruncateHeadersChain(0);
+        BOOST_FOREACH(const CHeaderSyncEntry& entry, vNew)
+        {
+            vHeadersChain.push_back(entry);
+            mapHeadersChainHeight[entry.hash] = entry.nHeight;
+        }
+        nHeadersTipHeight = vNew.back().nHeight;
+        nHeadersSyncLastProgress = GetTime();
+        PruneHeadersChain();
+
+        LogPrint("net", "headers sync: header chain now at height %d (peer %s)\n", nHeadersTipHeight, pfrom->addr.ToString());
+    }
+
+    // Remember how far into the header chain this peer can serve blocks
+    CNodeState *state = State(pfrom->GetId());
+    mi = mapHeadersChainHeight.find(vNew.back().hash);
+    if (state != NULL && mi != mapHeadersChainHeight.end() && (*mi).second > GetHeadersAnnouncedHeight(state))
+        state->hashHeadersAnnounced = vNew.back().hash;
+    return true;
+}
+
+// Ask a peer for the headers following our header chain tip
+static void PushGetHeaders(CNode* pnode)
+{
+    AssertLockHeld(cs_main);
+
+    vector<uint256> vHave;
+    int nStep = 1;
+    for (int i = (int)vHeadersChain.size() - 1; i >= 0; i -= nStep)
+    {
+        vHave.push_back(vHeadersChain[i].hash);
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    const CBlockIndex* pindex = pindexBest;
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back(Params().HashGenesisBlock());
+
+    CNodeState *state = State(pnode->GetId());
+    state->fHeadersRequested = true;
+    state->nHeadersRequestTime = GetTime();
+    nHeadersSyncNode = pnode->GetId();
+
+    pnode->PushMessage("getheaders", CBlockLocator(vHave), uint256(0));
+}
+
+// Handle a "headers" reply: extend the header chain and keep asking the same
+// peer while it returns full batches.
+static void ProcessHeaders(CNode* pfrom, const vector<CBlock>& vHeaders)
+{
+    AssertLockHeld(cs_main);
+
+    CNodeState *state = State(pfrom->GetId());
+    if (state == NULL)
+        return;
+    state->fHeadersRequested = false;
+    if (nHeadersSyncNode == pfrom->GetId())
+        nHeadersSyncNode = -1;
+
+    if (AcceptHeaders(pfrom, vHeaders) && vHeaders.size() == MAX_HEADERS_RESULTS && nHeadersSyncNode == -1)
+        PushGetHeaders(pfrom);
+    else
+        state->fHeadersDone = true;
+}
+
+// Connect downloaded bodies in header chain order, starting above pindexBest
+static void ConnectDownloadedBlocks(CNode* pfrom)
+{
+    AssertLockHeld(cs_main);
+
+    PruneHeadersChain();
+    while (!vHeadersChain.empty())
+    {
+        const CHeaderSyncEntry entry = vHeadersChain.front();
+        if (entry.hashPrev != hashBestChain)
+            break;
+
+        map<uint256, pair<NodeId, CBlock> >::iterator it = mapBlocksDownloaded.find(entry.hash);
+        if (it == mapBlocksDownloaded.end())
+            break;
+
+        NodeId nodeid = (*it).second.first;
+        CBlock block;
+        std::swap(block, (*it).second.second);
+        mapBlocksDownloaded.erase(it);
+
+        From_Node = pfrom;
+        bool fAccepted = false;
+        try
+        {
+            fAccepted = block.AcceptBlock();
+        }
+        catch (boost::thread_interrupted)
+        {
+            throw;
+        }
+        catch (std::exception& e)
+        {
+            PrintExceptionContinue(&e, "ConnectDownloadedBlocks()");
+        }
+
+        if (!fAccepted || hashBestChain != entry.hash)
+        {
+            if (block.nDoS)
+                Misbehaving(nodeid, block.nDoS);
+            LogPrintf("headers sync: block %s at height %d was not connected, dropping the headers above it\n", entry.hash.ToString(), entry.nHeight);
+            TruncateHeadersChain(entry.nHeight);
+            break;
+        }
+
+        nHeadersSyncLastProgress = GetTime();
+        if (fSecMsgEnabled)
+            SecureMsgScanBlock(block);
+
+        PruneHeadersChain();
+    }
+}
+
+// A block body requested by the headers-first download has arrived
+static void ProcessHeadersSyncBlock(CNode* pfrom, const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+
+    uint256 hash = block.GetHash();
+    MarkBlockAsReceived(hash);
+    mapAlreadyAskedFor.erase(CInv(MSG_BLOCK, hash));
+
+    if (mapBlockIndex.count(hash) || !mapHeadersChainHeight.count(hash))
+        return;
+
+    mapBlocksDownloaded.insert(make_pair(hash, make_pair(pfrom->GetId(), block)));
+    ConnectDownloadedBlocks(pfrom);
+}
+
+// Drive headers-first synchronization for one peer: request headers, release
+// blocks the peer is stalling on and fill its download slots from the window
+// above pindexBest. Called from SendMessages, which does not hold cs_main.
+static void SendHeadersSyncMessages(CNode* pto)
+{
+    if (!fHeadersFirstSync || fImporting || fReindex || pto->fClient || pto->fDisconnect)
+        return;
+
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain)
+        return;
+
+    CNodeState *state = State(pto->GetId());
+    if (state == NULL)
+        return;
+
+    int64_t nNow = GetTime();
+
+    // Headers
+    if (state->fHeadersRequested && nNow - state->nHeadersRequestTime > HEADERS_RESPONSE_TIMEOUT)
+    {
+        LogPrintf("headers sync: %s did not answer getheaders\n", pto->addr.ToString());
+        state->fHeadersRequested = false;
+        state->fHeadersDone = true;
+        if (nHeadersSyncNode == pto->GetId())
+            nHeadersSyncNode = -1;
+    }
+    // Every peer ahead of us is asked once, a shorter header chain may still
+    // carry more trust than ours
+    if (nHeadersSyncNode == -1 && !state->fHeadersDone && pto->nStartingHeight > nBestHeight)
+        PushGetHeaders(pto);
+
+    // The legacy block path may have connected some of the blocks meanwhile
+    PruneHeadersChain();
+    if (!IsHeadersSyncActive())
+        return;
+
+    // Only peers that announced the header chain are asked for its blocks
+    int nAnnouncedHeight = GetHeadersAnnouncedHeight(state);
+
+    if (nNow - nHeadersSyncLastProgress > HEADERS_SYNC_GIVEUP_TIMEOUT)
+    {
+        LogPrintf("headers sync: no progress for %d seconds, falling back to getblocks\n", nNow - nHeadersSyncLastProgress);
+        TruncateHeadersChain(0);
+        return;
+    }
+
+    // Stalling: release blocks outstanding for too long. If the block the
+    // window waits on is among them the peer is holding everyone back.
+    if (state->nBlocksInFlight > 0)
+    {
+        vector<uint256> vStalled;
+        for (map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); ++it)
+        {
+            if ((*it).second.nodeid == pto->GetId() && nNow - (*it).second.nTime > BLOCK_STALLING_TIMEOUT)
+                vStalled.push_back((*it).first);
+        }
+
+        bool fStallingWindow = false;
+        BOOST_FOREACH(const uint256& hash, vStalled)
+        {
+            MarkBlockAsReceived(hash);
+            map<uint256, int>::iterator mi = mapHeadersChainHeight.find(hash);
+            if (mi != mapHeadersChainHeight.end() && (*mi).second == nBestHeight + 1 && (*mi).second <= nAnnouncedHeight)
+                fStallingWindow = true;
+        }
+
+        if (fStallingWindow)
+        {
+            LogPrintf("headers sync: %s is stalling block download, disconnecting\n", pto->addr.ToString());
+            pto->fDisconnect = true;
+            return;
+        }
+        if (!vStalled.empty())
+            LogPrint("net", "headers sync: released %u stalled block requests from %s\n", vStalled.size(), pto->addr.ToString());
+    }
+
+    // Download window
+    if (state->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER || nAnnouncedHeight <= nBestHeight)
+        return;
+
+    int nWindowEnd = min(nAnnouncedHeight, nBestHeight + BLOCK_DOWNLOAD_WINDOW);
+
+    vector<CInv> vGetData;
+    for (std::deque<CHeaderSyncEntry>::const_iterator it = vHeadersChain.begin();
+         it != vHeadersChain.end() && (*it).nHeight <= nWindowEnd && state->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER; ++it)
+    {
+        const uint256& hash = (*it).hash;
+        if (mapBlocksInFlight.count(hash) || mapBlocksDownloaded.count(hash) || mapBlockIndex.count(hash))
+            continue;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        MarkBlockAsInFlight(pto->GetId(), hash);
+    }
+    if (!vGetData.empty())
+        pto->PushMessage("getdata", vGetData);
+}
+
+bool static IsCanonicalBlockSignature(CBlock* pblock)
+{
+    if (pblock->IsProofOfWork()) {
+        return pblock->vchBlockSig.empty();
+    }
+
+    return IsDERSignature(pblock->vchBlockSig, false);
+}
+
+void Misbehaving(NodeId pnode, int howmuch)
+{
+    if (howmuch == 0)
+        return;
+
+    CNodeState *state = State(pnode);
+    if (state == NULL)
+        return;
 
     state->nMisbehavior += howmuch;
     if (state->nMisbehavior >= GetArg("-banscore", 100))
@@ -5241,7 +5859,6 @@ map < uint256, CBlock > Match_Block_Map;
     	LogPrintf("mapBlockIndex.size() = %u\n",   mapBlockIndex.size());
     }
     filter++;
-    MilliSleep(1);
     //LogPrintf("*** ProcessBlock POW MINING STARTED \n");
 
 
@@ -5268,12 +5885,10 @@ map < uint256, CBlock > Match_Block_Map;
         //LogPrintf("^");
         //}
 
-        MilliSleep(5);
         return false;
     }
 
 
-    MilliSleep(1);   
     if ( fRequestShutdown )
     {
        LogPrintf("\n\nBank Society Gold, AcceptBlock processing, SHUTDOWN detected \n");
@@ -5410,7 +6025,6 @@ LogPrintf("\nRGP buffer size should be 30 is  %d \n", SYNCH_BLOCK_BUFFER_SIZE );
 //LogPrintf("RGP ProcessBlock buffer entries processing and clearing  Buffer_entries %d hash %s \n",  Buffer_entries, Block_Checker[ block_test ].GetHash().ToString() ); 
 //                   }                 
             
-        MilliSleep(1);
         }
  
    }
@@ -5452,7 +6066,6 @@ LogPrintf("\nRGP buffer size should be 30 is  %d \n", SYNCH_BLOCK_BUFFER_SIZE );
            
         }
 
-        MilliSleep( 1 );
     }
 
 /* See what is in the block checker array, it should be filled */
@@ -5497,7 +6110,6 @@ LogPrintf("\n");
                 /* Blank Block */
                 LogPrintf("RGP Blank Block %s \n", Block_Checker[ block_test ].GetHash().ToString() );
                 Block_Checker[ block_test ] = blank_block;
-                MilliSleep( 1 );
                 continue;
             }
             else
@@ -5519,7 +6131,6 @@ LogPrintf("RGP ProcessBlock Block_Checker Time  difference %d \n", test_time   )
                     {
                         LogPrintf("RGP ProcessBlock time too far %d \n", pindexBest->nTime - Block_Checker[ block_test ].nTime );
                         Block_Checker[ block_test ] = blank_block;
-                        MilliSleep( 1 );
                         continue;
                     }
                 }
@@ -5535,7 +6146,6 @@ LogPrintf("RGP ProcessBlock Block_Checker Time  difference %d \n", test_time   )
 /* RGP ADD CODE FOR A NULL RECORD */
 LogPrintf("RGP NULL Block found, REMOVING \n");
                 Block_Checker[ block_test ] = blank_block;
-                MilliSleep( 1 );
                 continue;
             }
 
@@ -5573,7 +6183,6 @@ LogPrintf("RGP NULL Block found, REMOVING \n");
 
                     block_matches++;
                     random_count_of_new_blocks++;
-                    MilliSleep(2);
                 }
  
             }
@@ -5587,7 +6196,6 @@ LogPrintf("RGP NULL Block found, REMOVING \n");
                 }
 
             }
-            MilliSleep(2);
         }
 
 //LogPrintf("RGP ProcessBlock block match  marked_entries %d array contents %d \n", marked_entries , marked_blocks_for_processing[ marked_entries ] );
@@ -5659,7 +6267,6 @@ LogPrintf("RGP NULL Block found, REMOVING \n");
                     else
                          block_checker++;
 
-                    MilliSleep(1);
                    
                 }
 
@@ -5692,12 +6299,10 @@ LogPrintf("RGP synch_check. %d \n", synch_check );
             PushGetBlocks(pfrom, PreviousIndex, PreviousIndex->GetBlockHash()  );
 //LogPrintf("RGP Asking for PREVIOUS %s \n", PreviousIndex->GetBlockHash().ToString() );
 
-            MilliSleep( 2 );
 
 
 
 LogPrintf("RGP Resetting block, clearing all items. \n");
-                MilliSleep(2);
             }
 
 
@@ -5726,7 +6331,6 @@ LogPrintf("RGP PROCESS MESSAGE block match is ZERO \n");
                 tester = match_checker->second;
 LogPrintf("RGP ProcessMage, new match ALGO hash %s tester %s \n", tester.GetHash().ToString(), tester.hashPrevBlock.ToString() );
                 duplicate_loop_count++;
-                MilliSleep( 2 );
             }
             
             if ( duplicate_loop_count == 1 )
@@ -5762,7 +6366,6 @@ LogPrintf("RGP ProcessMessage DUPLICATE BLOCK test nTime %d \n \n",  verified_bl
 
 // LogPrintf("RGP ProcessMessage DUPLICATE BLOCK DELETING FIRST BLOCK \n" );
                 
-                    MilliSleep(1);
 
                 }
 
@@ -5796,7 +6399,6 @@ LogPrintf("RGP ProcessMessage DUPLICATE BLOCK test nTime %d \n \n",  verified_bl
                     ALL_Blocks_Processed = true;
                     Block_Checker_Array = NOT_INITIALISED;
                     Buffer_entries = 0;
-                    MilliSleep( 1 );
                     break; /* end of the array of blocks */
                 }
 
@@ -5820,7 +6422,6 @@ LogPrintf("RGP ProcessMessage DUPLICATE BLOCK test nTime %d \n \n",  verified_bl
                 /* Skip this block it's been processed */
 
                 Blocks_Processed++;
-                MilliSleep( 1 );
             }
             else
             {
@@ -5841,7 +6442,6 @@ LogPrintf("RGP ProcessMessage DUPLICATE BLOCK test nTime %d \n \n",  verified_bl
                     if ( !Accept_Status )
                     {
                         LogPrintf("RGP ProcessMessage AcceptBlock() failed %d  \n" , Blocks_Processed );
-                        MilliSleep( 1 );
                         //Blocks_Processed++;
                         
                     }
@@ -5858,7 +6458,6 @@ LogPrintf("RGP ProcessMessage DUPLICATE BLOCK test nTime %d \n \n",  verified_bl
                         /* Process next block */      
                         Blocks_Processed++;
  
-                        MilliSleep( 1 );
                     }
 
                 }
@@ -5868,7 +6467,6 @@ LogPrintf("RGP ProcessMessage DUPLICATE BLOCK test nTime %d \n \n",  verified_bl
 //LogPrintf("TEST 7 No block match current %s new previous %s \n", current_previous_hash.ToString(), Block_Checker[ Blocks_Processed ].hashPrevBlock.ToString() );        
                     Blocks_Processed++;
                     
-                    MilliSleep(1);
                 }  
             }
 
@@ -5876,7 +6474,6 @@ loops_performed++;
 
 //LogPrintf("TEST 5 debug 1.2 loops %d \n",  loops_performed);
 
-           MilliSleep(1);
 
         } while ( !ALL_Blocks_Processed );
 
@@ -5931,7 +6528,6 @@ loops_performed++;
         }
 
 //MilliSleep( 20 );
-        MilliSleep(5);
 
         if (!Accept_Status)
         {
@@ -5945,7 +6541,6 @@ loops_performed++;
             //PushGetBlocks(pfrom, pindexBest, uint256(0) ); 
             //pfrom->AskFor(CInv(MSG_BLOCK, pblock->hashPrevBlock ),  true );
 
-            MilliSleep( 5 );
 
             //if ( BSC_Wallet_Synching )
             //{
@@ -5995,6 +6590,9 @@ loops_performed++;
                     darkSendPool.NewBlock();
                     masternodePayments.ProcessBlock(GetHeight()+10);
 
+                    // rank the masternodes for the next block while we hold the new tip
+                    mnodeman.UpdateScoreTable(pindexBest->nHeight + 1);
+
                 } else if (fLiteMode && !fImporting && !fReindex && pindexBest->nHeight > Checkpoints::GetTotalBlocksEstimate())
                 {
                     LogPrintf("*** RGP ProcessBlock light mode \n");
@@ -6042,7 +6640,6 @@ loops_performed++;
                       -- Duplicity check on stake was satisfactory --
                       ----------------------------------------------- */
                     LogPrintf("*** RGP Duplicity check-> Look into this BlockTime %d Gettim %d \n", pindexBest->GetBlockTime(), GetTime() );
-                    MilliSleep(1);
                 }
                 else
                 {
@@ -6055,12 +6652,10 @@ loops_performed++;
                        /* RGP, there can be 6 seconds between the current stored block and the
                                new block, this second test has been used to check that the
                                pindexBest block is always less than GetTime()                   */
-                       MilliSleep(1);
                    }
                    else
                    {
                       LogPrintf("*** RGP Duplicate proof of stake \n");
-                      MilliSleep(1);
                       return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
                    }
 
@@ -6070,7 +6665,6 @@ loops_performed++;
     }
 
     
-    MilliSleep(1);
     
     if (pblock->hashPrevBlock != hashBestChain)
     {
@@ -6084,7 +6678,6 @@ loops_performed++;
                 {
                     LogPrintf("*** ProcessBlock fill up memory detected, misbehaving \n");
                     Misbehaving(pfrom->GetId(), 1);
-                    MilliSleep(1); /* RGP Optimise */
                 }
 
                 LogPrintf("*** RGP ProcessBlock, DEBUG Special 003 \n");
@@ -6453,6 +7046,7 @@ int64_t nSearchTime;
                 // make sure coinstake would meet timestamp protocol
                 //    as it would be the same as the block timestamp
                 vtx[0].nTime = nTime = txCoinStake.nTime;
+                vtx[0].InvalidateHash();
 
                 // we have to make sure that we have no future timestamps in
                 //    our transactions set
@@ -6574,6 +7168,93 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+CBlockFileMapping::~CBlockFileMapping()
+{
+#ifndef WIN32
+    munmap((void*)pBegin, nSize);
+#endif
+}
+
+// Block files are only ever appended to, so a mapping stays valid and at
+// worst misses blocks written after it was made; those are picked up by
+// mapping the file again. Readers hold a reference, so evicting a mapping
+// never pulls memory from under them.
+static CCriticalSection cs_blockfilemaps;
+static map<unsigned int, pair<CBlockFileMappingRef, uint64_t> > mapBlockFileMaps;
+static uint64_t nBlockFileMapsTick = 0;
+
+CBlockFileMappingRef MapBlockFile(unsigned int nFile, uint64_t nMinSize)
+{
+#ifdef WIN32
+    return CBlockFileMappingRef();
+#else
+    // Whole files are mapped, leave the address space alone on 32-bit
+    static const unsigned int nMaxMaps = GetArg("-blockfilemaps", sizeof(void*) >= 8 ? DEFAULT_BLOCKFILE_MAPS : 0);
+    if (nMaxMaps == 0 || (nFile < 1) || (nFile == (unsigned int) -1))
+        return CBlockFileMappingRef();
+
+    LOCK(cs_blockfilemaps);
+
+    map<unsigned int, pair<CBlockFileMappingRef, uint64_t> >::iterator mi = mapBlockFileMaps.find(nFile);
+    if (mi != mapBlockFileMaps.end() && (*mi).second.first->nSize >= nMinSize)
+    {
+        (*mi).second.second = ++nBlockFileMapsTick;
+        return (*mi).second.first;
+    }
+
+    int fd = open(BlockFilePath(nFile).string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return CBlockFileMappingRef();
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size < nMinSize)
+    {
+        close(fd);
+        return CBlockFileMappingRef();
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return CBlockFileMappingRef();
+
+    CBlockFileMappingRef mapping(new CBlockFileMapping((const char*)p, st.st_size));
+    mapBlockFileMaps[nFile] = make_pair(mapping, ++nBlockFileMapsTick);
+
+    // Evict the least recently used mappings
+    while (mapBlockFileMaps.size() > nMaxMaps)
+    {
+        map<unsigned int, pair<CBlockFileMappingRef, uint64_t> >::iterator oldest = mapBlockFileMaps.begin();
+        for (mi = mapBlockFileMaps.begin(); mi != mapBlockFileMaps.end(); ++mi)
+            if ((*mi).second.second < (*oldest).second.second)
+                oldest = mi;
+        mapBlockFileMaps.erase(oldest);
+    }
+
+    return mapping;
+#endif
+}
+
+CBlockFileMappingRef MapBlockAt(unsigned int nFile, unsigned int nBlockPos)
+{
+    CBlockFileMappingRef mapping = MapBlockFile(nFile, (uint64_t)nBlockPos + 1);
+    if (!mapping || nBlockPos < sizeof(unsigned int))
+        return mapping;
+
+    // WriteToDisk stores the block size right in front of the block
+    unsigned int nBlockSize;
+    memcpy(&nBlockSize, mapping->pBegin + nBlockPos - sizeof(nBlockSize), sizeof(nBlockSize));
+    if ((uint64_t)nBlockPos + nBlockSize > mapping->nSize)
+        mapping = MapBlockFile(nFile, (uint64_t)nBlockPos + nBlockSize);
+    return mapping;
+}
+
+void UnmapBlockFiles()
+{
+    LOCK(cs_blockfilemaps);
+    mapBlockFileMaps.clear();
+}
+
 static unsigned int nCurrentBlockFile = 1;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
@@ -6603,7 +7284,6 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
         fclose(file);
         nCurrentBlockFile++;
 
-        MilliSleep(1); /* RGP Optimize */
     }
 }
 
@@ -6623,7 +7303,6 @@ unsigned int nBlockPos;
     // Load block index
     //
     //printf("RGP Debug LoadBlockIndex 001\n");
-    MilliSleep(1);
     CTxDB txdb("cr+");
     if (!txdb.LoadBlockIndex())
     {
@@ -6808,6 +7487,25 @@ struct CImportingNow
     }
 };
 
+void ThreadScriptCheck()
+{
+    RenameThread("SocietyG-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+void InterruptScriptCheck()
+{
+    scriptcheckqueue.Interrupt();
+}
+
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pSigHashCache.get()))
+        return error("CScriptCheck() : %s VerifySignature failed on input %u", ptxTo->GetHash().ToString(), nIn);
+    return true;
+}
+
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("SocietyG-loadblk");
@@ -6931,7 +7629,6 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 //        else
 //            LogPrintf("*** RGP Alreadyhave() txdb.ContainsTx does NOT exist \n");
 
-        MilliSleep( 1 ); /* RGP Optimize */
 
         return txInMap ||
                mapOrphanTransactions.count(inv.hash) ||
@@ -7127,7 +7824,6 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK  || inv.type == MSG_FILTERED_BLOCK)
                 break;
         }
-        MilliSleep(1); /* RGP Optimise */
     }
 
     pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
@@ -7145,70 +7841,338 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-/* ---------------------------
-   -- RGP. Message Protocol --
-   --------------------------------------------------------------------
-   -- To be implemented                                              --
-   -------------------------------------------------------------------- */
+/** Gossip messages.
+ *
+ *  Pings and pongs only touch the peer that sent them. With -gossipthreads
+ *  they are handed to a small worker pool so they are not stuck behind block
+ *  processing on the message handler thread, which keeps the measured ping
+ *  time honest. Messages of one peer are still handled in the order they
+ *  arrived: while a peer has gossip queued (fGossipQueued) the message
+ *  handler leaves the rest of its messages, and its SendMessages(), alone
+ *  until a worker has drained vGossipMsg.
+ *
+ *  Masternode, payment and spork messages stay on the message handler: their
+ *  handlers read mapBlockIndex, pindexBest and transactions without cs_main,
+ *  which is only safe on the thread that connects the blocks.
+ */
+static bool IsGossipCommand(const string& strCommand)
+{
+    return strCommand == "ping" || strCommand == "pong";
+}
 
-static uint64_t message_ask_filter = 0;
-CBlock block_to_check;
+// Protects vGossipNodes and every CNode's vGossipMsg/fGossipQueued
+static boost::mutex mutexGossip;
+static boost::condition_variable condGossip;
+static std::deque<CNode*> vGossipNodes;
+static bool fGossipQuit = false;
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+static bool IsGossipQueued(CNode* pnode)
 {
-vector<CInv> vInv;
-extern bool BSC_Wallet_Synching;
-bool Last_Block_Confirmed; /* RGP defined in main.h */
-int64_t Time_to_Last_block;
-int64_t nTime;
-CAddress addrMe;
-CAddress addrFrom;
-uint64_t nNonce;
-unsigned int nInventory_index;
-bool fAlreadyHave;
-uint256 hash_to_get;
-CInv Problem_Blocks_Inv;
-
-    RandAddSeedPerfmon();
+    boost::unique_lock<boost::mutex> lock(mutexGossip);
+    return pnode->fGossipQueued;
+}
 
-    LOCK(cs_main);
-    CTxDB txdb("r");
+// Account for and free a message taken off queueRecvMsg
+static void FinishRecvMessage(CNode* pnode, CNetMessage* pmsg)
+{
+    pnode->nRecvQueueSize -= pmsg->hdr.nMessageSize + 24;
+    delete pmsg;
+}
 
-    if ( message_ask_filter > 100 )
+static void QueueGossipMessage(CNode* pnode, CNetMessage* pmsg)
+{
+    boost::unique_lock<boost::mutex> lock(mutexGossip);
+    pnode->vGossipMsg.push_back(pmsg);
+    if (!pnode->fGossipQueued)
     {
-LogPrintf("rgp Processmessage started \n");
-        /* If the wallet is not yet synched, then delay */
-        Time_to_Last_block = ( GetTime() - pindexBest->GetBlockTime() );
-
-        if ( Time_to_Last_block > 200 )
+        pnode->fGossipQueued = true;
         {
-            // RGP, new implementation for synch, send to all connected noded
-            //      note requesting hash 0 does nothing!!!
-            
-            for (CNode* pnode : vNodes)
-            {
-                PushGetBlocks(pnode, pindexBest,  pindexBest->GetBlockHash() );
-                // LogPrintf("RGP pushing inventory request to node %s \n", pnode->addrName );
-            }
-            MilliSleep( 10 );
-
+            LOCK(cs_vNodes);
+            pnode->AddRef();
         }
- 
-        message_ask_filter = 0;
+        vGossipNodes.push_back(pnode);
+        condGossip.notify_one();
     }
-    
-    
-    message_ask_filter++;
-
-// RGP let's see what happens if we put it here
-        for (CNode* pnode : vNodes)
-            {
-                PushGetBlocks(pnode, pindexBest,  pindexBest->GetBlockHash() );
-                // LogPrintf("RGP pushing inventory request to node %s \n", pnode->addrName );
-                 MilliSleep( 5 );
-            }
-
-
+}
+
+static void ProcessGossipMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+{
+    if (strCommand == "ping")
+    {
+        if (pfrom->nVersion > BIP0031_VERSION)
+        {
+            uint64_t nonce = 0;
+            vRecv >> nonce;
+            // Echo the message back with the nonce. This allows for two useful features:
+            //
+            // 1) A remote node can quickly check if the connection is operational
+            // 2) Remote nodes can measure the latency of the network thread. If this node
+            //    is overloaded it won't respond to pings quickly and the remote node can
+            //    avoid sending us more work, like chain download requests.
+            //
+            // The nonce stops the remote getting confused between different pings: without
+            // it, if the remote node sends a ping once per second and this node takes 5
+            // seconds to respond to each, the 5th ping the remote sends would appear to
+            // return very quickly.
+
+            pfrom->PushMessage("pong", nonce);
+        }
+
+        // Use the ping to ask the peer for blocks we may have missed. This
+        // reads the best chain, so it waits for cs_main after the pong is out.
+        LOCK(cs_main);
+        PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash());
+    }
+
+
+    else if (strCommand == "pong")
+    {
+        int64_t pingUsecEnd = GetTimeMicros();
+        uint64_t nonce = 0;
+        size_t nAvail = vRecv.in_avail();
+        bool bPingFinished = false;
+        std::string sProblem;
+        if (nAvail >= sizeof(nonce)) {
+            vRecv >> nonce;
+
+            LogPrintf("*** RGP PONG message debug 002 \n");
+
+            // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
+            if (pfrom->nPingNonceSent != 0) {
+                if (nonce == pfrom->nPingNonceSent) {
+                    // Matching pong received, this ping is no longer outstanding
+                    bPingFinished = true;
+                    int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
+                    if (pingUsecTime > 0) {
+                        // Successful ping time measurement, replace previous
+                        pfrom->nPingUsecTime = pingUsecTime;
+                    } else {
+                        // This should never happen
+                        sProblem = "Timing mishap";
+                    }
+                } else {
+                    // Nonce mismatches are normal when pings are overlapping
+                    sProblem = "Nonce mismatch";
+                    if (nonce == 0) {
+                        // This is most likely a bug in another implementation somewhere, cancel this ping
+                        bPingFinished = true;
+                        sProblem = "Nonce zero";
+                    }
+                }
+            } else {
+                sProblem = "Unsolicited pong without ping";
+            }
+        } else {
+            // This is most likely a bug in another implementation somewhere, cancel this ping
+            bPingFinished = true;
+            sProblem = "Short payload";
+        }
+
+        if (!(sProblem.empty())) {
+            LogPrint("net", "pong %s %s: %s, %x expected, %x received, %zu bytes\n"
+                , pfrom->addr.ToString()
+                , pfrom->strSubVer
+                , sProblem
+                , pfrom->nPingNonceSent
+                , nonce
+                , nAvail);
+        }
+        if (bPingFinished) {
+            pfrom->nPingNonceSent = 0;
+        }
+
+        LOCK(cs_main);
+        PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash());
+    }
+
+    // Update the last seen time for this node's address
+    if (pfrom->fNetworkNode && strCommand == "ping")
+        AddressCurrentlyConnected(pfrom->addr);
+}
+
+void ThreadGossipHandler()
+{
+    RenameThread("SocietyG-gossip");
+
+    while (true)
+    {
+        CNode* pnode;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexGossip);
+            while (vGossipNodes.empty() && !fGossipQuit)
+                condGossip.wait(lock);
+            if (vGossipNodes.empty())
+                return;
+            pnode = vGossipNodes.front();
+            vGossipNodes.pop_front();
+        }
+
+        while (true)
+        {
+            CNetMessage* pmsg;
+            {
+                boost::unique_lock<boost::mutex> lock(mutexGossip);
+                if (pnode->vGossipMsg.empty() || pnode->fDisconnect)
+                {
+                    // whatever is left is freed with the node
+                    pnode->fGossipQueued = false;
+                    break;
+                }
+                pmsg = pnode->vGossipMsg.front();
+                pnode->vGossipMsg.pop_front();
+            }
+
+            string strCommand = pmsg->hdr.GetCommand();
+            try
+            {
+                ProcessGossipMessage(pnode, strCommand, pmsg->vRecv);
+            }
+            catch (std::ios_base::failure& e)
+            {
+                if (strstr(e.what(), "end of data"))
+                    LogPrintf("ThreadGossipHandler(%s, %u bytes) : Exception '%s' caught, normally caused by a message being shorter than its stated length\n", strCommand, pmsg->hdr.nMessageSize, e.what());
+                else
+                    PrintExceptionContinue(&e, "ThreadGossipHandler()");
+            }
+            catch (boost::thread_interrupted) {
+                FinishRecvMessage(pnode, pmsg);
+                throw;
+            }
+            catch (std::exception& e) {
+                PrintExceptionContinue(&e, "ThreadGossipHandler()");
+            } catch (...) {
+                PrintExceptionContinue(NULL, "ThreadGossipHandler()");
+            }
+            FinishRecvMessage(pnode, pmsg);
+        }
+
+        {
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+
+        // The message handler left the rest of this peer's messages for now
+        WakeMessageHandler();
+    }
+}
+
+void InterruptGossipHandler()
+{
+    boost::unique_lock<boost::mutex> lock(mutexGossip);
+    fGossipQuit = true;
+    condGossip.notify_all();
+}
+
+/* ---------------------------
+   -- RGP. Message Protocol --
+   --------------------------------------------------------------------
+   -- To be implemented                                              --
+   -------------------------------------------------------------------- */
+
+static uint64_t message_ask_filter = 0;
+CBlock block_to_check;
+
+// Whether the coinstake announced in a compact block spends an unspent output
+// of the main chain and is signed for it. The block signature alone is made
+// with the key of the coinstake's own output, which any peer can supply, so
+// this is what makes a proof-of-stake compact block cost a real coin.
+static bool CheckCompactBlockStake(const CTransaction& txCoinStake)
+{
+    const COutPoint& prevout = txCoinStake.vin[0].prevout;
+    CTxDB txdb("r");
+    CTxIndex txindex;
+    if (!txdb.ReadTxIndex(prevout.hash, txindex) || prevout.n >= txindex.vSpent.size() || !txindex.vSpent[prevout.n].IsNull())
+        return false;
+
+    CTransaction txPrev;
+    if (!txdb.ReadDiskTx(prevout.hash, txPrev) || prevout.n >= txPrev.vout.size())
+        return false;
+    return VerifySignature(txPrev, txCoinStake, 0, SCRIPT_VERIFY_NONE, 0);
+}
+
+// Hand a block rebuilt from a compact block to ProcessBlock, as the "block"
+// command would have
+static void ProcessCompactBlockResult(CNode* pfrom, CBlock& block)
+{
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
+
+    if (mapBlocksInFlight.count(hashBlock) || mapHeadersChainHeight.count(hashBlock))
+    {
+        ProcessHeadersSyncBlock(pfrom, block);
+        return;
+    }
+
+    block_to_check = block;
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    else if (block.nDoS)
+        Misbehaving(pfrom->GetId(), block.nDoS);
+
+    if (fSecMsgEnabled)
+        SecureMsgScanBlock(block);
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+{
+vector<CInv> vInv;
+extern bool BSC_Wallet_Synching;
+bool Last_Block_Confirmed; /* RGP defined in main.h */
+int64_t Time_to_Last_block;
+int64_t nTime;
+CAddress addrMe;
+CAddress addrFrom;
+uint64_t nNonce;
+unsigned int nInventory_index;
+bool fAlreadyHave;
+uint256 hash_to_get;
+CInv Problem_Blocks_Inv;
+
+    RandAddSeedPerfmon();
+
+    LOCK(cs_main);
+    CTxDB txdb("r");
+
+    if ( message_ask_filter > 100 )
+    {
+LogPrintf("rgp Processmessage started \n");
+        /* If the wallet is not yet synched, then delay */
+        Time_to_Last_block = ( GetTime() - pindexBest->GetBlockTime() );
+
+        if ( Time_to_Last_block > 200 )
+        {
+            // RGP, new implementation for synch, send to all connected noded
+            //      note requesting hash 0 does nothing!!!
+            
+            for (CNode* pnode : vNodes)
+            {
+                PushGetBlocks(pnode, pindexBest,  pindexBest->GetBlockHash() );
+                // LogPrintf("RGP pushing inventory request to node %s \n", pnode->addrName );
+            }
+
+        }
+ 
+        message_ask_filter = 0;
+    }
+    
+    
+    message_ask_filter++;
+
+// RGP let's see what happens if we put it here
+    // This runs for every message, ask all peers a few times a second at most
+    static int64_t nLastGetBlocksAll = 0;
+    if (GetTimeMillis() - nLastGetBlocksAll >= 250)
+    {
+        nLastGetBlocksAll = GetTimeMillis();
+        for (CNode* pnode : vNodes)
+            {
+                PushGetBlocks(pnode, pindexBest,  pindexBest->GetBlockHash() );
+                // LogPrintf("RGP pushing inventory request to node %s \n", pnode->addrName );
+            }
+    }
+
+
 
     if ( fDebug )
         LogPrintf("net, received: %s (%u bytes)\n", strCommand, vRecv.size());
@@ -7479,7 +8443,6 @@ LogPrintf("addr \n");
                     {
                         if (pnode->nVersion < CADDR_TIME_VERSION)
                         {
-                            MilliSleep( 1 );  /* RGP Otimized */
                             continue;
                         }
                         unsigned int nPointer;
@@ -7489,7 +8452,6 @@ LogPrintf("addr \n");
                         mapMix.insert(make_pair(hashKey, pnode));
                     }
 
-                    MilliSleep( 1 );  /* RGP Otimized */   
 
                     int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
                     for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
@@ -7500,7 +8462,6 @@ LogPrintf("addr \n");
             if (fReachable)
                 vAddrOk.push_back(addr);
              
-            MilliSleep( 1 );  /* RGP Otimized */   
             
         }
         addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
@@ -7563,7 +8524,6 @@ LogPrintf("addr \n");
                 PushGetBlocks(pfrom, Block_Start_Requested, Block_Start_Requested->GetBlockHash()  );
 //LogPrintf("RGP Asking for PREVIOUS %s \n", Block_Start_Requested->GetBlockHash().ToString() );
 
-        MilliSleep( 5 );
             }
 
 
@@ -7603,22 +8563,17 @@ LogPrintf("addr \n");
 
             switch( Inventory_Item.type )
             {
-                case MSG_TX     : MilliSleep( 5 );
-                                  break;
-
-                case MSG_BLOCK  : MilliSleep( 5 );
-                                  break;
+                case MSG_TX     :
+                case MSG_BLOCK  : break;
 
                 default         : LogPrintf("*** Process Inventory OTHER MSG_TYPE!!! %d index %d from node %s \n", Inventory_Item.type, nInventory_index, pfrom->addr.ToString() );
 
-                                  MilliSleep( 1 ); /* RGP Optimize */
 
                                   // Track requests for our stuff
                                   g_signals.Inventory( Inventory_Item.hash );
 
                                   /* RGP as this is end of the inv sequence, ask for blocks */
                                   PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash() );
-                                  MilliSleep( 1 );
 
                                   break; /* RGP let the for loop end */
 
@@ -7644,13 +8599,11 @@ LogPrintf("addr \n");
                    /* RGP experimental */
 
                    //PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash() );
-                   MilliSleep( 1 ); /* RGP Optimize */
 
                    if ( !mapBlockIndex.count( Inventory_Item.hash ) )
                    {
 
                        pfrom->AskFor( Inventory_Item, false );
-                       MilliSleep( 1 ); /* RGP Optimize */
                    }
 
                 }
@@ -7659,7 +8612,6 @@ LogPrintf("addr \n");
 		/* get the source to push blocks from out best index */
 PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash()  ); 
           
-                MilliSleep( 1 ); /* RGP Optimize */
             }
             else
             {
@@ -7667,7 +8619,6 @@ PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash()  );
                 // Fix up test
                 pfrom->AddInventoryKnown( Inventory_Item );
                 pfrom->AskFor( Inventory_Item, true );
-                MilliSleep( 1 ); /* RGP Optimize */
 
 
 
@@ -7685,7 +8636,6 @@ PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash()  );
                 {
                     //LogPrintf("*** RGP INV processing, we have, check orphans \n");
                     pfrom->AskFor( Inventory_Item, false );
-                    MilliSleep( 1 ); /* RGP Optimize */
 
                     if ( Inventory_Item.type == MSG_BLOCK && mapOrphanBlocks.count( Inventory_Item.hash ) )
                     {
@@ -7710,7 +8660,6 @@ PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash()  );
 
                         //LogPrintf("*** RGP INV processing, end of Orphan check \n");
 
-                        MilliSleep( 1 ); /* RGP Optimize */
                     }
                     else
                     {
@@ -7735,7 +8684,6 @@ PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash()  );
                         pfrom->AskFor( Inventory_Item, false );
 
 
-                        MilliSleep( 1 ); /* RGP Optimize */
                     }
 
 
@@ -7801,14 +8749,12 @@ PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash()  );
             // Track requests for our stuff
             g_signals.Inventory( Inventory_Item.hash );
 
-            MilliSleep( 1 ); /* RGP Optimize */
 
         }
 
         // Track requests for our stuff
         //g_signals.Inventory( vInv );
 
-        MilliSleep( 1 );
     }
 
 
@@ -7839,7 +8785,6 @@ PushGetBlocks( pfrom,  pindexBest, pindexBest->GetBlockHash() );
 
         pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
         ProcessGetData(pfrom);
-        MilliSleep(1); /* RGP Optimise */
     }
 
 
@@ -7852,7 +8797,6 @@ PushGetBlocks( pfrom,  pindexBest, pindexBest->GetBlockHash() );
 
 //LogPrintf("rgp Processmessage 'getblocks' request node %s \n", pfrom->addr.ToStringIP() );
 //PushGetBlocks(pfrom, pindexBest, pindexBest->GetBlockHash() );
-MilliSleep( 5);
 
 
         CBlockLocator locator;
@@ -7871,7 +8815,6 @@ MilliSleep( 5);
             //      latest has request.
 
             // RGP at present if hashstop is zero, just return with no activity  
-            MilliSleep( 5 );
             return true;
         }
 
@@ -7893,7 +8836,6 @@ MilliSleep( 5);
         {
             //LogPrintf("*** RGP ProcessMessage GETBLOCKS, Wallet Synching... \n" );
 
-            MilliSleep(1);
 
             //pfrom->PushInventory(CInv(MSG_BLOCK, pindexBest->GetBlockHash()));
             //pfrom->hashContinue = pindex->GetBlockHash(); /* RGP */
@@ -7959,16 +8901,13 @@ LogPrintf("*** RGP ProcessMessage GETBLOCKS from %s \n", pfrom->addr.ToStringIP(
                     // getblocks the next batch of inventory.
                     //LogPrintf("net, getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                     pfrom->hashContinue = pindex->GetBlockHash();
-                    MilliSleep(1);
                     break;
                 }
 
 
-		        MilliSleep(1);
             }
         }
         
-	MilliSleep(1);
     }
     else if (strCommand == "getheaders")
     {
@@ -8025,12 +8964,26 @@ LogPrintf("GETHEADERS\n");
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
             
-            MilliSleep(1);
         }
         pfrom->PushMessage("headers", vHeaders);
     }
 
 
+    else if (strCommand == "headers" && fHeadersFirstSync && !fImporting && !fReindex)
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+
+        ProcessHeaders(pfrom, vHeaders);
+    }
+
+
     else if (strCommand == "tx"|| strCommand == "dstx")
     {
         vector<uint256> vWorkQueue;
@@ -8182,6 +9135,153 @@ PushGetBlocks( pfrom,  pindexBest,  pindexBest->GetBlockHash() );
        --      records coming in                                         -- */
 
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock))
+            return true;
+
+        // Without its parent the block cannot be checked, let the regular
+        // download fetch it along with the missing part of the chain
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+        {
+            pfrom->AskFor(inv);
+            return true;
+        }
+
+        // Rebuilding from the pool is for blocks on our tip, and a peer gets
+        // it once per tip. Anything else is fetched whole and goes through
+        // the regular block checks.
+        CNodeState *state = State(pfrom->GetId());
+        if (cmpctblock.header.hashPrevBlock != hashBestChain || !state ||
+            state->hashLastCmpctBlockPrev == cmpctblock.header.hashPrevBlock)
+        {
+            LogPrint("cmpctblock", "Fetching compact block %s from peer=%d whole\n", hashBlock.ToString(), pfrom->id);
+            vector<CInv> vGetData(1, inv);
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+        state->hashLastCmpctBlockPrev = cmpctblock.header.hashPrevBlock;
+
+        // Check what the header and the prefilled coinbase and coinstake
+        // prove before any work goes into rebuilding the block from the pool
+        CBlock blockHeader = cmpctblock.header;
+        for (unsigned int i = 0; i < cmpctblock.vPrefilledTxn.size() && cmpctblock.vPrefilledTxn[i].nIndex == i && i < 2; i++)
+            blockHeader.vtx.push_back(cmpctblock.vPrefilledTxn[i].tx);
+        if (blockHeader.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+            return error("ProcessMessage() : cmpctblock %s timestamp too far in the future", hashBlock.ToString());
+        if (blockHeader.IsProofOfWork() ? !CheckProofOfWork(blockHeader.GetPoWHash(), blockHeader.nBits) :
+            (!blockHeader.CheckBlockSignature() || !CheckCompactBlockStake(blockHeader.vtx[1])))
+        {
+            Misbehaving(pfrom->GetId(), 50);
+            return error("ProcessMessage() : cmpctblock %s from peer=%d has invalid proof", hashBlock.ToString(), pfrom->id);
+        }
+
+        boost::shared_ptr<CPartiallyDownloadedBlock> pPartialBlock(new CPartiallyDownloadedBlock(&mempool));
+        ReadStatus status = pPartialBlock->InitData(cmpctblock);
+        if (status == READ_STATUS_INVALID)
+        {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("ProcessMessage() : invalid cmpctblock %s from peer=%d", hashBlock.ToString(), pfrom->id);
+        }
+        if (status == READ_STATUS_FAILED)
+        {
+            vector<CInv> vGetData(1, inv);
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        req.hashBlock = hashBlock;
+        pPartialBlock->GetMissing(req.vIndexes);
+        if (req.vIndexes.empty())
+        {
+            CBlock block;
+            status = pPartialBlock->FillBlock(block, vector<CTransaction>());
+            if (status == READ_STATUS_OK)
+            {
+                ProcessCompactBlockResult(pfrom, block);
+                return true;
+            }
+
+            vector<CInv> vGetData(1, inv);
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+
+        LogPrint("cmpctblock", "Requesting %u transactions of compact block %s from peer=%d\n",
+                 req.vIndexes.size(), hashBlock.ToString(), pfrom->id);
+        if (state)
+            state->pPartialBlock = pPartialBlock;
+        pfrom->PushMessage("getblocktxn", req);
+    }
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return true;
+
+        CBlock block;
+        if (!block.ReadFromDisk(mi->second))
+            return error("ProcessMessage() : getblocktxn failed to read block %s", req.hashBlock.ToString());
+
+        CBlockTransactions resp;
+        resp.hashBlock = req.hashBlock;
+        resp.vtx.reserve(req.vIndexes.size());
+        BOOST_FOREACH(unsigned short nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("ProcessMessage() : getblocktxn index out of range from peer=%d", pfrom->id);
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        CNodeState *state = State(pfrom->GetId());
+        if (!state || !state->pPartialBlock || state->pPartialBlock->header.GetHash() != resp.hashBlock)
+        {
+            LogPrint("cmpctblock", "Unexpected blocktxn %s from peer=%d\n", resp.hashBlock.ToString(), pfrom->id);
+            return true;
+        }
+
+        boost::shared_ptr<CPartiallyDownloadedBlock> pPartialBlock = state->pPartialBlock;
+        state->pPartialBlock.reset();
+
+        CBlock block;
+        ReadStatus status = pPartialBlock->FillBlock(block, resp.vtx);
+        if (status == READ_STATUS_INVALID)
+        {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("ProcessMessage() : invalid blocktxn %s from peer=%d", resp.hashBlock.ToString(), pfrom->id);
+        }
+        if (status == READ_STATUS_FAILED)
+        {
+            // A short id matched the wrong pool transaction, fall back to the full block
+            vector<CInv> vGetData(1, CInv(MSG_BLOCK, resp.hashBlock));
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+
+        ProcessCompactBlockResult(pfrom, block);
+    }
+
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
@@ -8189,6 +9289,14 @@ PushGetBlocks( pfrom,  pindexBest,  pindexBest->GetBlockHash() );
         uint256 hashBlock = block.GetHash();
         unsigned int age_calculation;
 
+        // Blocks of the header chain bypass the Block_Checker buffer in
+        // ProcessBlock and are connected in header chain order
+        if (mapBlocksInFlight.count(hashBlock) || mapHeadersChainHeight.count(hashBlock))
+        {
+            ProcessHeadersSyncBlock(pfrom, block);
+            return true;
+        }
+
 //PushGetBlocks( pfrom,  pindexBest,  pindexBest->GetBlockHash() );
 
         /* RGP Copy this block for later use by AcceptBlock() */
@@ -8261,7 +9369,6 @@ PushGetBlocks( pfrom,  pindexBest,  pindexBest->GetBlockHash() );
             //LogPrintf("*** RGP ProcessMessage block ACCEPTED \n" );
             mapAlreadyAskedFor.erase(inv);
 
-	    MilliSleep(1);
 
             //return true;
         }
@@ -8282,7 +9389,6 @@ PushGetBlocks( pfrom,  pindexBest,  pindexBest->GetBlockHash() );
             SecureMsgScanBlock(block);
 
         PushGetBlocks(pfrom,  pindexBest,  pindexBest->GetBlockHash()); /*  mapBlockIndex[inv.hash], uint256(0)); */
-        MilliSleep( 1 ); /* RGP Optimize */
 
         return true;
 
@@ -8311,7 +9417,6 @@ PushGetBlocks( pfrom,  pindexBest,  pindexBest->GetBlockHash() );
             if(addr.nTime > nCutOff)
                 pfrom->PushAddress(addr);
            
-            MilliSleep( 1 ); /* RGP Optimize */   
         }
     }
 
@@ -8333,93 +9438,15 @@ PushGetBlocks( pfrom,  pindexBest,  pindexBest->GetBlockHash() );
             if (i == (MAX_INV_SZ - 1))
                     break;
                     
-            MilliSleep(1); /* Optimize */
         }
         if (vInv.size() > 0)
             pfrom->PushMessage("inv", vInv);
     }
 
 
-    else if (strCommand == "ping")
+    else if (IsGossipCommand(strCommand))
     {
-PushGetBlocks( pfrom,  pindexBest,  pindexBest->GetBlockHash() );
-        if (pfrom->nVersion > BIP0031_VERSION)
-        {
-            uint64_t nonce = 0;
-            vRecv >> nonce;
-            // Echo the message back with the nonce. This allows for two useful features:
-            //
-            // 1) A remote node can quickly check if the connection is operational
-            // 2) Remote nodes can measure the latency of the network thread. If this node
-            //    is overloaded it won't respond to pings quickly and the remote node can
-            //    avoid sending us more work, like chain download requests.
-            //
-            // The nonce stops the remote getting confused between different pings: without
-            // it, if the remote node sends a ping once per second and this node takes 5
-            // seconds to respond to each, the 5th ping the remote sends would appear to
-            // return very quickly.
-
-            pfrom->PushMessage("pong", nonce);
-        }
-    }
-
-
-    else if (strCommand == "pong")
-    {
-        int64_t pingUsecEnd = GetTimeMicros();
-        uint64_t nonce = 0;
-        size_t nAvail = vRecv.in_avail();
-        bool bPingFinished = false;
-        std::string sProblem;
-PushGetBlocks( pfrom,  pindexBest,  pindexBest->GetBlockHash());
-        if (nAvail >= sizeof(nonce)) {
-            vRecv >> nonce;
-
-            LogPrintf("*** RGP PONG message debug 002 \n");
-
-            // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
-            if (pfrom->nPingNonceSent != 0) {
-                if (nonce == pfrom->nPingNonceSent) {
-                    // Matching pong received, this ping is no longer outstanding
-                    bPingFinished = true;
-                    int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
-                    if (pingUsecTime > 0) {
-                        // Successful ping time measurement, replace previous
-                        pfrom->nPingUsecTime = pingUsecTime;
-                    } else {
-                        // This should never happen
-                        sProblem = "Timing mishap";
-                    }
-                } else {
-                    // Nonce mismatches are normal when pings are overlapping
-                    sProblem = "Nonce mismatch";
-                    if (nonce == 0) {
-                        // This is most likely a bug in another implementation somewhere, cancel this ping
-                        bPingFinished = true;
-                        sProblem = "Nonce zero";
-                    }
-                }
-            } else {
-                sProblem = "Unsolicited pong without ping";
-            }
-        } else {
-            // This is most likely a bug in another implementation somewhere, cancel this ping
-            bPingFinished = true;
-            sProblem = "Short payload";
-        }
-
-        if (!(sProblem.empty())) {
-            LogPrint("net", "pong %s %s: %s, %x expected, %x received, %zu bytes\n"
-                , pfrom->addr.ToString()
-                , pfrom->strSubVer
-                , sProblem
-                , pfrom->nPingNonceSent
-                , nonce
-                , nAvail);
-        }
-        if (bPingFinished) {
-            pfrom->nPingNonceSent = 0;
-        }
+        ProcessGossipMessage(pfrom, strCommand, vRecv);
     }
 
 
@@ -8459,7 +9486,6 @@ LogPrintf(" RGP Inventory Processing duplicates \n");
     {
         LogPrintf("*** RGP Other message debug 001 > %s node %s \n", strCommand, pfrom->addr.ToStringIP() );
         PushGetBlocks( pfrom,  pindexBest,  pindexBest->GetBlockHash() );
-        MilliSleep( 1 );
 
         if (fSecMsgEnabled)
             SecureMsgReceiveData(pfrom, strCommand, vRecv);
@@ -8479,7 +9505,7 @@ LogPrintf(" RGP Inventory Processing duplicates \n");
 
     // Update the last seen time for this node's address
     if (pfrom->fNetworkNode)
-        if (strCommand == "version" || strCommand == "addr" || strCommand == "inv" || strCommand == "getdata" || strCommand == "ping")
+        if (strCommand == "version" || strCommand == "addr" || strCommand == "inv" || strCommand == "getdata")
             AddressCurrentlyConnected(pfrom->addr);
 
     return true;
@@ -8545,14 +9571,18 @@ string strCommand;
     // LogPrintf("*** RGP ProcessMessages before main loop \n");
 
 
-    if ( pfrom->vRecvMsg.empty() )
-        LogPrintf("*** RGP ProcessMessages, recive buffer empty %s \n", pfrom->addr.ToString() );
+    // Take over what the socket thread has received so far
+    CNetMessage* pmsgRecv;
+    while (pfrom->queueRecvMsg.Pop(pmsgRecv))
+    {
+        pmsgRecv->SetVersion(pfrom->nRecvVersion);
+        pfrom->vProcessMsg.push_back(pmsgRecv);
+    }
 
     if ( pfrom->fDisconnect )
         LogPrintf("*** RGP ProcessMessages, Disconnected %s \n", pfrom->addr.ToString() );
 
-    std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
-    while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end())
+    while (!pfrom->fDisconnect && !pfrom->vProcessMsg.empty())
     {
 
         // Don't bother if send buffer is too full to respond anyway
@@ -8563,70 +9593,37 @@ string strCommand;
         }
 
         // get next message
-        CNetMessage& msg = *it;
+        CNetMessage* pmsg = pfrom->vProcessMsg.front();
+        CNetMessage& msg = *pmsg;
 
         if (fDebug)
         {
-           LogPrintf("ProcessMessages(message %u msgsz, %zu bytes, complete:%s)\n",
-                     msg.hdr.nMessageSize, msg.vRecv.size(),
-                     msg.complete() ? "Y" : "N");
+           LogPrintf("ProcessMessages(message %u msgsz, %zu bytes)\n",
+                     msg.hdr.nMessageSize, msg.vRecv.size());
         }
 
-        // end, if an incomplete message is found
-        if (!msg.complete())
-        {
-            LogPrintf("*** RGP ProcessMessages msg incomplete from node %s \n", pfrom->addr.ToString() );
-
-            /* RGP delete messages or the same message will be used again and again */
-
-            try
-            {
-                LogPrintf("*** RGP ProcessMessages TRYING to free the vRecvMsg buffer \n");
-                pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
-
-                if ( GetTime() - pindexBest->GetBlockTime() > 10000 )        
-                    LogPrintf("RGP no ban, not synched \n");
-                else
-                {
-                    LogPrintf(" Node to ban is %s \n", pfrom->addr.ToString() );
-                    CNode::Ban(pfrom->addr, BanReasonNodeMisbehaving); 
-                }
-                MilliSleep( 1 );
-            }
-            catch (std::ios_base::failure& e)
-            {
-
-                PrintExceptionContinue(&e, "ProcessMessages()" );
-
-            }
-            catch (boost::thread_interrupted)
-            {
-                /* nothing */
-            }
-            catch (std::exception& e) {
-
-                PrintExceptionContinue(&e, "ProcessMessages()");
-            } catch (...) {
-
-                PrintExceptionContinue(NULL, "ProcessMessages()");
-            }
+        strCommand = msg.hdr.GetCommand();
 
-
-
-            /* Returning false will disconnect the node in net.cpp */
-            LogPrintf("*** RGP stopped Disconnect... \n");
-            pfrom->fDisconnect = true;
-            return false;
+        // Keep the order of this peer's messages while a worker still
+        // has some of its gossip to go through
+        bool fGossip = false;
+        if (nGossipThreads > 0)
+        {
+            bool fGossipQueued = IsGossipQueued(pfrom);
+            fGossip = IsGossipCommand(strCommand);
+            if (fGossipQueued && !fGossip)
+                break;
         }
 
         // at this point, any failure means we can delete the current message
-        it++;
+        pfrom->vProcessMsg.pop_front();
 
         // Scan for message start
         if ( memcmp( msg.hdr.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE ) != 0 )
         {
             LogPrintf("\n\nPROCESSMESSAGE: INVALID MESSAGESTART\n\n");
             fOk = false;
+            FinishRecvMessage(pfrom, pmsg);
             break;
         }
 
@@ -8635,11 +9632,10 @@ string strCommand;
         if (!hdr.IsValid())
         {
             LogPrintf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand());
+            FinishRecvMessage(pfrom, pmsg);
             continue;
         }
 
-        strCommand = hdr.GetCommand();
-
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
@@ -8668,21 +9664,30 @@ string strCommand;
                 // CNode::Ban(pfrom->addr, BanReasonNodeMisbehaving);   
                
                 pfrom->fDisconnect = true;
+                FinishRecvMessage(pfrom, pmsg);
                 break;				/* break out of the while loop          */
 //            }                                  /* no more messages should be processed */   
             //continue;
         }
 
-        MilliSleep( 1 );
+
+        if (fGossip)
+        {
+            QueueGossipMessage(pfrom, pmsg);
+            continue;
+        }
+
 
         // Process message
         bool fRet = false;
         try
         {           
             //LogPrintf("*** RGP ProcessMessages before call to ProcessMessage \n");
+            int64_t nTimeStart = GetTimeMicros();
             fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            LogPrint("bench", "ProcessMessages(%s, %u bytes) : queued %.2fms, processed in %.2fms\n", strCommand, nMessageSize,
+                     (nTimeStart - pmsg->nTime) * 0.001, (GetTimeMicros() - nTimeStart) * 0.001);
 
-            MilliSleep( 1 );
 
             //boost::this_thread::interruption_point();
         }
@@ -8705,6 +9710,7 @@ string strCommand;
             }
         }
         catch (boost::thread_interrupted) {
+            FinishRecvMessage(pfrom, pmsg);
             throw;
         }
         catch (std::exception& e) {
@@ -8717,8 +9723,9 @@ string strCommand;
 
         //LogPrintf("ProcessMessage, after ProcessMessage, after try catch \n");
 
+        FinishRecvMessage(pfrom, pmsg);
+
 
-        MilliSleep( 5 );
 
 
 
@@ -8745,22 +9752,9 @@ string strCommand;
             }
         }
 
-        MilliSleep( 5 );
-
-        //LogPrintf("ProcessMessage, after ProcessMessage, before End of while loop \n");
 
     }
 
-    /* -----------------------------------------------------------------------
-       -- RGP 6th Sep 2019, comment updated, if the node is still connected --
-       -- then clear the message, it's been processed. The effect of not    --
-       -- this that all nodes disconnect.                                   --
-       ----------------------------------------------------------------------- */
-    if ( !pfrom->fDisconnect )
-    {
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
-    }
-
     return fOk;
 }
 
@@ -8773,7 +9767,9 @@ uint64_t nonce;
 static int64_t nLastRebroadcast;
 extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
 
-
+    // A gossip worker is still answering this peer, see ProcessMessages()
+    if (IsGossipQueued(pto))
+        return true;
 
     //TRY_LOCK(cs_main, lockMain);
     //if (lockMain)
@@ -8786,7 +9782,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
         if (pto->nVersion == 0)
         {
             thread_semaphore.notify( THREAD_LOCK_CS_MAIN, CURRENT_TASK );
-            MilliSleep( 1 ); /* RGP Optimize */
             return true;
         }
 
@@ -8828,7 +9823,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
                 pto->PushMessage("ping");
             }
 
-            MilliSleep( 1 ); /* RGP Optimize */
         }
 
         thread_semaphore.notify( THREAD_LOCK_CS_MAIN, CURRENT_TASK );
@@ -8854,7 +9848,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
             pto->fStartSync = false;
             PushGetBlocks(pto, pindexBest,  pindexBest->GetBlockHash());
 
-            MilliSleep( 1 ); /* RGP Optimize */
         }
 //        else
  //       {
@@ -8869,6 +9862,9 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
 
         thread_semaphore.notify( THREAD_LOCK_CS_MAIN, CURRENT_TASK );
 
+        // Headers-first sync: header requests, stall detection, block download
+        SendHeadersSyncMessages(pto);
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -8876,7 +9872,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
         {           
                 ResendWalletTransactions();
 
-                MilliSleep( 1 ); /* RGP Optimize */
 
         }
 
@@ -8905,7 +9900,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
                             pnode->PushAddress(addr);
                     }
 
-                    MilliSleep(5);   /* RGP Optimize */
                 }
 
                 thread_semaphore.notify( THREAD_LOCK_CS_VNODES, CURRENT_TASK );
@@ -8939,7 +9933,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
 
                 //LogPrintf("*** SendMessages VADDR sent %d \n", monitor );
 
-                MilliSleep(5);   /* RGP Optimize */
             }
             pto->vAddrToSend.clear();
             if (!vAddr.empty())
@@ -8992,7 +9985,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
 
                 if ( pto->setInventoryKnown.count(inv) )
                 {
-                    MilliSleep(2);   /* RGP Optimize */
                     continue;
                 }
 
@@ -9013,7 +10005,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
                     {
                         monitor++;
                         vInvWait.push_back(inv);
-                        MilliSleep(2);   /* RGP Optimize */
                         continue;
                     }
                 }
@@ -9033,7 +10024,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
 
                 }
 
-                MilliSleep(1);   /* RGP Optimize */
             }
             pto->vInventoryToSend = vInvWait;
         }
@@ -9115,7 +10105,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
             pto->setAskFor.erase(inv.hash);
             pto->mapAskFor.erase(pto->mapAskFor.begin());
 
-            MilliSleep(5);   /* RGP Optimize */
 
         }
 
@@ -9128,7 +10117,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
             LogPrintf("*** RGP vGetData sent by Senddata \n");
 
             vGetData.clear();
-            MilliSleep( 5 );  /* RGP optimised */
         }
 
         if (fSecMsgEnabled)
@@ -9142,7 +10130,6 @@ extern bool BSC_Wallet_Synching; /* RGP defined in main.h */
        -- SendMessage is called to service message sending, --
        -- sometimes there is nothing to send.               --
        ------------------------------------------------------- */
-    MilliSleep(1);   /* RGP Optimize */
 
     return true;
 }
@@ -17,13 +17,16 @@
 #include "core.h"
 #include "bignum.h"
 #include "sync.h"
-#include "txmempool.h"
 #include "net.h"
 #include "script.h"
 #include "scrypt.h"
+#include "crypto/common.h"
 
+#include <atomic>
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+
 class CValidationState;
 
 #define START_MASTERNODE_PAYMENTS_TESTNET 1513486992 //GMT: Sunday, December 17, 2017 5:03:12 AM
@@ -50,6 +53,7 @@ class CInv;
 class CKeyItem;
 class CNode;
 class CReserveKey;
+class CTxMemPool;
 class CWallet;
 
 // from Myce
@@ -67,6 +71,12 @@ static const unsigned int MAX_BLOCK_SIZE = 30000000;  //30MB
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 /** Default for -blockprioritysize, maximum space for zero/low-fee transactions **/
 static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 50000;
+/** Default for -maxmempool, maximum megabytes of the transaction memory pool */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, hours after which a transaction leaves the memory pool */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Format of the address index, rebuilt on startup when the database holds an older one */
+static const int ADDRINDEX_VERSION = 1;
 /** The maximum size for transactions we're willing to relay/mine **/
 static const unsigned int MAX_STANDARD_TX_SIZE = MAX_BLOCK_SIZE_GEN/5;
 /** The maximum allowed number of signature check operations in a block (network rule) */
@@ -155,7 +165,45 @@ extern bool fLargeWorkInvalidChainFound;
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of gossip message threads allowed */
+static const int MAX_GOSSIP_THREADS = 8;
+/** -gossipthreads default (number of gossip message threads, 0 = handle inline) */
+static const int DEFAULT_GOSSIP_THREADS = 2;
+/** -checkblocks default (number of best chain blocks verified at startup, 0 = all) */
+static const int DEFAULT_CHECKBLOCKS = 500;
+/** -checklevel default */
+static const int DEFAULT_CHECKLEVEL = 1;
+/** Highest -checklevel run by -checkblocksbackground. Above it the checks
+ *  look at spends, which the blocks connected meanwhile keep adding. */
+static const int MAX_BACKGROUND_CHECKLEVEL = 3;
+
+/** Maximum number of headers in one "headers" message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of blocks above the best block that headers-first sync downloads in parallel */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum number of blocks requested from one peer at a time */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds a requested block may be outstanding before its peer counts as stalling */
+static const int64_t BLOCK_STALLING_TIMEOUT = 60;
+/** Seconds to wait for a reply to getheaders */
+static const int64_t HEADERS_RESPONSE_TIMEOUT = 2 * 60;
+/** Seconds without progress after which headers-first sync falls back to getblocks */
+static const int64_t HEADERS_SYNC_GIVEUP_TIMEOUT = 10 * 60;
+
+extern int nScriptCheckThreads;
+extern int nGossipThreads;
+/** Txids computed and served from the CTransaction cache, for -debug=bench */
+extern std::atomic<uint64_t> nTxHashesComputed;
+extern std::atomic<uint64_t> nTxHashesCached;
+extern bool fHeadersFirstSync;
+
+class CAddrIndexEntry;
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -184,13 +232,50 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
+
+/** Default for -blockfilemaps, number of block files kept memory mapped for reading */
+static const unsigned int DEFAULT_BLOCKFILE_MAPS = 8;
+
+/** Read-only memory mapping of a block file, unmapped when the last reference is dropped */
+class CBlockFileMapping
+{
+public:
+    const char* pBegin;
+    uint64_t nSize;
+
+    CBlockFileMapping(const char* pBeginIn, uint64_t nSizeIn) : pBegin(pBeginIn), nSize(nSizeIn) {}
+    ~CBlockFileMapping();
+
+private:
+    CBlockFileMapping(const CBlockFileMapping&);
+    CBlockFileMapping& operator=(const CBlockFileMapping&);
+};
+typedef boost::shared_ptr<const CBlockFileMapping> CBlockFileMappingRef;
+
+/** Map block file nFile covering at least nMinSize bytes, NULL if mapping is unavailable */
+CBlockFileMappingRef MapBlockFile(unsigned int nFile, uint64_t nMinSize);
+/** Map the block file holding the block stored at nBlockPos, covering the whole block */
+CBlockFileMappingRef MapBlockAt(unsigned int nFile, unsigned int nBlockPos);
+/** Drop all cached block file mappings */
+void UnmapBlockFiles();
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+/** Block of the best chain at nHeight, or NULL if the chain is shorter */
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** Make FindBlockByHeight() follow the chain ending in pindexNew */
+void SetBestChainHeightIndex(CBlockIndex* pindexNew);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
+/** Stop the script checking threads once their queue has drained */
+void InterruptScriptCheck();
+/** Run an instance of the gossip message thread */
+void ThreadGossipHandler();
+/** Stop the gossip message threads once their queue has drained */
+void InterruptGossipHandler();
 
 
 
@@ -219,7 +304,12 @@ bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree
                         bool* pfMissingInputs, bool fRejectInsaneFee=false, bool isDSTX=false);
 
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash);
+/** Page through the address index entries of dest, see CTxDB::ReadAddrIndex */
+bool FindTransactionsByDestination(const CTxDestination &dest, unsigned int nHeightStart, unsigned int nTxIndexStart, unsigned int nHeightEnd,
+                                   int nSkip, unsigned int nCount, std::vector<CAddrIndexEntry>& vEntries, bool& fMore);
+/** Rebuild the address index from the best chain, for -reindexaddr or
+ *  when the index on disk predates ADDRINDEX_VERSION */
+bool ReindexAddresses();
 
 int GetInputAge(CTxIn& vin);
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin);
@@ -238,6 +328,7 @@ void GeneratePoWcoins(bool fGenerate, CWallet* pwallet, bool fDebugConsoleOutput
 
 struct CNodeStateStats {
     int nMisbehavior;
+    int nBlocksInFlight;
 };
 
 
@@ -320,6 +411,11 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    // memory only, 0 until GetHash() is first called
+    mutable uint256 hashCached;
+
+public:
     CTransaction()
     {
 
@@ -339,6 +435,8 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+            const_cast<CTransaction*>(this)->hashCached = 0;
     )
 
     void SetNull()
@@ -350,6 +448,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        hashCached = 0;
     }
 
     bool IsNull() const
@@ -358,10 +457,37 @@ public:
         return (vin.empty() && vout.empty());
     }
 
+    /** The txid, serialized and hashed once and then cached. Code changing
+     *  the fields of a transaction that may already have been hashed must
+     *  call InvalidateHash() afterwards.
+     *
+     *  The first call writes the cache without a lock, and a reader racing
+     *  with that write can see a partly written hash. A transaction shared
+     *  between threads must therefore be hashed by its owner before it is
+     *  handed over: CScriptCheck does so when the check is queued, and the
+     *  rescan and address index workers only hash blocks they read
+     *  themselves, handing them back through a thread join.
+     */
     uint256 GetHash() const
     {
+        if (hashCached == 0)
+        {
+            hashCached = SerializeHash(*this);
+            nTxHashesComputed.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+            nTxHashesCached.fetch_add(1, std::memory_order_relaxed);
+        return hashCached;
+    }
+
+    bool IsHashCached() const
+    {
+        return hashCached != 0;
+    }
 
-        return SerializeHash(*this);
+    void InvalidateHash()
+    {
+        hashCached = 0;
     }
 
     bool IsCoinBase() const
@@ -413,8 +539,12 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
-      
-        
+        // Transaction deserialization is disabled below, so without pfileRet
+        // this only has to find the block file. A cached mapping of it
+        // answers that without opening the file.
+        if (!pfileRet && MapBlockFile(pos.nFile, (uint64_t)pos.nTxPos + 1))
+            return true;
+
         CAutoFile filein = CAutoFile(  OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (filein.IsNull())
         {
@@ -508,7 +638,7 @@ LogPrintf("CTransaction::ReadFromDisk() : fseek failed \n");
      @return    Returns true if all inputs are in txdb or mapTestPool
      */
     bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const;
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
@@ -519,11 +649,13 @@ LogPrintf("CTransaction::ReadFromDisk() : fseek failed \n");
         @param[in] pindexBlock
         @param[in] fBlock   true if called from ConnectBlock
         @param[in] fMiner   true if called from CreateNewBlock
+        @param[out] pvChecks    If not NULL, signature checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true,
+                       std::vector<CScriptCheck> *pvChecks = NULL) const;
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
@@ -536,6 +668,46 @@ LogPrintf("CTransaction::ReadFromDisk() : fseek failed \n");
 
 
 
+/** Closure representing one script verification
+ *  Note that this stores references to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+    boost::shared_ptr<const CSignatureHashCache> pSigHashCache;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashCache>& pSigHashCacheIn = boost::shared_ptr<const CSignatureHashCache>()) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pSigHashCache(pSigHashCacheIn)
+    {
+        // The check runs on a -par worker, which may hash ptxTo to report a
+        // failure. Cache the txid here, before the hand-off, see GetHash().
+        txToIn.GetHash();
+        assert(txToIn.IsHashCached());
+    }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+        pSigHashCache.swap(check.pSigHashCache);
+    }
+};
+
+
+
+
 /** wrapper for CTxOut that provides a more compact serialization */
 class CTxOutCompressor
 {
@@ -708,6 +880,64 @@ public:
 };
 
 
+/** Key of an address index record: the address id, then the best chain
+ * height of the block holding the transaction and its place in that block.
+ * The numbers are stored big-endian so LevelDB keeps the transactions of an
+ * address in chain order and a page can start anywhere with one seek.
+ */
+class CAddrIndexKey
+{
+public:
+    uint160 addrHash;
+    unsigned int nHeight;
+    unsigned int nTxIndex;
+
+    CAddrIndexKey() : addrHash(0), nHeight(0), nTxIndex(0) {}
+
+    CAddrIndexKey(const uint160& addrHashIn, unsigned int nHeightIn, unsigned int nTxIndexIn) :
+        addrHash(addrHashIn), nHeight(nHeightIn), nTxIndex(nTxIndexIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 28;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char vch[28];
+        memcpy(vch, addrHash.begin(), 20);
+        WriteBE32(vch + 20, nHeight);
+        WriteBE32(vch + 24, nTxIndex);
+        s.write((const char*)vch, sizeof(vch));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char vch[28];
+        s.read((char*)vch, sizeof(vch));
+        memcpy(addrHash.begin(), vch, 20);
+        nHeight = ReadBE32(vch + 20);
+        nTxIndex = ReadBE32(vch + 24);
+    }
+};
+
+/** A transaction filed under an address, with where to read it from */
+class CAddrIndexEntry
+{
+public:
+    CAddrIndexKey key;
+    uint256 hashTx;
+    CDiskTxPos pos;
+
+    CAddrIndexEntry() {}
+
+    CAddrIndexEntry(const CAddrIndexKey& keyIn, const uint256& hashTxIn, const CDiskTxPos& posIn) :
+        key(keyIn), hashTx(hashTxIn), pos(posIn) {}
+};
+
+
 
 
 
@@ -746,6 +976,15 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    // memory only, the header fields hashCached was computed from. The
+    // miners change nNonce and nTime in place, so the cache is checked
+    // against the fields rather than invalidated by hand.
+    mutable unsigned char vchHeaderCached[80];
+    mutable bool fHashCached;
+    mutable uint256 hashCached;
+
+public:
     CBlock()
     {
         SetNull();
@@ -786,6 +1025,7 @@ public:
         vchBlockSig.clear();
         vMerkleTree.clear();
         nDoS = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -795,7 +1035,13 @@ public:
 
     uint256 GetHash() const
     {
-        return Hash(BEGIN(nVersion), END(nNonce));
+        if (!fHashCached || memcmp(vchHeaderCached, BEGIN(nVersion), sizeof(vchHeaderCached)) != 0)
+        {
+            hashCached = Hash(BEGIN(nVersion), END(nNonce));
+            memcpy(vchHeaderCached, BEGIN(nVersion), sizeof(vchHeaderCached));
+            fHashCached = true;
+        }
+        return hashCached;
     }
 
     uint256 GetPoWHash() const
@@ -927,19 +1173,38 @@ public:
     {
         SetNull();
 	//LogPrintf("RGP Read From other 001 nBlockPos %d \n", nBlockPos); 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (filein.IsNull())
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
 
-        // Read block
-        try {
-            filein >> *this;
+        // Deserialize straight out of the mapped block file when possible
+        CBlockFileMappingRef mapping = MapBlockAt(nFile, nBlockPos);
+        if (mapping)
+        {
+            CMemoryReader reader(mapping->pBegin + nBlockPos, mapping->pBegin + mapping->nSize, SER_DISK, CLIENT_VERSION);
+            if (!fReadTransactions)
+                reader.nType |= SER_BLOCKHEADERONLY;
+
+            try {
+                reader >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
         }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+        else
+        {
+            // Open history file to read
+            CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+            if (!fReadTransactions)
+                filein.nType |= SER_BLOCKHEADERONLY;
+
+            // Read block
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
         }
 
 
@@ -992,7 +1257,6 @@ public:
     bool AcceptBlock();
     bool SignBlock(CWallet& keystore, int64_t nFees);
     bool CheckBlockSignature() const;
-    void RebuildAddressIndex(CTxDB& txdb);
 
 private:
     bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
@@ -1721,4 +1985,7 @@ protected:
     friend void ::UnregisterAllWallets();
 };
 
+// CTxMemPool holds CTransaction by value, so it comes after the definition
+#include "txmempool.h"
+
 #endif
@@ -12,8 +12,6 @@
 CCriticalSection cs_masternodes;
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasternodeScanningErrors;
-// cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
 
 
 struct CompareValueOnly
@@ -25,49 +23,20 @@ struct CompareValueOnly
     }
 };
 
-//Get the last hash that matches the modulus given. Processed in reverse order
+//Get the hash of the best chain block below nBlockHeight (0 = the tip's height)
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-
-    // LogPrintf("*** RGP Masternode::GetBlockHash Start \n");
-
     if (pindexBest == NULL) return false;
 
     if(nBlockHeight == 0)
         nBlockHeight = pindexBest->nHeight;
 
-    if(mapCacheBlockHashes.count(nBlockHeight))
-    {
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
-
-    const CBlockIndex *BlockLastSolved = pindexBest;
-    const CBlockIndex *BlockReading = pindexBest;
-
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || pindexBest->nHeight+1 < nBlockHeight) return false;
-
-    int nBlocksAgo = 0;
-    if(nBlockHeight > 0) nBlocksAgo = (pindexBest->nHeight+1)-nBlockHeight;
-    assert(nBlocksAgo >= 0);
-
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if(n >= nBlocksAgo){
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-
-            return true;
-        }
-        n++;
-
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
-    }
-
-    //LogPrintf("*** RGP GetBlockHash FAILED \n");
+    // the genesis block is never used
+    CBlockIndex* pindex = FindBlockByHeight(nBlockHeight - 1);
+    if (pindex == NULL || pindex->nHeight == 0) return false;
 
-    return false;
+    hash = pindex->GetBlockHash();
+    return true;
 }
 
 CMasternode::CMasternode()
@@ -84,6 +53,7 @@ CMasternode::CMasternode()
     lastTimeSeen = 0;
     cacheInputAge = 0;
     cacheInputAgeBlock = 0;
+    hashCollateralChecked = 0;
     unitTest = false;
     allowFreeTx = true;
     protocolVersion = PROTOCOL_VERSION;
@@ -115,6 +85,7 @@ CMasternode::CMasternode(const CMasternode& other)
     lastTimeSeen = other.lastTimeSeen;
     cacheInputAge = other.cacheInputAge;
     cacheInputAgeBlock = other.cacheInputAgeBlock;
+    hashCollateralChecked = other.hashCollateralChecked;
     unitTest = other.unitTest;
     allowFreeTx = other.allowFreeTx;
     protocolVersion = other.protocolVersion;
@@ -146,6 +117,7 @@ CMasternode::CMasternode(CService newAddr, CTxIn newVin, CPubKey newPubkey, std:
     lastTimeSeen = 0;
     cacheInputAge = 0;
     cacheInputAgeBlock = 0;
+    hashCollateralChecked = 0;
     unitTest = false;
     allowFreeTx = true;
     protocolVersion = protocolVersionIn;
@@ -230,9 +202,12 @@ LogPrintf("*** RGP CMasterNode::Check UpdatedWithin failed, MASTERNODE_REMOVE se
 
 //LogPrintf("RGP CMasternode::Check() Debug 004  \n");
 
-    if( !unitTest )
+    // The collateral can only have been spent by a block since the last
+    // check, so it is checked once per best block rather than on every call
+    if( !unitTest && pindexBest != NULL && hashCollateralChecked != hashBestChain )
     {
 LogPrintf("*** RGP CMasterNode::Check Debug 005 Unit Test \n");
+        hashCollateralChecked = hashBestChain;
         CValidationState state;
         CTransaction tx = CTransaction();
         CTxOut vout = CTxOut((GetMNCollateral(pindexBest->nHeight)-1)*COIN, darkSendPool.collateralPubKey);
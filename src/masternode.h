@@ -39,7 +39,6 @@ using namespace std;
 class CMasternode;
 
 extern CCriticalSection cs_masternodes;
-extern map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
@@ -73,6 +72,7 @@ public:
     int64_t lastTimeSeen;
     int cacheInputAge;
     int cacheInputAgeBlock;
+    uint256 hashCollateralChecked; // best block the collateral was last checked against
     bool unitTest;
     bool allowFreeTx;
     int protocolVersion;
@@ -112,6 +112,7 @@ public:
         swap(first.lastTimeSeen, second.lastTimeSeen);
         swap(first.cacheInputAge, second.cacheInputAge);
         swap(first.cacheInputAgeBlock, second.cacheInputAgeBlock);
+        swap(first.hashCollateralChecked, second.hashCollateralChecked);
         swap(first.unitTest, second.unitTest);
         swap(first.allowFreeTx, second.allowFreeTx);
         swap(first.protocolVersion, second.protocolVersion);
@@ -10,6 +10,8 @@
 
 #include "net.h"
 
+#include <deque>
+
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
 
@@ -30,28 +32,36 @@ static    std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
 CCriticalSection cs_process_message;
 
+// Score tables by the block hash they were calculated from, see
+// CMasternodeMan::GetScoreTable(). Entries are (score, index in
+// vMasternodes), so all tables are dropped when vMasternodes changes.
+static std::map<uint256, std::vector<pair<unsigned int, unsigned int> > > mapScoreTables;
+static std::deque<uint256> vScoreTableHashes;
 
-
-struct CompareValueOnly
+static void ClearScoreTables()
 {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-                    const pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-struct CompareValueOnlyMN
+    mapScoreTables.clear();
+    vScoreTableHashes.clear();
+}
+
+// Best score first, ties in vMasternodes order
+struct CompareScoreTableEntry
 {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-                    const pair<int64_t, CMasternode>& t2) const
+    bool operator()(const pair<unsigned int, unsigned int>& t1,
+                    const pair<unsigned int, unsigned int>& t2) const
     {
-        return t1.first < t2.first;
+        if (t1.first != t2.first)
+            return t1.first > t2.first;
+        return t1.second < t2.second;
     }
 };
 
 
 
 
+
+
+
 //
 // CMasternodeDB
 //
@@ -169,6 +179,7 @@ LogPrintf("*** RGP CMasternodeDB::Read Debug 005 \n");
         }
 
         // de-serialize address data into one CMnList object
+        ClearScoreTables();
         ssMasternodes >> mnodemanToLoad;
     }
     catch (std::exception &e) {
@@ -241,6 +252,7 @@ bool CMasternodeMan::Add(CMasternode &mn)
         LogPrintf("*** RGP CMasternodeMan::Add Debug MN node Masternode is added Debug 002\n" );
 
         vMasternodes.push_back(mn);
+        ClearScoreTables();
 
  //   CTxIn search_vin;
  //   CMasternode* pmn;
@@ -379,6 +391,7 @@ void CMasternodeMan::Clear()
     LogPrintf("*** RGP CMasternodeMan::Clear Start \n");
 
     vMasternodes.clear();
+    ClearScoreTables();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -571,108 +584,94 @@ CMasternode *CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude
     return NULL;
 }
 
-CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+const std::vector<pair<unsigned int, unsigned int> >* CMasternodeMan::GetScoreTable(int64_t nBlockHeight)
 {
-    unsigned int score = 0;
-    CMasternode* winner = NULL;
-
-    LogPrintf("*** RGP GetCurrentMasterNode start  \n");
+    AssertLockHeld(cs);
 
-    /* RGP : 13th April 2021 update this line to build vMasternodes */
-    std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+    //make sure we know about this block
+    uint256 hash = 0;
+    if(!GetBlockHash(hash, nBlockHeight)) return NULL;
 
-    if ( vMasternodes.empty() )
-    {
+    std::map<uint256, std::vector<pair<unsigned int, unsigned int> > >::iterator mi = mapScoreTables.find(hash);
+    if (mi != mapScoreTables.end())
+        return &mi->second;
 
-        LogPrintf("*** RGP vMasternodes empty returning null winner \n");
-        return winner;
-    }
+    std::vector<pair<unsigned int, unsigned int> >& vecScores = mapScoreTables[hash];
+    vScoreTableHashes.push_back(hash);
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+    // The collateral checks in CMasternode::Check() are cached per best block,
+    // running it here keeps activeState as fresh as a check per call did
+    vecScores.reserve(vMasternodes.size());
+    for (unsigned int i = 0; i < vMasternodes.size(); i++)
     {
-
-        /* -------------------------------------------------------------------
-           -- RGP, Patch for BSG-182, where rewards are updated, but old MN --
-           -- are not replying. Using GHaydons MN at the moment for the     --
-           -- rewards fix.                                                  --
-           ------------------------------------------------------------------- */
-        LogPrintf("*** RGP GetCurrentMasterNode loop MN addr %s \n", mn.addr.ToString() );
-
-        //if ( mn.addr.ToString() == "143.198.227.129:23980" )
-        //{
-        //    /* RGP, this is GHayden's MN */
-        //    // calculate the score for each masternode
-        //    uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        //    unsigned int n2 = 0;
-        //    memcpy(&n2, &n, sizeof(n2));
-        //    winner = &mn;
-        //    break;
-        //}
-
+        CMasternode& mn = vMasternodes[i];
         mn.Check();
-        LogPrintf("*** RGP RGP GetCurrentMasterNode %s \n",  mn.addr.ToString() );
-        if(mn.protocolVersion < minProtocol || !mn.IsEnabled())
-        {
-            LogPrintf("*** RGP GetCurrentMasterNode Protocol failure %d \n", mn.protocolVersion  );
-            continue;
-
-        }
 
-        // calculate the score for each masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
+        uint256 n = mn.CalculateScore(1, nBlockHeight);
         unsigned int n2 = 0;
         memcpy(&n2, &n, sizeof(n2));
 
-        // determine the winner
-        if(n2 > score)
-        {
-            score = n2;
-            winner = &mn;
-
-            LogPrintf("*** RGP MasterNode Winner of Stake %s \n", winner->addr.ToString() );
-
-        }
+        vecScores.push_back(make_pair(n2, i));
+    }
+    sort(vecScores.begin(), vecScores.end(), CompareScoreTableEntry());
 
+    while (vScoreTableHashes.size() > MASTERNODES_SCORE_TABLES)
+    {
+        mapScoreTables.erase(vScoreTableHashes.front());
+        vScoreTableHashes.pop_front();
     }
 
-    LogPrintf("*** RGP GetCurrentMasterNode end winner node %s \n", winner->addr.ToString() );
+    return &mapScoreTables[hash];
+}
 
-    return winner;
+void CMasternodeMan::UpdateScoreTable(int64_t nBlockHeight)
+{
+    LOCK(cs);
+    GetScoreTable(nBlockHeight);
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-     //LogPrintf("*** RGP CMasternodeMan::GetMasternodeRank Start \n");
+    const std::vector<pair<unsigned int, unsigned int> >* pvecScores = GetScoreTable(nBlockHeight);
+    if (pvecScores == NULL)
+        return NULL;
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return -1;
+    // the winner is the enabled masternode with the best non-zero score
+    BOOST_FOREACH(const PAIRTYPE(unsigned int, unsigned int)& s, *pvecScores)
+    {
+        if (s.first == 0)
+            break;
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        CMasternode& mn = vMasternodes[s.second];
+        if(mn.protocolVersion < minProtocol || !mn.IsEnabled())
+            continue;
 
-        if(mn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            mn.Check();
-            if(!mn.IsEnabled()) continue;
-        }
+        LogPrint("masternode", "GetCurrentMasterNode() : winner %s\n", mn.addr.ToString());
+        return &mn;
+    }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    return NULL;
+}
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
+    const std::vector<pair<unsigned int, unsigned int> >* pvecScores = GetScoreTable(nBlockHeight);
+    if (pvecScores == NULL)
+        return -1;
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
+    BOOST_FOREACH(const PAIRTYPE(unsigned int, unsigned int)& s, *pvecScores)
+    {
+        CMasternode& mn = vMasternodes[s.second];
+        if(mn.protocolVersion < minProtocol) continue;
+        if(fOnlyActive && !mn.IsEnabled()) continue;
+
         rank++;
-        if(s.second == vin) {
+        if(mn.vin == vin) {
             return rank;
         }
     }
@@ -682,36 +681,23 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<unsigned int, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+    LOCK(cs);
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-
-        mn.Check();
+    const std::vector<pair<unsigned int, unsigned int> >* pvecScores = GetScoreTable(nBlockHeight);
+    if (pvecScores == NULL)
+        return vecMasternodeRanks;
 
+    int rank = 0;
+    BOOST_FOREACH(const PAIRTYPE(unsigned int, unsigned int)& s, *pvecScores)
+    {
+        CMasternode& mn = vMasternodes[s.second];
         if(mn.protocolVersion < minProtocol) continue;
-        if(!mn.IsEnabled()) {
-            continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnlyMN());
+        if(!mn.IsEnabled()) continue;
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CMasternode)& s, vecMasternodeScores){
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        vecMasternodeRanks.push_back(make_pair(rank, mn));
     }
 
     return vecMasternodeRanks;
@@ -719,31 +705,22 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    const std::vector<pair<unsigned int, unsigned int> >* pvecScores = GetScoreTable(nBlockHeight);
+    if (pvecScores == NULL)
+        return NULL;
 
+    int rank = 0;
+    BOOST_FOREACH(const PAIRTYPE(unsigned int, unsigned int)& s, *pvecScores)
+    {
+        CMasternode& mn = vMasternodes[s.second];
         if(mn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            mn.Check();
-            if(!mn.IsEnabled()) continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+        if(fOnlyActive && !mn.IsEnabled()) continue;
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
         rank++;
         if(rank == nRank) {
-            return Find(s.second);
+            return &mn;
         }
     }
 
@@ -1146,7 +1123,7 @@ LogPrintf("RGP MN ProcessMessage Debug DSEE 301 \n");
             {
                 CBlockIndex* pMNIndex = (*mi).second; // block for 10000 SocietyG tx -> 1 confirmation
                 CBlockIndex* pConfIndex = FindBlockByHeight((pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1)); // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-                if(pConfIndex->GetBlockTime() > sigTime)
+                if(pConfIndex && pConfIndex->GetBlockTime() > sigTime)
                 {
                     LogPrintf("dsee - Bad sigTime %d for masternode %20s %105s (%i conf block is at %d)\n",
                               sigTime, addr.ToString(), vin.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
@@ -1549,7 +1526,7 @@ LogPrintf("RGP MN ProcessMessage Debug 300 \n\n");
 
                 CBlockIndex* pMNIndex = (*mi).second; // block for 150, 000 SocietyG tx -> 1 confirmation
                 CBlockIndex* pConfIndex = FindBlockByHeight((pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1)); // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-                if(pConfIndex->GetBlockTime() > sigTime)
+                if(pConfIndex && pConfIndex->GetBlockTime() > sigTime)
                 {
                     LogPrintf("dsee+ - Bad sigTime %d for masternode %20s %105s (%i conf block is at %d)\n",
                               sigTime, addr.ToString(), vin.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
@@ -19,6 +19,7 @@
 
 #define MASTERNODES_DUMP_SECONDS               (15*60)
 #define MASTERNODES_DSEG_SECONDS               (3*60*60)
+#define MASTERNODES_SCORE_TABLES               100 // block hashes with a cached score table
 
 using namespace std;
 
@@ -71,6 +72,9 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
+    // Scores of all masternodes for the block used at nBlockHeight, best first
+    const std::vector<pair<unsigned int, unsigned int> >* GetScoreTable(int64_t nBlockHeight);
+
     // map to hold all MNs
     //std::vector<CMasternode> vMasternodes;
     // who's asked for the masternode list and the last time
@@ -158,6 +162,9 @@ LogPrintf("RGP GetFullMasternodeVector returning %d \n", vMasternodes.size() );
         return vMasternodes;
     }
 
+    // Calculate the scores used to pay and rank masternodes at nBlockHeight
+    void UpdateScoreTable(int64_t nBlockHeight);
+
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol=0);
     int GetMasternodeRank(const CTxIn &vin, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
     CMasternode* GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
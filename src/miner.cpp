@@ -107,13 +107,13 @@ class COrphan
 {
     public:
 
-        CTransaction* ptx;
+        const CTxMemPoolEntry* ptx;
         set<uint256> setDependsOn;
 
         double dPriority;
         double dFeePerKb;
 
-        COrphan(CTransaction* ptxIn)
+        COrphan(const CTxMemPoolEntry* ptxIn)
         {
             ptx = ptxIn;
             dPriority = dFeePerKb = 0;
@@ -127,7 +127,7 @@ int64_t nLastCoinStakeSearchInterval = 0;
 
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority; class TxPriorityCompare
+typedef boost::tuple<double, double, const CTxMemPoolEntry*> TxPriority; class TxPriorityCompare
 {
     bool byFee;
 
@@ -159,6 +159,284 @@ typedef boost::tuple<double, double, CTransaction*> TxPriority; class TxPriority
         }
 };
 
+// Queue the memory pool transactions that can go into a block at nHeight,
+// using the fee, size and priority cached in their pool entries. Those that
+// spend another pool transaction wait in vOrphan until it has been added.
+static void CollectPoolTransactions(int nHeight, list<COrphan>& vOrphan,
+                                    map<uint256, vector<COrphan*> >& mapDependers,
+                                    vector<TxPriority>& vecPriority)
+{
+    AssertLockHeld(mempool.cs);
+
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+    {
+        const CTransaction& tx = mi->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            continue;
+
+        // Priority is sum(valuein * age) / txsize, as of the block before nHeight
+        double dPriority = mi->GetPriority(nHeight - 1);
+
+        // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+        // client code rounds up the size to the nearest 1K. That's good, because it gives an
+        // incentive to create smaller transactions.
+        double dFeePerKb = mi->GetFeePerKb();
+
+        if (mi->GetCountWithAncestors() == 1)
+        {
+            vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi)));
+            continue;
+        }
+
+        // Has to wait for dependencies
+        // Use list for automatic deletion
+        vOrphan.push_back(COrphan(&(*mi)));
+        COrphan* porphan = &vOrphan.back();
+        porphan->dPriority = dPriority;
+        porphan->dFeePerKb = dFeePerKb;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            if (mempool.mapTx.count(txin.prevout.hash) && porphan->setDependsOn.insert(txin.prevout.hash).second)
+                mapDependers[txin.prevout.hash].push_back(porphan);
+        }
+    }
+}
+
+/** Pool transactions picked for a block on top of hashPrevBlock.
+ *  The last selection is kept so that, while the best block stays the same,
+ *  a new template only has to try the pool entries that arrived since.
+ *  Guarded by cs_main and mempool.cs. */
+class CTxSelection
+{
+public:
+    uint256 hashPrevBlock;
+    uint64_t nPoolSequence;     // Newest pool entry considered
+    int64_t nPoolTime;          // Entry time of the newest pool entry considered
+    unsigned int nPoolRemoved;  // Pool removals already checked for
+
+    std::vector<CTransaction> vtx;
+    std::map<uint256, CTxIndex> mapTestPool;
+    uint64_t nBlockSize;
+    int nBlockSigOps;
+    int64_t nFees;
+
+    CTxSelection()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        hashPrevBlock = 0;
+        nPoolSequence = 0;
+        nPoolTime = 0;
+        nPoolRemoved = 0;
+        vtx.clear();
+        mapTestPool.clear();
+        nBlockSize = 1000;
+        nBlockSigOps = 100;
+        nFees = 0;
+    }
+};
+
+static CTxSelection txSelection;
+
+// Whether entry fits in the selection under the size, sigop and time limits
+static bool SelectionHasRoom(const CTxSelection& sel, const CTxMemPoolEntry& entry, unsigned int nBlockMaxSize, int64_t nMaxTxTime)
+{
+    // Size limits
+    if (sel.nBlockSize + entry.GetTxSize() >= nBlockMaxSize)
+        return false;
+
+    // Limits on sigOps, legacy and P2SH:
+    if (sel.nBlockSigOps + entry.GetSigOps() >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    // Timestamp limit
+    if (entry.GetTx().nTime > nMaxTxTime)
+        return false;
+
+    return true;
+}
+
+// Connect entry on top of the selection and append it, false if it does not connect
+static bool AddToSelection(CTxDB& txdb, CBlockIndex* pindexPrev, CTxSelection& sel, const CTxMemPoolEntry& entry)
+{
+    const CTransaction& tx = entry.GetTx();
+
+    // Connecting shouldn't fail due to dependency on other memory pool transactions
+    // because we're already processing them in order of dependency
+    map<uint256, CTxIndex> mapTestPoolTmp(sel.mapTestPool);
+    MapPrevTx mapInputs;
+    bool fInvalid;
+    if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+        return false;
+
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+        return false;
+
+    mapTestPoolTmp[entry.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+    swap(sel.mapTestPool, mapTestPoolTmp);
+
+    sel.vtx.push_back(tx);
+    sel.nBlockSize += entry.GetTxSize();
+    sel.nBlockSigOps += entry.GetSigOps();
+    sel.nFees += entry.GetFee();
+    return true;
+}
+
+// Select from the whole pool, high priority transactions first and then by fee
+static void SelectAllTransactions(CTxDB& txdb, CBlockIndex* pindexPrev, CTxSelection& sel,
+                                  unsigned int nBlockMaxSize, unsigned int nBlockPrioritySize,
+                                  unsigned int nBlockMinSize, int64_t nMinTxFee, int64_t nMaxTxTime)
+{
+    sel.SetNull();
+    sel.hashPrevBlock = pindexPrev->GetBlockHash();
+    sel.nPoolSequence = mempool.GetLastSequence();
+    sel.nPoolRemoved = mempool.GetTransactionsRemoved();
+    if (!mempool.mapTx.empty())
+        sel.nPoolTime = mempool.mapTx.get<mempool_entry_time>().rbegin()->GetTime();
+
+    // Priority order to process transactions
+    list<COrphan> vOrphan; // list memory doesn't move
+    map<uint256, vector<COrphan*> > mapDependers;
+
+    // This vector will be sorted into a priority queue:
+    vector<TxPriority> vecPriority;
+    CollectPoolTransactions(pindexPrev->nHeight + 1, vOrphan, mapDependers, vecPriority);
+
+    bool fSortedByFee = (nBlockPrioritySize <= 0);
+
+    TxPriorityCompare comparer(fSortedByFee);
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+    while (!vecPriority.empty())
+    {
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().get<0>();
+        double dFeePerKb = vecPriority.front().get<1>();
+        const CTxMemPoolEntry& entry = *(vecPriority.front().get<2>());
+        unsigned int nTxSize = entry.GetTxSize();
+
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        if (!SelectionHasRoom(sel, entry, nBlockMaxSize, nMaxTxTime))
+            continue;
+
+        // Skip free transactions if we're past the minimum block size:
+        if (fSortedByFee && (dFeePerKb < nMinTxFee) && (sel.nBlockSize + nTxSize >= nBlockMinSize))
+            continue;
+
+        // Prioritize by fee once past the priority size or we run out of high-priority
+        // transactions:
+        if (!fSortedByFee && ((sel.nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
+        {
+            fSortedByFee = true;
+            comparer = TxPriorityCompare(fSortedByFee);
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        }
+
+        if (!AddToSelection(txdb, pindexPrev, sel, entry))
+            continue;
+
+        if (fDebug && GetBoolArg("-printpriority", false))
+            LogPrint("miner", "%s : priority %.1f feeperkb %.1f txid %s\n", __FUNCTION__, dPriority, dFeePerKb, entry.GetHash().ToString());
+
+        // Add transactions that depend on this one to the priority queue
+        const uint256& hash = entry.GetHash();
+        if (mapDependers.count(hash))
+        {
+            BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+            {
+                if (!porphan->setDependsOn.empty())
+                {
+                    porphan->setDependsOn.erase(hash);
+                    if (porphan->setDependsOn.empty())
+                    {
+                        vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                        std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static bool CompareEntrySequence(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b)
+{
+    return a->GetSequence() < b->GetSequence();
+}
+
+// Append the pool entries that arrived since sel was made. Returns false if
+// the selection has to be made again from the whole pool: on a new best
+// block, when a selected transaction has left the pool, or when the new
+// entries do not all fit and the fee order has to decide. New entries are
+// only judged by fee, the priority area is left as the full pass filled it.
+static bool UpdateSelection(CTxDB& txdb, CBlockIndex* pindexPrev, CTxSelection& sel,
+                            unsigned int nBlockMaxSize, unsigned int nBlockMinSize,
+                            int64_t nMinTxFee, int64_t nMaxTxTime)
+{
+    if (sel.hashPrevBlock != pindexPrev->GetBlockHash())
+        return false;
+
+    if (sel.nPoolRemoved != mempool.GetTransactionsRemoved())
+    {
+        BOOST_FOREACH(const CTransaction& tx, sel.vtx)
+            if (!mempool.mapTx.count(tx.GetHash()))
+                return false;
+        sel.nPoolRemoved = mempool.GetTransactionsRemoved();
+    }
+
+    // New entries are at the recent end of the entry time index. One that
+    // got an older time from a clock step back waits for the next full pass.
+    vector<const CTxMemPoolEntry*> vNew;
+    uint64_t nNewSize = 0;
+    typedef indexed_transaction_set::index<mempool_entry_time>::type::const_reverse_iterator timeiter;
+    for (timeiter it = mempool.mapTx.get<mempool_entry_time>().rbegin();
+         it != mempool.mapTx.get<mempool_entry_time>().rend() && it->GetTime() >= sel.nPoolTime; ++it)
+    {
+        if (it->GetSequence() <= sel.nPoolSequence)
+            continue;
+        vNew.push_back(&(*it));
+        nNewSize += it->GetTxSize();
+    }
+    if (vNew.empty())
+        return true;
+
+    if (sel.nBlockSize + nNewSize >= nBlockMaxSize)
+        return false;
+
+    // Arrival order puts parents before their children
+    std::sort(vNew.begin(), vNew.end(), CompareEntrySequence);
+
+    int nHeight = pindexPrev->nHeight + 1;
+    BOOST_FOREACH(const CTxMemPoolEntry* pentry, vNew)
+    {
+        const CTransaction& tx = pentry->GetTx();
+        sel.nPoolTime = std::max(sel.nPoolTime, pentry->GetTime());
+
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            continue;
+
+        if (!SelectionHasRoom(sel, *pentry, nBlockMaxSize, nMaxTxTime))
+            continue;
+
+        // Skip free transactions if we're past the minimum block size:
+        if ((pentry->GetFeePerKb() < nMinTxFee) && (sel.nBlockSize + pentry->GetTxSize() >= nBlockMinSize))
+            continue;
+
+        AddToSelection(txdb, pindexPrev, sel, *pentry);
+    }
+    sel.nPoolSequence = mempool.GetLastSequence();
+
+    return true;
+}
+
 
 CBlock* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet *pwallet)
 {
@@ -181,7 +459,6 @@ CBlock* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet *pwallet)
     }
 
     CBlockIndex* pindexPrev = pindexBest;
-    int nHeight = pindexPrev->nHeight + 1;
 
     // Create coinbase tx
     CTransaction txNew;
@@ -232,231 +509,15 @@ CBlock* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet *pwallet)
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
 
-        //>SOCG<
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-
-            LogPrintf("*** RGP miner loop 5 \n");
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-            {
-                continue;
-            }
-
-            COrphan* porphan = NULL;
-
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-
-            bool fMissingInputs = false;
-
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-
-                LogPrintf("*** RGP miner loop 6 \n");
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        if (fDebug)
-                        {
-                            LogPrint("mempool", "%s : ERROR: mempool transaction missing input\n", __FUNCTION__);
-
-                            assert("mempool transaction missing input" == 0);
-                        }
-
-                        fMissingInputs = true;
-
-                        if (porphan)
-                        {
-                            vOrphan.pop_back();
-                        }
-
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    
-                    continue;
-                }
-
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-
-            if (fMissingInputs)
-            {
-                continue;
-            }
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-            {
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-            }
-        }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            LogPrintf("*** RGP miner loop 7 \n");
-
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-            {
-                continue;
-            }
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-            {
-                continue;
-            }
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (false && tx.nTime > pblock->vtx[0].nTime))
-            {
-                continue;
-            }
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-            {
-                continue;
-            }
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee && ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-
-            bool fInvalid;
-            
-            LogPrintf("RGP DEBUG [Miner] CreateNewBlockWithKey calling FetchInputs \n");
-            
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-            {
-                continue;
-            }
-
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-            {
-                continue;
-            }
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
-            {
-                continue;
-            }
-
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && GetBoolArg("-printpriority", false))
-            {
-                LogPrint("miner", "%s : priority %.1f feeperkb %.1f txid %s\n", __FUNCTION__, dPriority, dFeePerKb, tx.GetHash().ToString());
-            }
+        // Reuse the selection made on top of this block where possible
+        int64_t nMaxTxTime = GetAdjustedTime();
+        if (!UpdateSelection(txdb, pindexPrev, txSelection, nBlockMaxSize, nBlockMinSize, nMinTxFee, nMaxTxTime))
+            SelectAllTransactions(txdb, pindexPrev, txSelection, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize, nMinTxFee, nMaxTxTime);
 
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    LogPrintf("*** RGP miner loop 10 \n");
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        pblock->vtx.insert(pblock->vtx.end(), txSelection.vtx.begin(), txSelection.vtx.end());
+        uint64_t nBlockSize = txSelection.nBlockSize;
+        uint64_t nBlockTx = txSelection.vtx.size();
+        nFees = txSelection.nFees;
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -469,6 +530,7 @@ CBlock* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet *pwallet)
         // >SOCG< POW
 
         pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(pindexPrev->nHeight + 1, nFees);
+        pblock->vtx[0].InvalidateHash();
 
 LogPrintf(" RGP CREATNEWBLOCKwithKey() Pow reward %d \n", pblock->vtx[0].vout[0].nValue );
 
@@ -624,232 +686,18 @@ LogPrintf("RGP DEBUG Proof of Stake Debug 004 \n");
 
 //LogPrintf("RGP DEBUG  003 \n");
 
-        //>SOCG<
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-
-//LogPrintf("*** RGP miner loop 11 \n");
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-            {
-                continue;
-            }
-
-            COrphan* porphan = NULL;
-
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-
-            bool fMissingInputs = false;
-
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-//LogPrintf("*** RGP miner loop 12 \n");
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        if (fDebug)
-                        {
-                            LogPrint("mempool", "%s : ERROR: mempool transaction missing input\n", __FUNCTION__);
-
-                            assert("mempool transaction missing input" == 0);
-                        }
-
-                        fMissingInputs = true;
-
-                        if (porphan)
-                        {
-                            vOrphan.pop_back();
-                        }
-
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    
-                    continue;
-                }
-
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-
-            if (fMissingInputs)
-            {
-                continue;
-            }
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-            {
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-            }
-        }
-
-//LogPrintf("RGP DEBUG  010 \n");
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            LogPrintf("*** RGP miner loop 13 \n");
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-            {
-                continue;
-            }
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-            {
-                continue;
-            }
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-            {
-                continue;
-            }
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-            {
-                continue;
-            }
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee && ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-
-            bool fInvalid;
-LogPrintf("RGP DEBUG [Miner] CreateNewBlock calling FetchInputs \n");
-            
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-            {
-                continue;
-            }
-
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-            {
-                continue;
-            }
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
-            {
-                continue;
-            }
-
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            //if (fDebug && GetBoolArg("-printpriority", false))
-            //{
-                LogPrint("miner", "%s : priority %.1f feeperkb %.1f txid %s\n", __FUNCTION__, dPriority, dFeePerKb, tx.GetHash().ToString());
-           // }
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    LogPrintf("*** RGP miner loop 14 \n");
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        // Reuse the selection made on top of this block where possible,
+        // a coinstake block may not hold transactions newer than itself
+        int64_t nMaxTxTime = GetAdjustedTime();
+        if (fProofOfStake)
+            nMaxTxTime = std::min(nMaxTxTime, (int64_t)pblock->vtx[0].nTime);
+        if (!UpdateSelection(txdb, pindexPrev, txSelection, nBlockMaxSize, nBlockMinSize, nMinTxFee, nMaxTxTime))
+            SelectAllTransactions(txdb, pindexPrev, txSelection, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize, nMinTxFee, nMaxTxTime);
 
-LogPrintf("RGP DEBUG  20 \n");
+        pblock->vtx.insert(pblock->vtx.end(), txSelection.vtx.begin(), txSelection.vtx.end());
+        uint64_t nBlockSize = txSelection.nBlockSize;
+        uint64_t nBlockTx = txSelection.vtx.size();
+        nFees = txSelection.nFees;
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -864,6 +712,7 @@ LogPrintf("RGP DEBUG  20 \n");
         if (!fProofOfStake)
         {
             pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(pindexPrev->nHeight + 1, nFees);
+            pblock->vtx[0].InvalidateHash();
 
             LogPrintf("RGP DEBUG Proof of Work reward %d \n", pblock->vtx[0].vout[0].nValue );
         }
@@ -913,6 +762,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].InvalidateHash();
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
@@ -24,6 +24,7 @@
 #include "core.h"
 #include "ui_interface.h"
 #include "darksend.h"
+#include "scheduler.h"
 
 
 #ifdef ENABLE_WALLET
@@ -34,6 +35,12 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/resource.h>
+#endif
+
+#if defined(__linux__)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -128,8 +135,107 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
 
+// Socket readiness backend used by ThreadSocketHandler. The epoll backend is
+// edge-triggered: a node's readiness is latched in fSocketRecvReady /
+// fSocketSendReady until a recv/send reports the socket drained.
+static bool fSocketEventsEpoll = false;
+#ifdef USE_EPOLL
+static int hEpollFd = -1;
+static const int MAX_SOCKET_EVENTS = 256;
+#endif
+
+/** Pick the socket readiness backend (-socketevents=epoll|select) and set it up. */
+static void SocketEventsInit()
+{
+    std::string strMode = GetArg("-socketevents", "epoll");
+
+#ifdef USE_EPOLL
+    if (strMode == "epoll")
+    {
+        hEpollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpollFd == -1)
+        {
+            LogPrintf("SocketEventsInit() : epoll_create1 failed with error %d, falling back to select()\n", errno);
+            return;
+        }
+
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        {
+            // Listen sockets stay level-triggered; data.ptr == NULL marks them.
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(hEpollFd, EPOLL_CTL_ADD, hListenSocket, &event) == -1)
+                LogPrintf("SocketEventsInit() : epoll_ctl listen socket failed with error %d\n", errno);
+        }
+
+        // Thousands of peers need more descriptors than the usual soft limit of 1024
+        struct rlimit limitFD;
+        if (getrlimit(RLIMIT_NOFILE, &limitFD) != -1 && limitFD.rlim_cur < limitFD.rlim_max)
+        {
+            limitFD.rlim_cur = limitFD.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limitFD);
+        }
+
+        fSocketEventsEpoll = true;
+        LogPrintf("Using epoll socket event backend\n");
+        return;
+    }
+#endif
+
+    if (strMode != "select")
+        LogPrintf("Socket event backend '%s' not available, using select()\n", strMode);
+}
+
+/** Register a node's socket with the event backend. Safe to call from any thread. */
+static void SocketEventsAdd(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (!fSocketEventsEpoll || pnode->hSocket == INVALID_SOCKET)
+        return;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpollFd, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1)
+        LogPrintf("SocketEventsAdd() : epoll_ctl failed with error %d\n", errno);
+#endif
+}
+
+/** Deregister a socket before it is closed, so no event can outlive its CNode. */
+static void SocketEventsRemove(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (!fSocketEventsEpoll || hSocket == INVALID_SOCKET)
+        return;
+
+    // Explicit removal: a forked child (e.g. -blocknotify) may still hold the fd,
+    // in which case close() alone would leave the registration behind.
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(hEpollFd, EPOLL_CTL_DEL, hSocket, &event);
+#endif
+}
+
 // Signals for message handling
 static CNodeSignals g_signals;
+
+// Wakes ThreadMessageHandler once a peer has a complete message waiting
+static boost::mutex mutexMsgProc;
+static boost::condition_variable condMsgProc;
+static bool fMsgProcWake = false;
+
+void WakeMessageHandler()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+        fMsgProcWake = true;
+    }
+    condMsgProc.notify_one();
+}
+
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
 
@@ -1769,7 +1875,7 @@ unsigned int connecting_port;
     //if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
     //              ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     //{
-        if (!IsSelectableSocket(hSocket))
+        if (!fSocketEventsEpoll && !IsSelectableSocket(hSocket))
         {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             //CloseSocket(hSocket);
@@ -1786,6 +1892,7 @@ unsigned int connecting_port;
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+            SocketEventsAdd(pnode);
         }
 
         pnode->nTimeConnected = GetTime();
@@ -1892,6 +1999,7 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         //LogPrintf("*** RGP, disconnecting node %s /n", addrName);
+        SocketEventsRemove(hSocket);
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -2040,7 +2148,6 @@ void CNode::SweepBanned()
         else
             ++it;
 
-        MilliSleep( 1 ); /* RGP optimise */
     }
 }
 
@@ -2099,6 +2206,7 @@ void CNode::copyStats(CNodeStats &stats)
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    bool fNewMessage = false;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
@@ -2121,10 +2229,20 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        MilliSleep( 1 ); /* RGP optimise */
-
+        // hand complete messages over to the message handler
+        if (msg.complete())
+        {
+            msg.nTime = GetTimeMicros();
+            nRecvQueueSize += msg.vRecv.size() + 24;
+            queueRecvMsg.Push(new CNetMessage(std::move(msg)));
+            vRecvMsg.pop_back();
+            fNewMessage = true;
+        }
     }
 
+    if (fNewMessage)
+        WakeMessageHandler();
+
     return true;
 }
 
@@ -2269,14 +2387,12 @@ return;
                             vAdd.push_back(addr);
                             found++;
                             }
-                            MilliSleep( 1 ); /* RGP optimise */
 
                         }
                     }
                     addrman.Add(vAdd, CNetAddr(seed.name, true));
                 }
 
-                MilliSleep( 1 ); /* RGP optimise */
 
             }
 
@@ -2305,7 +2421,6 @@ return;
                         nOutbound++;
                     }
 
-                    MilliSleep( 1 ); /* RGP optimise */
 
                 }
             }
@@ -2347,7 +2462,6 @@ return;
                     OpenNetworkConnection(addrConnect, &grant);
                 }
 
-                MilliSleep( 1 ); /* RGP optimise */
 
             }
 
@@ -2360,7 +2474,6 @@ void SocketSendData(CNode *pnode)
     std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
 
 //LogPrintf("*** SocketSendData node %s \n", pnode->addr.ToString()  );
-MilliSleep(1);
 
     while (it != pnode->vSendMsg.end())
     {
@@ -2459,7 +2572,6 @@ MilliSleep(1);
 
         }
 
-        MilliSleep( 1 ); /* RGP optimise */
 
     }
 
@@ -2472,396 +2584,548 @@ MilliSleep(1);
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
-{
-    extern volatile bool fRequestShutdown;
-    unsigned int nPrevNodeCount = 0;
-    int nErr;
-    bool nodestatus;
-    string ipAnalysis;
-    string portinfo;
+// Nodes with latched epoll readiness that still has to be serviced
+static set<CNode*> setNodesEventPending;
 
-    while ( !fRequestShutdown )
+static void SocketDisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    //
+    // Disconnect nodes
+    //
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nRecvQueueSize == 0 && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                setNodesEventPending.erase(pnode);
 
-                MilliSleep( 1 ); /* RGP optimise */
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
                 }
-
-                MilliSleep( 1 ); /* RGP optimise */
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
-        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
 
+static void AcceptConnection(SOCKET hListenSocket)
+{
+    bool nodestatus;
+    string ipAnalysis;
+    string portinfo;
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
 
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %d\n", nErr);
+        return;
+    }
+
+    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+        LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (!fSocketEventsEpoll && !IsSelectableSocket(hSocket))
+    {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        /* RGP */
+        LogPrintf("MAX CONNECTION connection from %s dropped (banned)\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        /* RGP, Added some monitoring code, as low volume connections
+           at the start of the project was causing many bans to occur.
+           Once traffic improved there were no bans, will look at this in the
+           future if this happens again during the life of the coin.
+           Removed all BANNING code for now.                                      */
+
+
+        nodestatus = false ;
+
+        ipAnalysis = addr.ToStringIP();
+        portinfo   = addr.ToStringPort();
+
+        if ( portinfo == "23980" ) {
+            if ( fDebug ){
+                LogPrintf("*** RGP UNBANNED analise %s \n", ipAnalysis  );
             }
+            nodestatus = CNode::Unban( addr );
+            /* Do not close the socket */
+
+            //bool CNode::Unban(const CNetAddr &addr) {
+            //    CSubNet subNet(addr.ToString()+(addr.IsIPv4() ? "/32" : "/128"));
+            //    return Unban(subNet);
+           // }
+           //CNode::IsBanned(addr)
 
-            MilliSleep( 1 ); /* RGP optimise */
         }
+        else
+        {
+            portinfo   = addr.ToStringPort();
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                nErr = WSAGetLastError();
+            /* UNBANN for now until rectified */
+            nodestatus = CNode::Unban( addr );
+
+            if ( portinfo == "23980" ) {
+
+
+            } else {
 
                 if ( fDebug ){
-                    LogPrintf("socket select error %d\n", nErr);
+                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
                 }
+                //closesocket(hSocket);
 
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
             }
+        }
+    }
+    else
+    {
+        // According to the internet TCP_NODELAY is not carried into accepted sockets
+        // on all platforms.  Set it again here just to be sure.
+        int set = 1;
+#ifdef WIN32
+        setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&set, sizeof(int));
+#else
+        setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (void*)&set, sizeof(int));
+#endif
 
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+        LogPrint("net", "accepted connection %s\n", addr.ToString());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+            SocketEventsAdd(pnode);
         }
+    }
+}
 
+// requires LOCK(cs_vRecvMsg)
+// Returns true when the read filled the buffer, i.e. the socket probably holds more data.
+static bool SocketRecvData(CNode* pnode)
+{
+    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
+        if (!pnode->fDisconnect)
+            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
+        pnode->CloseSocketDisconnect();
+        return false;
+    }
 
-        //
-        // Accept new connections
-        //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes == (int)sizeof(pchBuf);
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
         {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
 
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
+// requires LOCK(cs_vRecvMsg)
+// Whether there is room (or need) to read more from the peer, see SocketHandlerSelect().
+static bool NodeWantsRecv(CNode* pnode)
+{
+    return pnode->nRecvQueueSize == 0 || pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
 
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                /* RGP */
-                LogPrintf("MAX CONNECTION connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                /* RGP, Added some monitoring code, as low volume connections
-                   at the start of the project was causing many bans to occur.
-                   Once traffic improved there were no bans, will look at this in the
-                   future if this happens again during the life of the coin.
-                   Removed all BANNING code for now.                                      */
+static void SocketCheckInactivity(CNode* pnode)
+{
+    //
+    // Inactivity checking
+    //
+    if (pnode->vSendMsg.empty())
+    {
+        pnode->nLastSendEmpty = GetTime();
+    }
 
+    if (GetTime() - pnode->nTimeConnected > IDLE_TIMEOUT)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in timeout, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+            pnode->CloseSocketDisconnect();
+        }
+        else if (GetTime() - pnode->nLastSend > DATA_TIMEOUT)
+        {
+           LogPrintf("socket not sending node %s \n", pnode );
+            pnode->fDisconnect = true;
+            pnode->CloseSocketDisconnect();
+        }
+        else if (GetTime() - pnode->nLastRecv > DATA_TIMEOUT)
+        {
+            LogPrintf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+            pnode->CloseSocketDisconnect();
+        }
+    }
+}
 
-                nodestatus = false ;
+static void SocketHandlerSelect()
+{
+    int nErr;
 
-                ipAnalysis = addr.ToStringIP();
-                portinfo   = addr.ToStringPort();
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+        have_fds = true;
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
 
-                if ( portinfo == "23980" ) {
-                    if ( fDebug ){
-                        LogPrintf("*** RGP UNBANNED analise %s \n", ipAnalysis  );
-                    }
-                    nodestatus = CNode::Unban( addr );
-                    /* Do not close the socket */
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    continue;
+                }
+            }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && NodeWantsRecv(pnode))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
 
-                    //bool CNode::Unban(const CNetAddr &addr) {
-                    //    CSubNet subNet(addr.ToString()+(addr.IsIPv4() ? "/32" : "/128"));
-                    //    return Unban(subNet);
-                   // }
-                   //CNode::IsBanned(addr)
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
 
-                }
-                else
-                {
-                    portinfo   = addr.ToStringPort();
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            nErr = WSAGetLastError();
 
+            if ( fDebug ){
+                LogPrintf("socket select error %d\n", nErr);
+            }
 
-                    /* UNBANN for now until rectified */
-                    nodestatus = CNode::Unban( addr );
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
 
-                    if ( portinfo == "23980" ) {
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
 
 
-                    } else {
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+    {
+        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+            AcceptConnection(hListenSocket);
+    }
 
-                        if ( fDebug ){
-                            LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                        }
-                        //closesocket(hSocket);
 
-                    }
-                }
-            }
-            else
-            {
-                // According to the internet TCP_NODELAY is not carried into accepted sockets
-                // on all platforms.  Set it again here just to be sure.
-                int set = 1;
-#ifdef WIN32
-                setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&set, sizeof(int));
-#else
-                setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (void*)&set, sizeof(int));
-#endif
+    //
+    // Service each socket
+    //
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        boost::this_thread::interruption_point();
 
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
+        //
+        // Receive
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+                SocketRecvData(pnode);
         }
 
-
         //
-        // Service each socket
+        // Send
         //
-        vector<CNode*> vNodesCopy;
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetSend))
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                SocketSendData(pnode);
         }
+
+        SocketCheckInactivity(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
+
+#ifdef USE_EPOLL
+static void SocketHandlerEpoll()
+{
+    static int64_t nLastInactivityCheck = 0;
+    static bool fMoreData = false;
+
+    // Only block when the previous pass left no socket with unread data behind.
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(hEpollFd, events, MAX_SOCKET_EVENTS, fMoreData ? 0 : 50);
+    boost::this_thread::interruption_point();
+
+    if (nEvents == -1)
+    {
+        if (errno != EINTR && fDebug)
+            LogPrintf("socket epoll_wait error %d\n", errno);
+        nEvents = 0;
+    }
+
+    for (int i = 0; i < nEvents; i++)
+    {
+        if (events[i].data.ptr == NULL)
         {
-            boost::this_thread::interruption_point();
+            // Listen sockets are level-triggered, one accept per wakeup is enough.
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                if (hListenSocket != INVALID_SOCKET)
+                    AcceptConnection(hListenSocket);
+            continue;
+        }
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+        // Nodes are only deleted by this thread, after their socket has been
+        // deregistered, so a pointer returned by this epoll_wait() is still valid.
+        CNode* pnode = (CNode*)events[i].data.ptr;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            pnode->fSocketRecvReady = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fSocketSendReady = true;
+        setNodesEventPending.insert(pnode);
+    }
 
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+    //
+    // Service the sockets that have become ready
+    //
+    fMoreData = false;
+    vector<CNode*> vNodesReady;
+    {
+        LOCK(cs_vNodes);
+        vNodesReady.assign(setNodesEventPending.begin(), setNodesEventPending.end());
+        BOOST_FOREACH(CNode* pnode, vNodesReady)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesReady)
+    {
+        boost::this_thread::interruption_point();
+
+        if (pnode->hSocket != INVALID_SOCKET && pnode->fSocketSendReady)
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (!pnode->vSendMsg.empty())
                     SocketSendData(pnode);
+                // Anything still queued hit a full kernel buffer, EPOLLOUT fires again once it drains.
+                pnode->fSocketSendReady = false;
             }
+        }
 
-            //
-            // Inactivity checking
-            //
-            if (pnode->vSendMsg.empty())
+        if (pnode->hSocket != INVALID_SOCKET && pnode->fSocketRecvReady)
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv && NodeWantsRecv(pnode))
             {
-                pnode->nLastSendEmpty = GetTime();
+                pnode->fSocketRecvReady = SocketRecvData(pnode);
+                if (pnode->fSocketRecvReady)
+                    fMoreData = true;
             }
+        }
 
-            if (GetTime() - pnode->nTimeConnected > IDLE_TIMEOUT)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in timeout, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                    pnode->CloseSocketDisconnect();
-                }
-                else if (GetTime() - pnode->nLastSend > DATA_TIMEOUT)
-                {
-                   LogPrintf("socket not sending node %s \n", pnode );
-                    pnode->fDisconnect = true;
-                    pnode->CloseSocketDisconnect();
-                }
-                else if (GetTime() - pnode->nLastRecv > DATA_TIMEOUT)
-                {
-                    LogPrintf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                    pnode->CloseSocketDisconnect();
-                }
-            }
+        if (pnode->hSocket == INVALID_SOCKET || (!pnode->fSocketRecvReady && !pnode->fSocketSendReady))
+            setNodesEventPending.erase(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesReady)
+            pnode->Release();
+    }
+
+    //
+    // Idle peers produce no events, sweep them once a second
+    //
+    if (GetTime() != nLastInactivityCheck)
+    {
+        nLastInactivityCheck = GetTime();
 
-            MilliSleep( 1 ); /* RGP optimise */
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->hSocket != INVALID_SOCKET)
+                SocketCheckInactivity(pnode);
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+    extern volatile bool fRequestShutdown;
+    unsigned int nPrevNodeCount = 0;
+
+    while ( !fRequestShutdown )
+    {
+        SocketDisconnectNodes(nPrevNodeCount);
+
+#ifdef USE_EPOLL
+        if (fSocketEventsEpoll)
+            SocketHandlerEpoll();
+        else
+#endif
+            SocketHandlerSelect();
 
     // Refresh nodes/peers every X minutes
     RefreshRecentConnections(2);
-
-        MilliSleep( 1 ); /* RGP optimise */
     }
 
     /* End of while, check if we are closing */
@@ -3036,7 +3300,6 @@ void ThreadDNSAddressSeed()
             addrman.Add(vAdd, CNetAddr(seed.name, true));
         }
 
-        MilliSleep( 1 ); /* RGP optimise */
     }
 
     LogPrintf("%d addresses found from DNS seeds\n", found);
@@ -3185,7 +3448,6 @@ void ThreadOpenConnections()
                     setConnected.insert(pnode->addr.GetGroup());
                     nOutbound++;
                 }
-                MilliSleep( 2 );
             }
         }
 
@@ -3222,13 +3484,11 @@ void ThreadOpenConnections()
             addrConnect = addr;
             break;
 
-            MilliSleep( 5 ); /* RGP optimise */
         }
 
         if (addrConnect.IsValid())
             OpenNetworkConnection(addrConnect, &grant);
 
-        MilliSleep( 5 ); /* RGP optimise */
 
     }
 }
@@ -3281,7 +3541,6 @@ void ThreadOpenAddedConnections()
                 }
             }
 
-            MilliSleep( 1 ); /* RGP optimise */
         }
         // Attempt to connect to each IP for each addnode entry until at least one is successful per addnode entry
         // (keeping in mind that addnode entries can have many IPs if fNameLookup)
@@ -3301,7 +3560,6 @@ void ThreadOpenAddedConnections()
                         }
                     }
                 }
-                MilliSleep( 1 ); /* RGP optimise */
             }
         }
         BOOST_FOREACH(vector<CService>& vserv, lservAddressesToAdd)
@@ -3420,7 +3678,6 @@ void static StartSync(const vector<CNode*> &vNodes)
             }
         }
 
-        MilliSleep( 1 ); /* RGP optimise */
     }
 
 
@@ -3441,6 +3698,7 @@ void ThreadMessageHandler()
 extern volatile bool fRequestShutdown;
 int64_t Time_to_Last_block;
 int64_t start_time;
+int64_t nNextStallGetBlocks = 0;
 
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
 LogPrintf("RGP NET ThreadMessageHandler start \n" );
@@ -3460,15 +3718,9 @@ LogPrintf("RGP NET ThreadMessageHandler start \n" );
                 pnode->AddRef();
                 if (pnode == pnodeSync)
                     fHaveSyncNode = true;
-
-                MilliSleep(2); /* RGP Optimisation */
-                
             }
         }
 
-        MilliSleep(5); /* RGP Optimisation */
-
-
         if (!fHaveSyncNode){
             StartSync(vNodesCopy);
         }
@@ -3479,22 +3731,20 @@ LogPrintf("RGP NET ThreadMessageHandler start \n" );
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
         }
 
+        // Peers that went quiet while we are behind are asked for blocks
+        // again, at most once a second
+        bool fStallCheck = GetTimeMillis() >= nNextStallGetBlocks;
         bool fSleep = true;
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             if (pnode->fDisconnect)
-            {
-
-                MilliSleep(5); /* RGP Optimisation */
                 continue;
-            }
-            // Receive messages
 
-            MilliSleep( 1 ); /* RGP Optimize */
+            // Receive messages
 
             /* -- RGP, Check if the incoming message queue is empty -- */
-            if ( pnode->vRecvMsg.empty() )
+            if ( pnode->queueRecvMsg.Empty() && pnode->vProcessMsg.empty() )
             {
 
                 // The only occasion that this could happen in when the Daemon
@@ -3502,68 +3752,49 @@ LogPrintf("RGP NET ThreadMessageHandler start \n" );
 
                 Time_to_Last_block = GetTime() - pindexBest->GetBlockTime();
                 // LogPrintf("RGP NET ThreadMessageHandler Last block was %d \n", Time_to_Last_block );
-                if ( Time_to_Last_block < 4000 )
-                {
-                    // RGP, we are close to synch or are synched
-                    MilliSleep( 100 );
-                }
-                else
+                if ( Time_to_Last_block >= 4000 && fStallCheck )
                 {
                     // This is the scenario where there is no messages, as the nodes 
                     // have stopped sending messages.
                     
                     PushGetBlocks(pnode, pindexBest, pindexBest->GetBlockHash() );
-                    MilliSleep(200);
                     StartSync(vNodesCopy);
-                    /* do nothing */
+                    nNextStallGetBlocks = GetTimeMillis() + 1000;
                 }
             }
             else
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                // queueRecvMsg needs no lock, this is its only consumer
+                if (!g_signals.ProcessMessages(pnode))
                 {
-                    if (!g_signals.ProcessMessages(pnode))
-                    {
-                        pnode->CloseSocketDisconnect();
-                        MilliSleep(10); /* RGP Optimisation */
-                    }
+                    pnode->CloseSocketDisconnect();
+                }
 
-                    // Disconnect node/peer if send/recv data becomes idle
-                    if (GetTime() - pnode->nTimeConnected > 180 )
-                    { /* 90 to 180 rgp */
+                // Disconnect node/peer if send/recv data becomes idle
+                if (GetTime() - pnode->nTimeConnected > 180 )
+                { /* 90 to 180 rgp */
 
-                        if (GetTime() - pnode->nLastRecv > 120)
-                        {/* was 60 */
+                    if (GetTime() - pnode->nLastRecv > 120)
+                    {/* was 60 */
 
-                            if (GetTime() - pnode->nLastSend > 90 )
-                            { /* 60 was < 30 */
-                               pnode->CloseSocketDisconnect();
-                               MilliSleep(10); /* RGP Optimisation */
-                            }
+                        if (GetTime() - pnode->nLastSend > 90 )
+                        { /* 60 was < 30 */
+                           pnode->CloseSocketDisconnect();
                         }
                     }
+                }
 
-                    if (pnode->nSendSize < SendBufferSize())
+                if (pnode->nSendSize < SendBufferSize())
+                {
+                    if (!pnode->vRecvGetData.empty() || !pnode->vProcessMsg.empty() || !pnode->queueRecvMsg.Empty())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                        MilliSleep(5); /* RGP Optimisation */
+                        fSleep = false;
                     }
                 }
-                else
-                {
-                    MilliSleep(5); /* RGP Optimisation */
-                    LogPrintf("RGP ThreadMessageHandler lockRecv FAILED \n");
-                }
 
             }
             //boost::this_thread::interruption_point();
 
-            MilliSleep(5); /* RGP Optimisation */
-
             // Send messages
             {
 
@@ -3571,43 +3802,28 @@ LogPrintf("RGP NET ThreadMessageHandler start \n" );
                 //if (lockSend)
                 //{
                     g_signals.SendMessages(pnode, pnode == pnodeTrickle);
-                    MilliSleep(10); /* RGP Optimisation */
-
-
-                //}
-                //else
-                //{
-                //    MilliSleep(20); /* RGP Optimisation */
                 //}
             }
             //boost::this_thread::interruption_point();
-
-            MilliSleep( 30 );
         }
         
         if ( ( GetTime() - start_time ) > 5 )
         {
 LogPrintf("RGP ThreadMessageHandler debug 004 %d \n", GetTime() - start_time );
         }
-        MilliSleep( 200 );
 
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
-            {
                 pnode->Release();
-                MilliSleep(2); /* RGP Optimisation */
-            }
         }
 
-        if (fSleep)
-        {
-            MilliSleep(200); // RGP was MilliSleep(100);
-        }
-        else
-        {
-            MilliSleep(50); /* RGP Optimisation */
-        }
+        // Wait for the socket thread to hand over a message, the timeout
+        // keeps the trickle, pings and shutdown check going when all is quiet
+        boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+        if (fSleep && !fMsgProcWake)
+            condMsgProc.timed_wait(lock, boost::posix_time::milliseconds(100));
+        fMsgProcWake = false;
     }
 }
 
@@ -3784,7 +4000,7 @@ void static Discover(boost::thread_group& threadGroup)
 
 }
 
-void StartNode(boost::thread_group& threadGroup)
+void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 {
 
     //try to read stored banlist
@@ -3823,6 +4039,7 @@ void StartNode(boost::thread_group& threadGroup)
 #endif
     
     // Send and receive from sockets, accept connections
+    SocketEventsInit();
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -3835,7 +4052,7 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
-    threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpData, DUMP_ADDRESSES_INTERVAL * 1000));
+    scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL * 1000);
 }
 
 bool StopNode()
@@ -13,10 +13,12 @@
 #include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
+#include "spscqueue.h"
 #include "sync.h"
 #include "uint256.h"
 #include "util.h"
 
+#include <atomic>
 #include <deque>
 #include <stdint.h>
 
@@ -34,6 +36,7 @@ class CBlockIndex;
 extern int nBestHeight;
 
 class CNode;
+class CScheduler;
 
 namespace boost {
     class thread_group;
@@ -152,9 +155,11 @@ bool CheckNode(CAddress addrConnect);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
-void StartNode(boost::thread_group& threadGroup);
+void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Wake ThreadMessageHandler, a peer has messages for it */
+void WakeMessageHandler();
 
 typedef int NodeId;
 
@@ -289,11 +294,14 @@ public:
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
+    int64_t nTime;                  // time in microseconds the message was complete
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        nTime = 0;
     }
 
     bool complete() const
@@ -427,11 +435,26 @@ public:
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
-    std::deque<CNetMessage> vRecvMsg;
+    std::deque<CNetMessage> vRecvMsg; // message still being received, socket thread only
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
+    // Complete messages are handed from the socket thread to the message
+    // handler through queueRecvMsg without taking a lock. nRecvQueueSize
+    // counts the bytes of every message handed over and not yet processed.
+    CSPSCQueue<CNetMessage*> queueRecvMsg;
+    std::atomic<unsigned int> nRecvQueueSize;
+    std::deque<CNetMessage*> vProcessMsg; // message handler thread only
+
+    // Gossip messages waiting for a worker, see ProcessMessages()
+    std::deque<CNetMessage*> vGossipMsg;
+    bool fGossipQueued;
+
+    // Edge-triggered socket readiness, only touched by ThreadSocketHandler
+    bool fSocketRecvReady;
+    bool fSocketSendReady;
+
     // Firewall Data
     double nTrafficAverage;
     double nTrafficRatio;
@@ -516,6 +539,10 @@ public:
         nServices = 0;
         hSocket = hSocketIn;
         nRecvVersion = INIT_PROTO_VERSION;
+        nRecvQueueSize = 0;
+        fGossipQueued = false;
+        fSocketRecvReady = false;
+        fSocketSendReady = false;
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
@@ -577,6 +604,15 @@ public:
             closesocket(hSocket);
             hSocket = INVALID_SOCKET;
         }
+
+        CNetMessage* pmsg;
+        while (queueRecvMsg.Pop(pmsg))
+            delete pmsg;
+        BOOST_FOREACH(CNetMessage* pmsg, vProcessMsg)
+            delete pmsg;
+        BOOST_FOREACH(CNetMessage* pmsg, vGossipMsg)
+            delete pmsg;
+
         GetNodeSignals().FinalizeNode(GetId());
     }
 
@@ -604,7 +640,7 @@ public:
     // requires LOCK(cs_vRecvMsg)
     unsigned int GetTotalRecvSize()
     {
-        unsigned int total = 0;
+        unsigned int total = nRecvQueueSize;
         BOOST_FOREACH(const CNetMessage &msg, vRecvMsg) 
             total += msg.vRecv.size() + 24;
         return total;
@@ -613,9 +649,11 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
-    // requires LOCK(cs_vRecvMsg)
+    // Messages already handed to the message handler pick up the new
+    // version when they are taken off queueRecvMsg.
     void SetRecvVersion(int nVersionIn)
     {
+        LOCK(cs_vRecvMsg);
         nRecvVersion = nVersionIn;
         BOOST_FOREACH(CNetMessage &msg, vRecvMsg)
             msg.SetVersion(nVersionIn);
@@ -665,6 +703,13 @@ public:
         }
     }
 
+    // Returns true if inv was not known yet, marking it known
+    bool AddInventoryKnownIfNew(const CInv& inv)
+    {
+        LOCK(cs_inventory);
+        return setInventoryKnown.insert(inv).second;
+    }
+
     int GetInventoryKnown(const CInv& inv)
     {
         {
@@ -110,14 +110,18 @@ static void handleRunawayException(std::exception *e)
 #if QT_VERSION < 0x050000
 void DebugMessageHandler(QtMsgType type, const char * msg)
 {
-    const char *category = (type == QtDebugMsg) ? "qt" : NULL;
-    LogPrint(category, "GUI: %s\n", msg);
+    if (type == QtDebugMsg)
+        LogPrint("qt", "GUI: %s\n", msg);
+    else
+        LogPrintf("GUI: %s\n", msg);
 }
 #else
 void DebugMessageHandler(QtMsgType type, const QMessageLogContext& context, const QString &msg)
 {
-    const char *category = (type == QtDebugMsg) ? "qt" : NULL;
-    LogPrint(category, "GUI: %s\n", msg.toStdString());
+    if (type == QtDebugMsg)
+        LogPrint("qt", "GUI: %s\n", msg.toStdString());
+    else
+        LogPrintf("GUI: %s\n", msg.toStdString());
 }
 #endif
 
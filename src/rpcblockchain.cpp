@@ -7,6 +7,7 @@
 #include "main.h"
 #include "kernel.h"
 #include "checkpoints.h"
+#include "txdb.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -279,13 +280,7 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -310,3 +305,33 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value gettxcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "gettxcacheinfo\n"
+            "Returns hit/miss counters of the in-memory transaction index and transaction caches.\n");
+
+    CTxDBCacheStats stats;
+    GetTxDBCacheStats(stats);
+
+    Object txindex;
+    txindex.push_back(json_spirit::Pair("entries", (boost::uint64_t)stats.nTxIndexEntries));
+    txindex.push_back(json_spirit::Pair("maxentries", (boost::int64_t)GetArg("-txindexcache", DEFAULT_TXINDEX_CACHE)));
+    txindex.push_back(json_spirit::Pair("hits", (boost::uint64_t)stats.nTxIndexHits));
+    txindex.push_back(json_spirit::Pair("misses", (boost::uint64_t)stats.nTxIndexMisses));
+
+    Object tx;
+    tx.push_back(json_spirit::Pair("entries", (boost::uint64_t)stats.nTxEntries));
+    tx.push_back(json_spirit::Pair("maxentries", (boost::int64_t)GetArg("-txcache", DEFAULT_TX_CACHE)));
+    tx.push_back(json_spirit::Pair("hits", (boost::uint64_t)stats.nTxHits));
+    tx.push_back(json_spirit::Pair("misses", (boost::uint64_t)stats.nTxMisses));
+
+    Object result;
+    result.push_back(json_spirit::Pair("txindex", txindex));
+    result.push_back(json_spirit::Pair("tx", tx));
+    result.push_back(json_spirit::Pair("flushes", (boost::uint64_t)stats.nTxnFlushes));
+    result.push_back(json_spirit::Pair("flushedentries", (boost::uint64_t)stats.nTxnFlushedEntries));
+    return result;
+}
@@ -168,6 +168,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "searchrawtransactions", 1 },
     { "searchrawtransactions", 2 },
     { "searchrawtransactions", 3 },
+    { "searchrawtransactions", 5 },
     { "firewallenabled", 1 },
     { "firewallstatus", 0 },
     { "firewallclearblacklist", 1 },
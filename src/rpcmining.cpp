@@ -286,6 +286,29 @@ double nNetworkWeight;
     return obj;
 }
 
+Value getstakesearchinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getstakesearchinfo\n"
+            "Returns statistics of the stake kernel search.");
+
+    CStakeSearchStats stats;
+    GetStakeSearchStats(stats);
+
+    Object obj;
+    obj.push_back(json_spirit::Pair("threads",           GetStakeSearchThreads()));
+    obj.push_back(json_spirit::Pair("searches",          (uint64_t)stats.nSearches));
+    obj.push_back(json_spirit::Pair("kernelsfound",      (uint64_t)stats.nKernelsFound));
+    obj.push_back(json_spirit::Pair("kernelstried",      (uint64_t)stats.nKernelsTried));
+    obj.push_back(json_spirit::Pair("lastkernelstried",  (uint64_t)stats.nLastKernelsTried));
+    obj.push_back(json_spirit::Pair("lastsearchthreads", stats.nLastThreads));
+    obj.push_back(json_spirit::Pair("lastsearchtime",    (double)stats.nLastSearchMicros / 1000000));
+    obj.push_back(json_spirit::Pair("lastkernelspersec", stats.nLastSearchMicros ? (double)stats.nLastKernelsTried * 1000000 / stats.nLastSearchMicros : 0.0));
+    obj.push_back(json_spirit::Pair("kernelspersec",     stats.nTotalSearchMicros ? (double)stats.nKernelsTried * 1000000 / stats.nTotalSearchMicros : 0.0));
+    return obj;
+}
+
 
 Value checkkernel(const Array& params, bool fHelp)
 {
@@ -390,6 +413,7 @@ Value checkkernel(const Array& params, bool fHelp)
     unique_ptr<CBlock> pblock(CreateNewBlock(*pMiningKey, true, &nFees));
 
     pblock->nTime = pblock->vtx[0].nTime = nTime;
+    pblock->vtx[0].InvalidateHash();
 
     CDataStream ss(SER_DISK, PROTOCOL_VERSION);
     ss << *pblock;
@@ -570,6 +594,7 @@ Value getworkex(const Array& params, bool fHelp)
         if(coinbase.size() == 0)
         {
             pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+            pblock->vtx[0].InvalidateHash();
         }
         else
         {
@@ -735,6 +760,7 @@ Value getwork(const Array &params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        pblock->vtx[0].InvalidateHash();
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
         assert(pwalletMain != NULL);
@@ -819,10 +845,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
     // Update block
     static unsigned int nTransactionsUpdatedLast;
     static CBlockIndex* pindexPrev;
-    static int64_t nStart;
     static CBlock* pblock;
     
-    if (pindexPrev != pindexBest || (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    // CreateNewBlock only has to look at what changed in the pool since the
+    // last template, so a changed pool is picked up straight away
+    if (pindexPrev != pindexBest || mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast)
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = NULL;
@@ -830,7 +857,6 @@ Value getblocktemplate(const Array& params, bool fHelp)
         // Store the pindexBest used before CreateNewBlock, to avoid races
         nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
         CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
 
         // Create new block
         if(pblock)
@@ -859,9 +885,10 @@ Value getblocktemplate(const Array& params, bool fHelp)
     map<uint256, int64_t> setTxIndex;
     
     int i = 0;
-    
-    CTxDB txdb("r");
-    
+
+    // Fees and sigops come from the pool entries instead of fetching every input
+    LOCK(mempool.cs);
+
     BOOST_FOREACH (CTransaction& tx, pblock->vtx)
     {
         uint256 txHash = tx.GetHash();
@@ -880,30 +907,25 @@ Value getblocktemplate(const Array& params, bool fHelp)
 
         entry.push_back(json_spirit::Pair("hash", txHash.GetHex()));
 
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        
-        bool fInvalid = false;
-        
-        if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+        CTxMemPool::txiter it = mempool.mapTx.find(txHash);
+        if (it != mempool.mapTx.end())
         {
-            entry.push_back(json_spirit::Pair("fee", (int64_t)(tx.GetValueIn(mapInputs) - tx.GetValueOut())));
+            entry.push_back(json_spirit::Pair("fee", it->GetFee()));
 
             Array deps;
-            
-            BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
+            set<uint256> setDeps;
+
+            BOOST_FOREACH (const CTxIn& txin, tx.vin)
             {
-                if (setTxIndex.count(inp.first))
+                if (setTxIndex.count(txin.prevout.hash) && setDeps.insert(txin.prevout.hash).second)
                 {
-                    deps.push_back(setTxIndex[inp.first]);
+                    deps.push_back(setTxIndex[txin.prevout.hash]);
                 }
             }
 
             entry.push_back(json_spirit::Pair("depends", deps));
 
-            int64_t nSigOps = GetLegacySigOpCount(tx);
-            nSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            entry.push_back(json_spirit::Pair("sigops", nSigOps));
+            entry.push_back(json_spirit::Pair("sigops", (int64_t)it->GetSigOps()));
         }
 
         transactions.push_back(entry);
@@ -108,6 +108,7 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(json_spirit::Pair("startingheight", stats.nStartingHeight));
         if (fStateStats) {
             obj.push_back(json_spirit::Pair("banscore", statestats.nMisbehavior));
+            obj.push_back(json_spirit::Pair("inflight", statestats.nBlocksInFlight));
         }
         obj.push_back(json_spirit::Pair("syncnode", stats.fSyncNode));
 
@@ -603,19 +603,20 @@ Value sendrawtransaction(const Array& params, bool fHelp)
 
 Value searchrawtransactions(const Array &params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 4)
+    if (fHelp || params.size() < 1 || params.size() > 6)
         throw runtime_error(
-            "searchrawtransactions <address> [verbose=1] [skip=0] [count=100]\n");
+            "searchrawtransactions <address> [verbose=1] [skip=0] [count=100] [cursor] [endheight]\n"
+            "Returns the transactions paying to or spending from <address>, oldest first.\n"
+            "A negative skip counts back from the end of the range.\n"
+            "With a cursor (\"\", \"<height>\" or the \"next\" of an earlier page) the search\n"
+            "starts there and an Object {transactions, next} is returned, where next is\n"
+            "null on the last page. endheight limits the search to blocks up to that height.");
 
     CSocietyGcoinAddress address(params[0].get_str());
     if (!address.IsValid())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
     CTxDestination dest = address.Get();
 
-    std::vector<uint256> vtxhash;
-    if (!FindTransactionsByDestination(dest, vtxhash))
-        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
-
     int nSkip = 0;
     int nCount = 100;
     bool fVerbose = true;
@@ -625,45 +626,80 @@ Value searchrawtransactions(const Array &params, bool fHelp)
         nSkip = params[2].get_int();
     if (params.size() > 3)
         nCount = params[3].get_int();
-
-    if (nSkip < 0)
-        nSkip += vtxhash.size();
-    if (nSkip < 0)
-        nSkip = 0;
     if (nCount < 0)
         nCount = 0;
 
-    std::vector<uint256>::const_iterator it = vtxhash.begin();
-    while (it != vtxhash.end() && nSkip--) it++;
+    int nHeightStart = 0;
+    int nTxIndexStart = 0;
+    bool fCursor = params.size() > 4;
+    if (fCursor)
+    {
+        std::string strCursor = params[4].get_str();
+        size_t nColon = strCursor.find(':');
+        nHeightStart = atoi(strCursor.substr(0, nColon));
+        if (nColon != std::string::npos)
+            nTxIndexStart = atoi(strCursor.substr(nColon + 1));
+        if (nHeightStart < 0 || nTxIndexStart < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    }
+    int nHeightEnd = std::numeric_limits<int>::max();
+    if (params.size() > 5)
+        nHeightEnd = params[5].get_int();
+    if (nHeightEnd < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid endheight");
+
+    std::vector<CAddrIndexEntry> vEntries;
+    bool fMore;
+    if (!FindTransactionsByDestination(dest, nHeightStart, nTxIndexStart, nHeightEnd, nSkip, nCount, vEntries, fMore))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
 
     Array result;
-    while (it != vtxhash.end() && nCount--) {
-        CTransaction tx;
-        uint256 hashBlock;
-        if (!GetTransaction(*it, tx, hashBlock))
+    CBlock block;
+    CBlockIndex* pindexBlock = NULL;
+    BOOST_FOREACH(const CAddrIndexEntry& entry, vEntries)
+    {
+        // The entry knows which block and slot hold the transaction, so there
+        // is no tx index lookup. Entries come in block order, a block is read
+        // once for all of its matches.
+        CBlockIndex* pindex = FindBlockByHeight(entry.key.nHeight);
+        if (pindex && pindex != pindexBlock)
         {
-           // throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Cannot read transaction from disk");
-           Object obj;
-       obj.push_back(json_spirit::Pair("ERROR", "Cannot read transaction from disk"));
-	   result.push_back(obj);
-	}
-	else
-	{
+            pindexBlock = NULL;
+            if (pindex->nFile == entry.pos.nFile && pindex->nBlockPos == entry.pos.nBlockPos &&
+                block.ReadFromDisk(pindex, true))
+                pindexBlock = pindex;
+        }
+        if (!pindex || pindex != pindexBlock || entry.key.nTxIndex >= block.vtx.size() ||
+            block.vtx[entry.key.nTxIndex].GetHash() != entry.hashTx)
+        {
+            Object obj;
+            obj.push_back(json_spirit::Pair("ERROR", "Cannot read transaction from disk"));
+            result.push_back(obj);
+            continue;
+        }
+        const CTransaction& tx = block.vtx[entry.key.nTxIndex];
 
         CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
         ssTx << tx;
         string strHex = HexStr(ssTx.begin(), ssTx.end());
         if (fVerbose) {
             Object object;
-            TxToJSON(tx, hashBlock, object);
+            TxToJSON(tx, pindex->GetBlockHash(), object);
             object.push_back(json_spirit::Pair("hex", strHex));
             result.push_back(object);
         } else {
             result.push_back(strHex);
         }
-      
-        }
-        it++;
     }
-    return result;
+
+    if (!fCursor)
+        return result;
+
+    Object ret;
+    ret.push_back(json_spirit::Pair("transactions", result));
+    if (fMore && !vEntries.empty())
+        ret.push_back(json_spirit::Pair("next", strprintf("%u:%u", vEntries.back().key.nHeight, vEntries.back().key.nTxIndex + 1)));
+    else
+        ret.push_back(json_spirit::Pair("next", Value::null));
+    return ret;
 }
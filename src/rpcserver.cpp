@@ -343,6 +343,7 @@ static const CRPCCommand vRPCCommands[] =
         {"blockchain", 	        "getblockbynumber",	    &getblockbynumber,	   true,    	false,     	false 		},
         {"blockchain",          "gettransaction",       &gettransaction,       true,        true,       false       },
         {"blockchain",		    "getcheckpoint",	    &getcheckpoint,        true,      	false,     	false		},
+        {"blockchain",          "gettxcacheinfo",       &gettxcacheinfo,       true,        false,      false       },
 
         
 #ifdef ENABLE_WALLET
@@ -450,6 +451,7 @@ static const CRPCCommand vRPCCommands[] =
     { "Wallet_enabled", "darksend",               &darksend,               false,     false,      true },
     { "Wallet_enabled","getmininginfo",          &getmininginfo,          true,      false,     false },
     { "Wallet_enabled","getstakinginfo",         &getstakinginfo,         true,      false,     false },
+    { "Wallet_enabled","getstakesearchinfo",     &getstakesearchinfo,     true,      false,     false },
     { "Wallet_enabled","getnewaddress",          &getnewaddress,          true,      false,     true },
     { "Wallet_enabled","getnewpubkey",           &getnewpubkey,           true,      false,     true },
     { "Wallet_enabled","getaccountaddress",      &getaccountaddress,      true,      false,     true },
@@ -186,6 +186,7 @@ extern json_spirit::Value getsubsidy(const json_spirit::Array& params, bool fHel
 extern json_spirit::Value getstakesubsidy(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getmininginfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getstakinginfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getstakesearchinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value checkkernel(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getwork(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getworkex(const json_spirit::Array& params, bool fHelp);
@@ -252,6 +253,7 @@ extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fH
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockbynumber(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value gettxcacheinfo(const json_spirit::Array& params, bool fHelp);
 
 /* ---------------------
    -- RGP JIRA BSG-51 --
@@ -0,0 +1,116 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "scheduler.h"
+
+#include <assert.h>
+#include <utility>
+
+#include <boost/bind.hpp>
+
+CScheduler::CScheduler() : nThreadsServicingQueue(0), fStopRequested(false), fStopWhenEmpty(false)
+{
+}
+
+CScheduler::~CScheduler()
+{
+    assert(nThreadsServicingQueue == 0);
+}
+
+void CScheduler::serviceQueue()
+{
+    boost::unique_lock<boost::mutex> lock(newTaskMutex);
+    ++nThreadsServicingQueue;
+
+    // newTaskMutex is held except while waiting or running a task. The
+    // waits are interruption points, and boost takes the lock back before
+    // throwing thread_interrupted.
+    try
+    {
+        while (!shouldStop())
+        {
+            while (!shouldStop() && taskQueue.empty())
+                newTaskScheduled.wait(lock);
+
+            // Wait for the first task to come due, a sooner one may be
+            // scheduled meanwhile
+            while (!shouldStop() && !taskQueue.empty() &&
+                   newTaskScheduled.timed_wait(lock, taskQueue.begin()->first))
+            {
+            }
+            if (shouldStop() || taskQueue.empty())
+                continue;
+
+            Function f = taskQueue.begin()->second;
+            taskQueue.erase(taskQueue.begin());
+
+            lock.unlock();
+            try
+            {
+                f();
+            }
+            catch (...)
+            {
+                lock.lock();
+                throw;
+            }
+            lock.lock();
+        }
+    }
+    catch (...)
+    {
+        --nThreadsServicingQueue;
+        throw;
+    }
+    --nThreadsServicingQueue;
+}
+
+void CScheduler::stop(bool fDrain)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(newTaskMutex);
+        if (fDrain)
+            fStopWhenEmpty = true;
+        else
+            fStopRequested = true;
+    }
+    newTaskScheduled.notify_all();
+}
+
+void CScheduler::schedule(CScheduler::Function f, boost::system_time t)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(newTaskMutex);
+        taskQueue.insert(std::make_pair(t, f));
+    }
+    newTaskScheduled.notify_one();
+}
+
+void CScheduler::scheduleFromNow(CScheduler::Function f, int64_t nMilliSeconds)
+{
+    schedule(f, boost::get_system_time() + boost::posix_time::milliseconds(nMilliSeconds));
+}
+
+static void Repeat(CScheduler* s, CScheduler::Function f, int64_t nMilliSeconds)
+{
+    f();
+    s->scheduleFromNow(boost::bind(&Repeat, s, f, nMilliSeconds), nMilliSeconds);
+}
+
+void CScheduler::scheduleEvery(CScheduler::Function f, int64_t nMilliSeconds)
+{
+    scheduleFromNow(boost::bind(&Repeat, this, f, nMilliSeconds), nMilliSeconds);
+}
+
+size_t CScheduler::getQueueInfo(boost::system_time& first, boost::system_time& last) const
+{
+    boost::unique_lock<boost::mutex> lock(newTaskMutex);
+    size_t nResult = taskQueue.size();
+    if (!taskQueue.empty())
+    {
+        first = taskQueue.begin()->first;
+        last = taskQueue.rbegin()->first;
+    }
+    return nResult;
+}
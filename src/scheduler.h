@@ -0,0 +1,68 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SCHEDULER_H
+#define BITCOIN_SCHEDULER_H
+
+#include <map>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+/** Runs tasks at a given time, or every so many milliseconds, on the
+ * threads that call serviceQueue(), instead of a thread per periodic task
+ * sleeping in a loop.
+ *
+ * Usage:
+ *
+ *   CScheduler* s = new CScheduler();
+ *   s->scheduleEvery(&DumpData, 900000);
+ *   boost::thread* t = new boost::thread(boost::bind(&CScheduler::serviceQueue, s));
+ *
+ * and to stop it, either of
+ *   t->interrupt(); t->join();
+ *   s->stop(false); t->join();
+ *
+ * Tasks should be short, the queue waits for each to finish.
+ */
+class CScheduler
+{
+public:
+    CScheduler();
+    ~CScheduler();
+
+    typedef boost::function<void(void)> Function;
+
+    // Call f once at time t
+    void schedule(Function f, boost::system_time t);
+
+    // Call f once, nMilliSeconds from now
+    void scheduleFromNow(Function f, int64_t nMilliSeconds);
+
+    // Call f every nMilliSeconds, the first time nMilliSeconds from now.
+    // The interval runs from the end of one call to the start of the next.
+    void scheduleEvery(Function f, int64_t nMilliSeconds);
+
+    // Run tasks as they come due until stop() is called or the thread is
+    // interrupted. Any number of threads may service the queue.
+    void serviceQueue();
+
+    // Make serviceQueue() return, right away or once the queue is empty
+    void stop(bool fDrain = false);
+
+    // Number of tasks queued, and the times of the first and last
+    size_t getQueueInfo(boost::system_time& first, boost::system_time& last) const;
+
+private:
+    std::multimap<boost::system_time, Function> taskQueue;
+    boost::condition_variable newTaskScheduled;
+    mutable boost::mutex newTaskMutex;
+    int nThreadsServicingQueue;
+    bool fStopRequested;
+    bool fStopWhenEmpty;
+
+    bool shouldStop() const { return fStopRequested || (fStopWhenEmpty && taskQueue.empty()); }
+};
+
+#endif
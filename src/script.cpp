@@ -8,8 +8,6 @@
    -------------------------------------------- */
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -24,6 +22,7 @@ using namespace boost;
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
+#include "cuckoocache.h"
 
 namespace {
 
@@ -110,7 +109,7 @@ const char* ScriptErrorString(const ScriptError serror)
 }
 
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache* pcache = NULL);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
@@ -439,7 +438,7 @@ bool static CheckPubKeyEncoding(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -1151,7 +1150,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         return false;
 
                     bool fSuccess = CheckSignatureEncoding(vchSig) && CheckPubKeyEncoding(vchPubKey) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
 
                     popstack(stack);
                     popstack(stack);
@@ -1215,7 +1214,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = CheckSignatureEncoding(vchSig) && CheckPubKeyEncoding(vchPubKey) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
 
                         if (fOk)
                         {
@@ -2096,6 +2095,59 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return ss.GetHash();
 }
 
+CSignatureHashCache::CSignatureHashCache(const CTransaction& txTo)
+{
+    // Same layout as CTransaction::Serialize, with an empty script in every input
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+    vInputPos.reserve(txTo.vin.size() + 1);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+    {
+        vInputPos.push_back(ss.size());
+        ss << txin.prevout << CScript() << txin.nSequence;
+    }
+    vInputPos.push_back(ss.size());
+    ss << txTo.vout << txTo.nLockTime;
+    vchBlank.assign(ss.begin(), ss.end());
+
+    vMidstate.reserve(txTo.vin.size());
+    CSHA256 hasher;
+    unsigned int nPos = 0;
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        hasher.Write(&vchBlank[nPos], vInputPos[i] - nPos);
+        nPos = vInputPos[i];
+        vMidstate.push_back(hasher);
+    }
+}
+
+bool CSignatureHashCache::SignatureHash(const CScript& scriptCodeIn, const CTransaction& txTo, unsigned int nIn, int nHashType, uint256& hashRet) const
+{
+    // SIGHASH_NONE, SIGHASH_SINGLE and ANYONECANPAY change the other inputs or outputs
+    if ((nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE || (nHashType & SIGHASH_ANYONECANPAY))
+        return false;
+    if (nIn >= vMidstate.size() || vInputPos.size() != txTo.vin.size() + 1)
+        return false;
+
+    CScript scriptCode(scriptCodeIn);
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    const CTxIn& txin = txTo.vin[nIn];
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txin.prevout << scriptCode << txin.nSequence;
+
+    CSHA256 hasher(vMidstate[nIn]);
+    hasher.Write((const unsigned char*)&ss[0], ss.size());
+    hasher.Write(&vchBlank[vInputPos[nIn + 1]], vchBlank.size() - vInputPos[nIn + 1]);
+    hasher.Write((const unsigned char*)&nHashType, sizeof(nHashType));
+
+    uint256 hash1;
+    hasher.Finalize(hash1.begin());
+    CSHA256().Write(hash1.begin(), 32).Finalize(hashRet.begin());
+    return true;
+}
+
 
 bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
 {
@@ -2106,6 +2158,9 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     // The checksig op will also drop the signatures from its hash.
     uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
+    // The scriptSig is rewritten from here on
+    txTo.InvalidateHash();
+
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
         return false;
@@ -2149,63 +2204,70 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
 
+// Cache entries are already salted SHA-256 hashes, so their eight 32-bit
+// words make good cuckoo hashes
+class CSignatureCacheHasher
+{
+public:
+    void operator()(const uint256& entry, uint32_t locs[8]) const
+    {
+        memcpy(locs, entry.begin(), 32);
+    }
+};
+
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
+    // Random salt, so an attacker cannot pick signatures that collide in the cache
+    uint256 nonce;
+    CCuckooCache<uint256, CSignatureCacheHasher> setValid;
     boost::shared_mutex cs_sigcache;
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache()
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        GetRandBytes(nonce.begin(), 32);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    // entry is the salted hash of (signature hash, signature, public key)
+    void ComputeEntry(uint256& entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    {
+        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(pubKey.begin(), pubKey.size()).Write(vchSig.data(), vchSig.size()).Finalize(entry.begin());
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    // Lookups only share the lock with each other, erasing just flags the slot
+    bool Get(const uint256& entry, bool fErase)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        return setValid.contains(entry, fErase);
+    }
 
+    void Set(const uint256& entry)
+    {
         boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        setValid.insert(entry);
+    }
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    uint32_t Setup(size_t nBytes)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        return setValid.setup_bytes(nBytes);
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache signatureCache;
+
+void InitSignatureCache()
 {
-    static CSignatureCache signatureCache;
+    // -maxsigcachesize is in MiB, 0 disables the cache
+    int64_t nMaxCacheSize = std::max((int64_t)0, std::min((int64_t)GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), MAX_MAX_SIG_CACHE_SIZE));
+    size_t nElems = signatureCache.Setup(nMaxCacheSize << 20);
+    LogPrintf("Using %d MiB for the signature cache, able to store %u elements\n", nMaxCacheSize, nElems);
+}
 
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache* pcache)
+{
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
         return false;
@@ -2219,16 +2281,23 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash;
+    if (pcache == NULL || !pcache->SignatureHash(scriptCode, txTo, nIn, nHashType, sighash))
+        sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    // Signatures checked while connecting a block (SCRIPT_VERIFY_NOCACHE)
+    // are not needed again, their slots are freed for new entries
+    if (signatureCache.Get(entry, flags & SCRIPT_VERIFY_NOCACHE))
         return true;
 
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
 
     return true;
 }
@@ -2726,15 +2795,15 @@ bool SignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn, const vec
 }
 
 
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pcache))
         return false;
 
     stackCopy = stack;
 
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pcache))
         return false;
     if (stack.empty())
         return false;
@@ -2752,7 +2821,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pcache))
             return false;
         if (stackCopy.empty())
             return false;
@@ -2862,7 +2931,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, unsigne
     return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
 }*/
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -2873,7 +2942,7 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, flags, nHashType);
+    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, flags, nHashType, pcache);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -18,11 +18,13 @@
 #include "bignum.h"
 #include "util.h"
 #include "stealth.h"
+#include "crypto/sha256.h"
 
 typedef std::vector<unsigned char> valtype;
 
 class CKeyStore;
 class CTransaction;
+class CSignatureHashCache;
 
 class BaseSignatureChecker;
 
@@ -150,6 +152,11 @@ enum isminetype
 typedef uint8_t isminefilter;
 
 
+/** -maxsigcachesize default, in MiB */
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+/** Maximum -maxsigcachesize, in MiB */
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
+
 // Mandatory script verification flags that all new blocks must comply with for
 // them to be valid. (but old blocks may not comply with)
 //
@@ -972,7 +979,7 @@ public:
 
 
 bool IsDERSignature(const valtype &vchSig, bool haveHashType = true);
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache = NULL);
 bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* error = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
@@ -984,8 +991,10 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache = NULL);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache = NULL);
+/** Size the signature cache from -maxsigcachesize */
+void InitSignatureCache();
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* error = NULL);
 
@@ -1000,6 +1009,35 @@ bool Solver(const CKeyStore& keystore, const CScript& scriptPubKey, uint256 hash
                   CScript& scriptSigRet, txnouttype& whichTypeRet);
 //uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
+/** Signature hash state shared by all inputs of one transaction.
+ *
+ * SignatureHash() copies the whole transaction and serializes it again for
+ * every signature it checks. For the common SIGHASH_ALL case the only part
+ * that differs between inputs is the scriptCode placed in the input being
+ * signed, so the transaction is serialized once here with every scriptSig
+ * blanked, and the SHA256 state is saved at the start of each input. A
+ * signature hash then resumes from that state, writes its own input and
+ * the cached rest of the transaction. The bytes hashed are unchanged.
+ */
+class CSignatureHashCache
+{
+private:
+    // Transaction serialized with every scriptSig empty
+    std::vector<unsigned char> vchBlank;
+
+    // Offset of each input in vchBlank, followed by the offset of the outputs
+    std::vector<unsigned int> vInputPos;
+
+    // SHA256 state after hashing vchBlank up to each input
+    std::vector<CSHA256> vMidstate;
+
+public:
+    explicit CSignatureHashCache(const CTransaction& txTo);
+
+    // Returns false if nHashType needs the full SignatureHash()
+    bool SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, uint256& hashRet) const;
+};
+
 
 class BaseSignatureChecker
 {
@@ -1319,4 +1319,54 @@ public:
     }
 };
 
+/** Non-owning, read-only stream over a range of memory such as a mapped file.
+ *  Objects are deserialized directly from the range, reads past its end throw.
+ */
+class CMemoryReader
+{
+private:
+    const char* pread;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CMemoryReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pread(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    size_t size() const          { return pend - pread; }
+    bool empty() const           { return pread == pend; }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CMemoryReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read : end of data");
+        memcpy(pch, pread, nSize);
+        pread += nSize;
+        return (*this);
+    }
+
+    CMemoryReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore : end of data");
+        pread += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
@@ -0,0 +1,76 @@
+// Copyright (c) 2012-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+/** Unbounded single-producer/single-consumer queue.
+  *
+  * Exactly one thread may call Push() and exactly one (other) thread may
+  * call Pop() and Empty(); neither side ever takes a lock. The list always
+  * holds one spent node at its head, so the producer only touches the tail
+  * and the consumer only touches the head, and the two meet on the atomic
+  * next pointer of the last node.
+  */
+template<typename T> class CSPSCQueue {
+private:
+    struct Node {
+        std::atomic<Node*> next;
+        T value;
+
+        Node() : next(NULL), value() {}
+        explicit Node(const T& valueIn) : next(NULL), value(valueIn) {}
+    };
+
+    // Owned by the consumer
+    Node* head;
+
+    // Owned by the producer
+    Node* tail;
+
+    CSPSCQueue(const CSPSCQueue&);
+    void operator=(const CSPSCQueue&);
+
+public:
+    CSPSCQueue() {
+        head = tail = new Node();
+    }
+
+    // Producer side
+    void Push(const T& value) {
+        Node* node = new Node(value);
+        tail->next.store(node, std::memory_order_release);
+        tail = node;
+    }
+
+    // Consumer side, returns false if nothing is queued
+    bool Pop(T& value) {
+        Node* next = head->next.load(std::memory_order_acquire);
+        if (next == NULL)
+            return false;
+        value = std::move(next->value);
+        delete head;
+        head = next;
+        return true;
+    }
+
+    // Consumer side
+    bool Empty() const {
+        return head->next.load(std::memory_order_acquire) == NULL;
+    }
+
+    // Both sides must be quiescent
+    ~CSPSCQueue() {
+        while (head != NULL) {
+            Node* next = head->next.load(std::memory_order_relaxed);
+            delete head;
+            head = next;
+        }
+    }
+};
+
+#endif
@@ -3,12 +3,20 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
+#include <atomic>
+#include <deque>
 #include <map>
 
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
 #include <leveldb/filter_policy.h>
@@ -16,6 +24,8 @@
 
 #include "kernel.h"
 #include "checkpoints.h"
+#include "crypto/sha256.h"
+#include "init.h"
 #include "txdb.h"
 #include "util.h"
 #include "main.h"
@@ -25,6 +35,72 @@ using namespace std;
 using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
+bool fTxDBSync = false;
+
+// Shared in-memory caches in front of the "tx" records and of the
+// transactions read through ReadDiskTx. Entries are evicted in insertion order.
+// nTxIndexCacheGeneration is bumped on every tx index write so that a reader
+// which missed the cache never inserts a value that was overwritten while it
+// was reading from LevelDB.
+static CCriticalSection cs_txdbcache;
+static map<uint256, CTxIndex> mapTxIndexCache;
+static deque<uint256> dequeTxIndexCache;
+static map<uint256, CTransaction> mapTxCache;
+static deque<uint256> dequeTxCache;
+static uint64_t nTxIndexCacheGeneration = 0;
+static CTxDBCacheStats txdbCacheStats;
+
+static void TxIndexCacheInsert(const uint256& hash, const CTxIndex& txindex)
+{
+    static const unsigned int nMaxEntries = GetArg("-txindexcache", DEFAULT_TXINDEX_CACHE);
+    if (nMaxEntries == 0)
+        return;
+
+    pair<map<uint256, CTxIndex>::iterator, bool> ret = mapTxIndexCache.insert(make_pair(hash, txindex));
+    if (!ret.second)
+    {
+        ret.first->second = txindex;
+        return;
+    }
+    dequeTxIndexCache.push_back(hash);
+
+    while (dequeTxIndexCache.size() > nMaxEntries)
+    {
+        mapTxIndexCache.erase(dequeTxIndexCache.front());
+        dequeTxIndexCache.pop_front();
+    }
+}
+
+static void TxIndexCacheErase(const uint256& hash)
+{
+    // The stale hash stays in the eviction queue, erasing it there later is harmless
+    mapTxIndexCache.erase(hash);
+}
+
+static void TxCacheInsert(const uint256& hash, const CTransaction& tx)
+{
+    static const unsigned int nMaxEntries = GetArg("-txcache", DEFAULT_TX_CACHE);
+    if (nMaxEntries == 0)
+        return;
+
+    if (!mapTxCache.insert(make_pair(hash, tx)).second)
+        return;
+    dequeTxCache.push_back(hash);
+
+    while (dequeTxCache.size() > nMaxEntries)
+    {
+        mapTxCache.erase(dequeTxCache.front());
+        dequeTxCache.pop_front();
+    }
+}
+
+void GetTxDBCacheStats(CTxDBCacheStats& stats)
+{
+    LOCK(cs_txdbcache);
+    stats = txdbCacheStats;
+    stats.nTxIndexEntries = mapTxIndexCache.size();
+    stats.nTxEntries = mapTxCache.size();
+}
 
 static leveldb::Options GetOptions() {
     leveldb::Options options;
@@ -133,97 +209,230 @@ void CTxDB::Close()
     options.block_cache = NULL;
     delete activeBatch;
     activeBatch = NULL;
+    mapTxnTxIndex.clear();
+    mapTxnWrites.clear();
+
+    LOCK(cs_txdbcache);
+    mapTxIndexCache.clear();
+    dequeTxIndexCache.clear();
+    mapTxCache.clear();
+    dequeTxCache.clear();
+    nTxIndexCacheGeneration++;
 }
 
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
     activeBatch = new leveldb::WriteBatch();
+    mapTxnTxIndex.clear();
+    mapTxnWrites.clear();
     return true;
 }
 
-bool CTxDB::TxnCommit()
+bool CTxDB::TxnCommit(bool fSync)
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = fSync;
+    leveldb::Status status = pdb->Write(writeOptions, activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    mapTxnWrites.clear();
     if (!status.ok()) {
+        mapTxnTxIndex.clear();
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
     }
-    return true;
-}
-
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
+    // The batch is on disk, publish its tx index records to the shared cache
+    if (!mapTxnTxIndex.empty())
+    {
+        LOCK(cs_txdbcache);
+        nTxIndexCacheGeneration++;
+        for (map<uint256, CTxIndex>::iterator it = mapTxnTxIndex.begin(); it != mapTxnTxIndex.end(); ++it)
+        {
+            if ((*it).second.IsNull())
+                TxIndexCacheErase((*it).first);
+            else
+                TxIndexCacheInsert((*it).first, (*it).second);
         }
+        txdbCacheStats.nTxnFlushes++;
+        txdbCacheStats.nTxnFlushedEntries += mapTxnTxIndex.size();
+        mapTxnTxIndex.clear();
     }
-};
+    return true;
+}
 
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The writes are
+// mirrored in mapTxnWrites, so this is a lookup rather than a batch replay.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
-    }
-    return scanner.foundEntry;
+    map<string, pair<bool, string> >::const_iterator it = mapTxnWrites.find(key.str());
+    if (it == mapTxnWrites.end())
+        return false;
+    *deleted = (*it).second.first;
+    if (!*deleted)
+        *value = (*it).second.second;
+    return true;
 }
 
-bool CTxDB::WriteAddrIndex(uint160 addrHash, uint256 txHash)
+bool CTxDB::WriteAddrIndex(const CAddrIndexEntry& entry)
 {
-    std::vector<uint256> txHashes;
-    if(!ReadAddrIndex(addrHash, txHashes))
+    return Write(make_pair(string("adx"), entry.key), make_pair(entry.hashTx, entry.pos));
+}
+
+bool CTxDB::EraseAddrIndex(const CAddrIndexKey& key)
+{
+    return Erase(make_pair(string("adx"), key));
+}
+
+bool CTxDB::ReadAddrIndex(const CAddrIndexKey& keyStart, unsigned int nHeightEnd, int nSkip, unsigned int nCount,
+                          vector<CAddrIndexEntry>& vEntries, bool& fMore)
+{
+    vEntries.clear();
+    fMore = false;
+    if (keyStart.nHeight > nHeightEnd)
+        return true;
+
+    CDataStream ssFirst(SER_DISK, CLIENT_VERSION);
+    ssFirst << make_pair(string("adx"), keyStart);
+    CDataStream ssLast(SER_DISK, CLIENT_VERSION);
+    ssLast << make_pair(string("adx"), CAddrIndexKey(keyStart.addrHash, nHeightEnd, std::numeric_limits<unsigned int>::max()));
+    string strFirst = ssFirst.str();
+    string strLast = ssLast.str();
+
+    // Only the keys are compared while skipping, nothing is unpacked
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    if (nSkip >= 0)
     {
-	txHashes.push_back(txHash);
-        return Write(make_pair(string("adr"), addrHash), txHashes);
+        iterator->Seek(strFirst);
+        for (; nSkip > 0 && iterator->Valid() && iterator->key().compare(strLast) <= 0; nSkip--)
+            iterator->Next();
     }
     else
     {
-	if(std::find(txHashes.begin(), txHashes.end(), txHash) == txHashes.end()) 
-    	{
-    	    txHashes.push_back(txHash);
-            return Write(make_pair(string("adr"), addrHash), txHashes);
-	}
-	else
-	{
-	    return true; // already have this tx hash
-	}
+        // Step back from the end of the range, stopping at its start
+        iterator->Seek(strLast);
+        if (!iterator->Valid())
+            iterator->SeekToLast();
+        else if (iterator->key().compare(strLast) > 0)
+            iterator->Prev();
+        for (int i = -1; i > nSkip && iterator->Valid() && iterator->key().compare(strFirst) >= 0; i--)
+            iterator->Prev();
+        if (!iterator->Valid() || iterator->key().compare(strFirst) < 0)
+            iterator->Seek(strFirst);
+    }
+
+    for (; iterator->Valid() && iterator->key().compare(strLast) <= 0; iterator->Next())
+    {
+        if (vEntries.size() == nCount)
+        {
+            fMore = true;
+            break;
+        }
+
+        CAddrIndexEntry entry;
+        try {
+            CDataStream ssKey(iterator->key().data(), iterator->key().data() + iterator->key().size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            ssKey >> strType >> entry.key;
+            CDataStream ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> entry.hashTx >> entry.pos;
+        }
+        catch (std::exception &e) {
+            delete iterator;
+            return error("ReadAddrIndex() : deserialize error");
+        }
+        vEntries.push_back(entry);
     }
+    delete iterator;
+    return true;
 }
 
-bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes)
+// Entries are written in their serialized key order so each batch lands in
+// the memtable, and later in the sorted tables, as one run
+static const size_t ADDRINDEX_BATCH_BYTES = 16 << 20;
+
+struct CompareAddrIndexEntryKey
 {
-    return Read(make_pair(string("adr"), addrHash), txHashes);
+    bool operator()(const CAddrIndexEntry& a, const CAddrIndexEntry& b) const
+    {
+        if (a.key.addrHash != b.key.addrHash)
+            return memcmp(a.key.addrHash.begin(), b.key.addrHash.begin(), 20) < 0;
+        if (a.key.nHeight != b.key.nHeight)
+            return a.key.nHeight < b.key.nHeight;
+        return a.key.nTxIndex < b.key.nTxIndex;
+    }
+};
+
+bool CTxDB::WriteAddrIndexBatch(vector<CAddrIndexEntry>& vEntries)
+{
+    assert(!activeBatch && !fReadOnly);
+
+    sort(vEntries.begin(), vEntries.end(), CompareAddrIndexEntryKey());
+
+    leveldb::WriteBatch batch;
+    size_t nBatchBytes = 0;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << make_pair(string("adx"), vEntries[i].key);
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << make_pair(vEntries[i].hashTx, vEntries[i].pos);
+        batch.Put(ssKey.str(), ssValue.str());
+        nBatchBytes += ssKey.size() + ssValue.size();
+
+        if (nBatchBytes >= ADDRINDEX_BATCH_BYTES || i + 1 == vEntries.size())
+        {
+            leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+            if (!status.ok())
+                return error("WriteAddrIndexBatch() : LevelDB batch write failure: %s", status.ToString());
+            batch.Clear();
+            nBatchBytes = 0;
+        }
+    }
+    return true;
+}
+
+bool CTxDB::EraseAddrIndex()
+{
+    assert(!activeBatch && !fReadOnly);
+
+    // "adr" held one txid list per address before the index was ordered by height
+    const char* apszPrefix[] = {"adr", "adx"};
+    leveldb::Status status;
+    for (unsigned int i = 0; i < sizeof(apszPrefix) / sizeof(apszPrefix[0]) && status.ok(); i++)
+    {
+        CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+        ssPrefix << string(apszPrefix[i]);
+        string strPrefix = ssPrefix.str();
+
+        leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+        leveldb::WriteBatch batch;
+        size_t nBatchBytes = 0;
+        for (iterator->Seek(strPrefix); iterator->Valid() && iterator->key().starts_with(strPrefix); iterator->Next())
+        {
+            batch.Delete(iterator->key());
+            nBatchBytes += iterator->key().size();
+            if (nBatchBytes >= ADDRINDEX_BATCH_BYTES)
+            {
+                status = pdb->Write(leveldb::WriteOptions(), &batch);
+                if (!status.ok())
+                    break;
+                batch.Clear();
+                nBatchBytes = 0;
+            }
+        }
+        delete iterator;
+        if (status.ok())
+            status = pdb->Write(leveldb::WriteOptions(), &batch);
+    }
+    if (!status.ok())
+        return error("EraseAddrIndex() : LevelDB batch write failure: %s", status.ToString());
+    return true;
 }
 
 /* ----------------------------------------------------------------------- 
@@ -232,11 +441,38 @@ bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes)
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
 bool read_status;
+uint64_t nGeneration;
 
     read_status = false;
 
     txindex.SetNull();
 
+    // Records written by the open transaction take precedence over the caches
+    if (activeBatch)
+    {
+        map<uint256, CTxIndex>::iterator mi = mapTxnTxIndex.find(hash);
+        if (mi != mapTxnTxIndex.end())
+        {
+            if ((*mi).second.IsNull())
+                return false;
+            txindex = (*mi).second;
+            return true;
+        }
+    }
+
+    {
+        LOCK(cs_txdbcache);
+        map<uint256, CTxIndex>::iterator mi = mapTxIndexCache.find(hash);
+        if (mi != mapTxIndexCache.end())
+        {
+            txdbCacheStats.nTxIndexHits++;
+            txindex = (*mi).second;
+            return true;
+        }
+        txdbCacheStats.nTxIndexMisses++;
+        nGeneration = nTxIndexCacheGeneration;
+    }
+
         try
         {
             /* Looks like READ() is failing, when the transaction is not on disk */
@@ -262,11 +498,11 @@ bool read_status;
             PrintExceptionContinue(NULL, "cont Read()");
         }
 
-        MilliSleep(1);
-
         if ( read_status )
         {
-            MilliSleep( 1);
+            LOCK(cs_txdbcache);
+            if (nGeneration == nTxIndexCacheGeneration)
+                TxIndexCacheInsert(hash, txindex);
             return true;
         }
         else
@@ -281,7 +517,18 @@ bool read_status;
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
-    return Write(make_pair(string("tx"), hash), txindex);
+    if (!Write(make_pair(string("tx"), hash), txindex))
+        return false;
+
+    if (activeBatch)
+        mapTxnTxIndex[hash] = txindex;
+    else
+    {
+        LOCK(cs_txdbcache);
+        nTxIndexCacheGeneration++;
+        TxIndexCacheInsert(hash, txindex);
+    }
+    return true;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -289,18 +536,40 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return UpdateTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
 {
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    if (!Erase(make_pair(string("tx"), hash)))
+        return false;
+
+    if (activeBatch)
+        mapTxnTxIndex[hash].SetNull();
+    else
+    {
+        LOCK(cs_txdbcache);
+        nTxIndexCacheGeneration++;
+        TxIndexCacheErase(hash);
+    }
+    return true;
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
+    if (activeBatch)
+    {
+        map<uint256, CTxIndex>::iterator mi = mapTxnTxIndex.find(hash);
+        if (mi != mapTxnTxIndex.end())
+            return !(*mi).second.IsNull();
+    }
+    {
+        LOCK(cs_txdbcache);
+        if (mapTxIndexCache.count(hash))
+            return true;
+    }
     return Exists(make_pair(string("tx"), hash));
 }
 
@@ -309,7 +578,35 @@ bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
     tx.SetNull();
     if (!ReadTxIndex(hash, txindex))
         return false;
-    return (tx.ReadFromDisk(txindex.pos));
+
+    {
+        LOCK(cs_txdbcache);
+        map<uint256, CTransaction>::iterator mi = mapTxCache.find(hash);
+        if (mi != mapTxCache.end())
+        {
+            txdbCacheStats.nTxHits++;
+            tx = (*mi).second;
+            return true;
+        }
+        txdbCacheStats.nTxMisses++;
+    }
+
+    // CTransaction::ReadFromDisk(CDiskTxPos) no longer deserializes, so take
+    // the transaction out of the block that holds it
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, true))
+        return false;
+    BOOST_FOREACH(const CTransaction& txBlock, block.vtx)
+    {
+        if (txBlock.GetHash() == hash)
+        {
+            tx = txBlock;
+            LOCK(cs_txdbcache);
+            TxCacheInsert(hash, tx);
+            return true;
+        }
+    }
+    return error("CTxDB::ReadDiskTx() : %s not in block at index position", hash.ToString());
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx)
@@ -375,6 +672,286 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+// Block index snapshot, blkindex.snap in the data directory. A header,
+// then one fixed size little-endian record per block index entry in height
+// order, parents referred to by record number, then a SHA256 of all that.
+static const uint32_t BLOCKINDEX_SNAPSHOT_VERSION = 1;
+static const size_t SNAPSHOT_HEADER_SIZE = 4 + 4 + 4 + 4 + 32;
+static const size_t SNAPSHOT_RECORD_SIZE = 272;
+static const uint32_t SNAPSHOT_NONE = (uint32_t)-1;
+
+static boost::filesystem::path BlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.snap";
+}
+
+static unsigned char* WriteSnapshotHash(unsigned char* p, const uint256& hash)
+{
+    memcpy(p, hash.begin(), 32);
+    return p + 32;
+}
+
+static const unsigned char* ReadSnapshotHash(const unsigned char* p, uint256& hash)
+{
+    memcpy(hash.begin(), p, 32);
+    return p + 32;
+}
+
+static void WriteSnapshotRecord(unsigned char* p, const CBlockIndex* pindex, uint32_t nPrev, uint32_t nNext)
+{
+    p = WriteSnapshotHash(p, pindex->GetBlockHash());
+    WriteLE32(p, nPrev); p += 4;
+    WriteLE32(p, nNext); p += 4;
+    WriteLE32(p, pindex->nFile); p += 4;
+    WriteLE32(p, pindex->nBlockPos); p += 4;
+    WriteLE32(p, pindex->nHeight); p += 4;
+#ifndef LOWMEM
+    WriteLE64(p, pindex->nMint); p += 8;
+    WriteLE64(p, pindex->nMoneySupply); p += 8;
+    WriteLE64(p, pindex->nLastReward); p += 8;
+#else
+    memset(p, 0, 24); p += 24;
+#endif
+    WriteLE32(p, pindex->nFlags); p += 4;
+    WriteLE64(p, pindex->nStakeModifier); p += 8;
+#ifndef LOWMEM
+    p = WriteSnapshotHash(p, pindex->bnStakeModifierV2);
+#else
+    p = WriteSnapshotHash(p, 0);
+#endif
+    p = WriteSnapshotHash(p, pindex->prevoutStake.hash);
+    WriteLE32(p, pindex->prevoutStake.n); p += 4;
+    WriteLE32(p, pindex->nStakeTime); p += 4;
+    p = WriteSnapshotHash(p, pindex->hashProof);
+    WriteLE32(p, pindex->nVersion); p += 4;
+    p = WriteSnapshotHash(p, pindex->hashMerkleRoot);
+    WriteLE32(p, pindex->nTime); p += 4;
+    WriteLE32(p, pindex->nBits); p += 4;
+    WriteLE32(p, pindex->nNonce); p += 4;
+    WriteSnapshotHash(p, pindex->nChainTrust);
+}
+
+// Fill pindex from a record, all but its hash and links
+static void ReadSnapshotRecord(const unsigned char* p, CBlockIndex* pindex)
+{
+    p += 32 + 4 + 4;
+    pindex->nFile = ReadLE32(p); p += 4;
+    pindex->nBlockPos = ReadLE32(p); p += 4;
+    pindex->nHeight = ReadLE32(p); p += 4;
+#ifndef LOWMEM
+    pindex->nMint = ReadLE64(p); p += 8;
+    pindex->nMoneySupply = ReadLE64(p); p += 8;
+    pindex->nLastReward = ReadLE64(p); p += 8;
+#else
+    p += 24;
+#endif
+    pindex->nFlags = ReadLE32(p); p += 4;
+    pindex->nStakeModifier = ReadLE64(p); p += 8;
+#ifndef LOWMEM
+    p = ReadSnapshotHash(p, pindex->bnStakeModifierV2);
+#else
+    p += 32;
+#endif
+    p = ReadSnapshotHash(p, pindex->prevoutStake.hash);
+    pindex->prevoutStake.n = ReadLE32(p); p += 4;
+    pindex->nStakeTime = ReadLE32(p); p += 4;
+    p = ReadSnapshotHash(p, pindex->hashProof);
+    pindex->nVersion = ReadLE32(p); p += 4;
+    p = ReadSnapshotHash(p, pindex->hashMerkleRoot);
+    pindex->nTime = ReadLE32(p); p += 4;
+    pindex->nBits = ReadLE32(p); p += 4;
+    pindex->nNonce = ReadLE32(p); p += 4;
+    ReadSnapshotHash(p, pindex->nChainTrust);
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    LOCK(cs_main);
+    if (pindexBest == NULL)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    map<const CBlockIndex*, uint32_t> mapRecord;
+    for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
+        mapRecord[vSortedByHeight[i].second] = i;
+
+    boost::filesystem::path pathSnapshot = BlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = pathSnapshot;
+    pathTmp.replace_extension(".tmp");
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : cannot open %s", pathTmp.string());
+
+    CSHA256 hasher;
+    vector<unsigned char> vBuf(SNAPSHOT_HEADER_SIZE);
+    memcpy(&vBuf[0], Params().MessageStart(), 4);
+    WriteLE32(&vBuf[4], BLOCKINDEX_SNAPSHOT_VERSION);
+    WriteLE32(&vBuf[8], SNAPSHOT_RECORD_SIZE);
+    WriteLE32(&vBuf[12], vSortedByHeight.size());
+    WriteSnapshotHash(&vBuf[16], hashBestChain);
+
+    // Records go out a few thousand at a time
+    bool fOk = true;
+    unsigned int i = 0;
+    while (fOk)
+    {
+        hasher.Write(&vBuf[0], vBuf.size());
+        fOk = fwrite(&vBuf[0], 1, vBuf.size(), file) == vBuf.size();
+        if (i == vSortedByHeight.size())
+            break;
+
+        unsigned int nRecords = std::min((size_t)4096, vSortedByHeight.size() - i);
+        vBuf.resize(nRecords * SNAPSHOT_RECORD_SIZE);
+        for (unsigned int j = 0; j < nRecords; j++, i++)
+        {
+            const CBlockIndex* pindex = vSortedByHeight[i].second;
+            uint32_t nPrev = pindex->pprev ? mapRecord[pindex->pprev] : SNAPSHOT_NONE;
+            uint32_t nNext = pindex->pnext ? mapRecord[pindex->pnext] : SNAPSHOT_NONE;
+            WriteSnapshotRecord(&vBuf[j * SNAPSHOT_RECORD_SIZE], pindex, nPrev, nNext);
+        }
+    }
+
+    uint256 hashData;
+    hasher.Finalize(hashData.begin());
+    fOk = fOk && fwrite(hashData.begin(), 1, 32, file) == 32;
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, pathSnapshot))
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove(pathTmp, ec);
+        return error("WriteBlockIndexSnapshot() : cannot write %s", pathSnapshot.string());
+    }
+
+    LogPrintf("Wrote %u block index entries to %s in %dms\n", vSortedByHeight.size(), pathSnapshot.filename().string(), GetTimeMillis() - nStart);
+    return true;
+}
+
+// Load mapBlockIndex from the snapshot if it was taken at hashBestOnDisk.
+// On any mismatch nothing is loaded and the database is scanned instead.
+static bool ReadBlockIndexSnapshot(const uint256& hashBestOnDisk)
+{
+    boost::filesystem::path pathSnapshot = BlockIndexSnapshotPath();
+    int64_t nStart = GetTimeMillis();
+
+    const unsigned char* pBegin = NULL;
+    size_t nSize = 0;
+#ifndef WIN32
+    int fd = open(pathSnapshot.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void* pMap = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        pMap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pMap == MAP_FAILED)
+        return false;
+    pBegin = (const unsigned char*)pMap;
+    nSize = st.st_size;
+#else
+    vector<unsigned char> vData;
+    {
+        boost::system::error_code ec;
+        uintmax_t nFileSize = boost::filesystem::file_size(pathSnapshot, ec);
+        FILE* file = ec ? NULL : fopen(pathSnapshot.string().c_str(), "rb");
+        if (!file)
+            return false;
+        vData.resize(nFileSize);
+        bool fRead = nFileSize > 0 && fread(&vData[0], 1, nFileSize, file) == nFileSize;
+        fclose(file);
+        if (!fRead)
+            return false;
+    }
+    pBegin = &vData[0];
+    nSize = vData.size();
+#endif
+
+    bool fOk = false;
+    uint32_t nRecords = 0;
+    uint256 hashBestSnapshot;
+    if (nSize >= SNAPSHOT_HEADER_SIZE + 32)
+    {
+        nRecords = ReadLE32(pBegin + 12);
+        ReadSnapshotHash(pBegin + 16, hashBestSnapshot);
+        fOk = memcmp(pBegin, Params().MessageStart(), 4) == 0 &&
+              ReadLE32(pBegin + 4) == BLOCKINDEX_SNAPSHOT_VERSION &&
+              ReadLE32(pBegin + 8) == SNAPSHOT_RECORD_SIZE &&
+              nSize == SNAPSHOT_HEADER_SIZE + (size_t)nRecords * SNAPSHOT_RECORD_SIZE + 32 &&
+              hashBestSnapshot == hashBestOnDisk;
+    }
+    if (fOk)
+    {
+        uint256 hashData, hashStored;
+        CSHA256().Write(pBegin, nSize - 32).Finalize(hashData.begin());
+        ReadSnapshotHash(pBegin + nSize - 32, hashStored);
+        fOk = hashData == hashStored;
+    }
+    if (!fOk)
+        LogPrintf("ReadBlockIndexSnapshot() : %s does not match the database, scanning it instead\n", pathSnapshot.filename().string());
+
+    // Every entry comes out of one allocation, block index entries live until exit
+    CBlockIndex* pindexFirst = fOk ? new CBlockIndex[nRecords] : NULL;
+    const unsigned char* pRecords = pBegin + SNAPSHOT_HEADER_SIZE;
+    for (uint32_t i = 0; fOk && i < nRecords; i++)
+    {
+        const unsigned char* p = pRecords + (size_t)i * SNAPSHOT_RECORD_SIZE;
+        uint256 hash;
+        ReadSnapshotHash(p, hash);
+        uint32_t nPrev = ReadLE32(p + 32);
+        uint32_t nNext = ReadLE32(p + 36);
+        // Parents come first in height order
+        if ((nPrev != SNAPSHOT_NONE && nPrev >= i) || (nNext != SNAPSHOT_NONE && nNext >= nRecords))
+        {
+            fOk = false;
+            break;
+        }
+
+        CBlockIndex* pindexNew = &pindexFirst[i];
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(mapBlockIndex.end(), make_pair(hash, pindexNew));
+        if (mi->second != pindexNew)
+        {
+            fOk = false;
+            break;
+        }
+        pindexNew->phashBlock = &(mi->first);
+        pindexNew->pprev = nPrev == SNAPSHOT_NONE ? NULL : &pindexFirst[nPrev];
+        pindexNew->pnext = nNext == SNAPSHOT_NONE ? NULL : &pindexFirst[nNext];
+        ReadSnapshotRecord(p, pindexNew);
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && hash == Params().HashGenesisBlock())
+            pindexGenesisBlock = pindexNew;
+
+        // NovaCoin: build setStakeSeen
+        if (pindexNew->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    }
+
+#ifndef WIN32
+    munmap(pMap, nSize);
+#endif
+    if (!fOk && pindexFirst)
+    {
+        LogPrintf("ReadBlockIndexSnapshot() : %s is inconsistent, scanning the database instead\n", pathSnapshot.filename().string());
+        mapBlockIndex.clear();
+        setStakeSeen.clear();
+        pindexGenesisBlock = NULL;
+        delete[] pindexFirst;
+        return false;
+    }
+    if (fOk)
+        LogPrintf("Loaded %u block index entries from %s in %dms\n", nRecords, pathSnapshot.filename().string(), GetTimeMillis() - nStart);
+    return fOk;
+}
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -383,6 +960,52 @@ bool CTxDB::LoadBlockIndex()
         return true;
     }
 
+    // A snapshot written at the last clean shutdown stands in for the scan,
+    // if the database still has the best chain it was taken at
+    uint256 hashBestOnDisk;
+    bool fSnapshot = false;
+    if (GetBoolArg("-blockindexsnapshot", true) && ReadHashBestChain(hashBestOnDisk))
+        fSnapshot = ReadBlockIndexSnapshot(hashBestOnDisk);
+
+    // It describes the database at the shutdown that wrote it, so it is
+    // never used twice
+    boost::system::error_code ec;
+    boost::filesystem::remove(BlockIndexSnapshotPath(), ec);
+
+    if (!fSnapshot && !LoadBlockIndexGuts())
+        return false;
+
+    boost::this_thread::interruption_point();
+
+    // Load hashBestChain pointer to end of best chain
+    if (!ReadHashBestChain(hashBestChain))
+    {
+        if (pindexGenesisBlock == NULL)
+            return true;
+        return error("CTxDB::LoadBlockIndex() : hashBestChain not loaded");
+    }
+    if (!mapBlockIndex.count(hashBestChain))
+        return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
+    pindexBest = mapBlockIndex[hashBestChain];
+    SetBestChainHeightIndex(pindexBest);
+    nBestHeight = pindexBest->nHeight;
+    nBestChainTrust = pindexBest->nChainTrust;
+
+    LogPrintf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
+    hashBestChain.ToString(), nBestHeight, CBigNum(nBestChainTrust).ToString(),
+    DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()));
+
+    // Load bnBestInvalidTrust, OK if it doesn't exist
+    CBigNum bnBestInvalidTrust;
+    ReadBestInvalidTrust(bnBestInvalidTrust);
+    nBestInvalidTrust = bnBestInvalidTrust.getuint256();
+
+    // The blocks of the best chain are verified by init, through VerifyBestChain
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexGuts()
+{
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
     // out of the DB and into mapBlockIndex.
@@ -480,174 +1103,255 @@ LogPrintf("RGP Debug LoadBlockIndex Debug 002 \n");
 
 LogPrintf("RGP Debug LoadBlockIndex Debug 003 \n");
 
-    // Load hashBestChain pointer to end of best chain
-    if (!ReadHashBestChain(hashBestChain))
+    return true;
+}
+
+// Best chain positions of the blocks being verified, and their heights
+typedef map<pair<unsigned int, unsigned int>, int> BlockPosMap;
+
+// The transaction block stores at nTxPos, NULL if none starts there. The
+// offsets are worked out as ConnectBlock does when it indexes the block.
+static const CTransaction* GetTxAtPos(const CBlock& block, unsigned int nBlockPos, unsigned int nTxPos)
+{
+    unsigned int nPos = nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
     {
-        if (pindexGenesisBlock == NULL)
-            return true;
-        return error("CTxDB::LoadBlockIndex() : hashBestChain not loaded");
+        if (nPos == nTxPos)
+            return &tx;
+        nPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
-    if (!mapBlockIndex.count(hashBestChain))
-        return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
-    pindexBest = mapBlockIndex[hashBestChain];
-    nBestHeight = pindexBest->nHeight;
-    nBestChainTrust = pindexBest->nChainTrust;
-
-    LogPrintf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
-    hashBestChain.ToString(), nBestHeight, CBigNum(nBestChainTrust).ToString(),
-    DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()));
+    return NULL;
+}
 
-    // Load bnBestInvalidTrust, OK if it doesn't exist
-    CBigNum bnBestInvalidTrust;
-    ReadBestInvalidTrust(bnBestInvalidTrust);
-    nBestInvalidTrust = bnBestInvalidTrust.getuint256();
+// Read the transaction at pos. CTransaction::ReadFromDisk(CDiskTxPos) no
+// longer deserializes, so it is taken out of its block, the one being
+// checked when pos is in it.
+static bool ReadTxAtPos(const CDiskTxPos& pos, const CBlock& block, const CBlockIndex* pindex, CTransaction& tx)
+{
+    const CTransaction* ptx;
+    CBlock blockOther;
+    if (pos.nFile == pindex->nFile && pos.nBlockPos == pindex->nBlockPos)
+        ptx = GetTxAtPos(block, pos.nBlockPos, pos.nTxPos);
+    else if (blockOther.ReadFromDisk(pos.nFile, pos.nBlockPos, true))
+        ptx = GetTxAtPos(blockOther, pos.nBlockPos, pos.nTxPos);
+    else
+        return false;
 
-    // Verify blocks in the best chain
-    int nCheckLevel = GetArg("-checklevel", 1);
-    int nCheckDepth = GetArg( "-checkblocks", 500);
-    if (nCheckDepth == 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
+    if (!ptx)
+        return false;
+    tx = *ptx;
+    return true;
+}
 
-    MilliSleep( 5 );
+// Run the -checklevel checks on a block of the best chain. Returns false,
+// after logging why, when the best chain has to move back before it.
+static bool CheckBestChainBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex, int nCheckLevel, const BlockPosMap& mapBlockPos)
+{
+    bool fOk = true;
 
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    // check level 1: verify block validity
+    // check level 7: verify block signature too
+    if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
     {
-        boost::this_thread::interruption_point();
-        if (pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-
-        // RGP, new creation in loop
-        CBlock block;
+        LogPrintf("VerifyBestChain() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+        fOk = false;
+    }
+    // check level 2: verify transaction index validity
+    if (nCheckLevel<=1)
+        return fOk;
 
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
+    BOOST_FOREACH(const CTransaction &tx, block.vtx)
+    {
+        uint256 hashTx = tx.GetHash();
+        CTxIndex txindex;
+        if (txdb.ReadTxIndex(hashTx, txindex))
         {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-
-            // RGP, process block transactions
-
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
+            // check level 3: checker transaction hashes
+            if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
             {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
+                // either an error or a duplicate transaction
+                CTransaction txFound;
+                if (!ReadTxAtPos(txindex.pos, block, pindex, txFound))
+                {
+                    LogPrintf("VerifyBestChain() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
+                    fOk = false;
+                }
+                else if (txFound.GetHash() != hashTx) // not a duplicate tx
                 {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+                    LogPrintf("VerifyBestChain() : *** invalid tx position for %s\n", hashTx.ToString());
+                    fOk = false;
+                }
+            }
+            // check level 4: check whether spent txouts were spent within the main chain,
+            // by this block or one above it
+            unsigned int nOutput = 0;
+            if (nCheckLevel>3)
+            {
+                BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                {
+                    if (!txpos.IsNull())
                     {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
+                        BlockPosMap::const_iterator mi = mapBlockPos.find(make_pair(txpos.nFile, txpos.nBlockPos));
+                        if (mi == mapBlockPos.end() || mi->second < pindex->nHeight)
                         {
-                            LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
-                            pindexFork = pindex->pprev;
+                            LogPrintf("VerifyBestChain() : *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
+                            fOk = false;
                         }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
+                        // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                        if (nCheckLevel>5)
+                        {
+                            CTransaction txSpend;
+                            if (!ReadTxAtPos(txpos, block, pindex, txSpend))
                             {
-                                LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
-                                pindexFork = pindex->pprev;
+                                LogPrintf("VerifyBestChain() : *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
+                                fOk = false;
                             }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
+                            else if (!txSpend.CheckTransaction())
                             {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
+                                LogPrintf("VerifyBestChain() : *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
+                                fOk = false;
+                            }
+                            else
+                            {
+                                bool fFound = false;
+                                BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
+                                    if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                        fFound = true;
+                                if (!fFound)
                                 {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                        {
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                            MilliSleep(1);
-                                        }
-                                        if (!fFound)
-                                        {
-                                            LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
+                                    LogPrintf("VerifyBestChain() : *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
+                                    fOk = false;
                                 }
                             }
-                            nOutput++;
-                            //MilliSleep(1); /* RGP Optimise - No optimise it takes forever */
                         }
                     }
+                    nOutput++;
                 }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
+            }
+        }
+        // check level 5: check whether all prevouts are marked spent
+        if (nCheckLevel>4)
+        {
+            BOOST_FOREACH(const CTxIn &txin, tx.vin)
+            {
+                CTxIndex txindex;
+                if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
                 {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                          {
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
-                                  pindexFork = pindex->pprev;
-                              }
-                          }
-                          //MilliSleep(1);/* RGP Optimise - No optimise it takes forever */
-                     }
+                    if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                    {
+                        LogPrintf("VerifyBestChain() : *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
+                        fOk = false;
+                    }
                 }
             }
         }
-        MilliSleep( 5 ); /* RGP Optimise */
     }
+    return fOk;
+}
+
+// Reads and verifies blocks, taking the next unclaimed slot until none are
+// left. Every worker writes only the slots it claimed.
+static void ThreadVerifyBlocks(const vector<CBlockIndex*>* pvCheck, const BlockPosMap* pmapBlockPos, int nCheckLevel,
+                               vector<char>* pvBad, vector<char>* pvUnread, std::atomic<int>* pnNext)
+{
+    CTxDB txdb("r");
+    CBlock block;
+    int i;
+    while (!ShutdownRequested() && (i = pnNext->fetch_add(1)) < (int)pvCheck->size())
+    {
+        if (!block.ReadFromDisk((*pvCheck)[i]))
+            (*pvUnread)[i] = true;
+        else if (!CheckBestChainBlock(txdb, block, (*pvCheck)[i], nCheckLevel, *pmapBlockPos))
+            (*pvBad)[i] = true;
+    }
+}
 
+bool VerifyBestChain(int nCheckLevel, int nCheckDepth, bool fBackground)
+{
+    if (fBackground && nCheckLevel > MAX_BACKGROUND_CHECKLEVEL)
+    {
+        LogPrintf("VerifyBestChain() : running level %d in the background instead of %d\n", MAX_BACKGROUND_CHECKLEVEL, nCheckLevel);
+        nCheckLevel = MAX_BACKGROUND_CHECKLEVEL;
+    }
 
-    if (pindexFork)
+    int64_t nStart = GetTimeMillis();
+    vector<CBlockIndex*> vCheck;
+    BlockPosMap mapBlockPos;
     {
-        boost::this_thread::interruption_point();
-        // Reorg back to the fork
-        LogPrintf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
-        CBlock block;
-        if (!block.ReadFromDisk(pindexFork))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        CTxDB txdb;
-        block.SetBestChain(txdb, pindexFork);
+        LOCK(cs_main);
+        if (nCheckDepth == 0 || nCheckDepth > nBestHeight)
+            nCheckDepth = nBestHeight;
+        for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev && pindex->nHeight >= nBestHeight-nCheckDepth; pindex = pindex->pprev)
+        {
+            vCheck.push_back(pindex);
+            mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex->nHeight;
+        }
     }
 
+    int nThreads = std::max(nScriptCheckThreads, 1);
+    LogPrintf("Verifying last %i blocks at level %i on %d threads\n", vCheck.size(), nCheckLevel, nThreads);
+
+    vector<char> vBad(vCheck.size(), false);
+    vector<char> vUnread(vCheck.size(), false);
+    {
+        // The workers point into this frame, so wait for them even when interrupted
+        boost::this_thread::disable_interruption di;
+        std::atomic<int> nNext(0);
+        boost::thread_group workers;
+        for (int i = 0; i < nThreads; i++)
+            workers.create_thread(boost::bind(&ThreadVerifyBlocks, &vCheck, &mapBlockPos, nCheckLevel, &vBad, &vUnread, &nNext));
+        workers.join_all();
+    }
+    boost::this_thread::interruption_point();
+    if (ShutdownRequested())
+        return true;
+
+    // The lowest bad block decides where the best chain moves back to
+    CBlockIndex* pindexFork = NULL;
+    for (unsigned int i = 0; i < vCheck.size(); i++)
+    {
+        if (vUnread[i])
+        {
+            if (!fBackground)
+                return error("VerifyBestChain() : block.ReadFromDisk failed at %d", vCheck[i]->nHeight);
+            LogPrintf("VerifyBestChain() : cannot read block at %d\n", vCheck[i]->nHeight);
+        }
+        if (vBad[i])
+            pindexFork = vCheck[i]->pprev;
+    }
+    LogPrintf("VerifyBestChain() : verified %u blocks in %dms\n", vCheck.size(), GetTimeMillis() - nStart);
+    if (!pindexFork)
+        return true;
+
+    LOCK(cs_main);
+    if (fBackground)
+    {
+        // The best chain may have moved since the blocks were read
+        pindexFork = NULL;
+        CTxDB txdb("r");
+        for (int i = vCheck.size() - 1; i >= 0 && !pindexFork; i--)
+        {
+            CBlock block;
+            if (vBad[i] && vCheck[i]->IsInMainChain() && block.ReadFromDisk(vCheck[i]) &&
+                !CheckBestChainBlock(txdb, block, vCheck[i], nCheckLevel, mapBlockPos))
+                pindexFork = vCheck[i]->pprev;
+        }
+        if (!pindexFork)
+            return true;
+    }
+
+    // Reorg back to the fork
+    LogPrintf("VerifyBestChain() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
+    CBlock block;
+    if (!block.ReadFromDisk(pindexFork))
+        return error("VerifyBestChain() : block.ReadFromDisk failed");
+    CTxDB txdb;
+    block.SetBestChain(txdb, pindexFork);
     return true;
 }
+
+void ThreadVerifyBestChain(int nCheckLevel, int nCheckDepth)
+{
+    RenameThread("SocietyG-verify");
+    VerifyBestChain(nCheckLevel, nCheckDepth, true);
+}
@@ -15,6 +15,33 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+/** Hit/miss counters of the shared tx index and previous-transaction caches */
+struct CTxDBCacheStats
+{
+    uint64_t nTxIndexHits;
+    uint64_t nTxIndexMisses;
+    uint64_t nTxIndexEntries;
+    uint64_t nTxHits;
+    uint64_t nTxMisses;
+    uint64_t nTxEntries;
+    uint64_t nTxnFlushes;
+    uint64_t nTxnFlushedEntries;
+
+    CTxDBCacheStats() : nTxIndexHits(0), nTxIndexMisses(0), nTxIndexEntries(0),
+                        nTxHits(0), nTxMisses(0), nTxEntries(0),
+                        nTxnFlushes(0), nTxnFlushedEntries(0) {}
+};
+
+/** Default number of CTxIndex records kept in memory (-txindexcache) */
+static const unsigned int DEFAULT_TXINDEX_CACHE = 100000;
+/** Default number of previously read transactions kept in memory (-txcache) */
+static const unsigned int DEFAULT_TX_CACHE = 20000;
+
+void GetTxDBCacheStats(CTxDBCacheStats& stats);
+
+/** Whether the batch of a connected block is fsynced before TxnCommit returns (-dbsync) */
+extern bool fTxDBSync;
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -46,6 +73,14 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+    // Tx index records written since TxnBegin. They are served from here
+    // instead of scanning activeBatch, and reach the shared cache only once
+    // TxnCommit succeeded. A null CTxIndex marks an erased record.
+    std::map<uint256, CTxIndex> mapTxnTxIndex;
+    // Every key written or erased since TxnBegin, so reads inside a
+    // transaction do not have to replay activeBatch. An erase is stored as
+    // (true, "").
+    std::map<std::string, std::pair<bool, std::string> > mapTxnWrites;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -112,6 +147,7 @@ protected:
 
         if (activeBatch) {
             activeBatch->Put(ssKey.str(), ssValue.str());
+            mapTxnWrites[ssKey.str()] = std::make_pair(false, ssValue.str());
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -135,6 +171,7 @@ protected:
         ssKey << key;
         if (activeBatch) {
             activeBatch->Delete(ssKey.str());
+            mapTxnWrites[ssKey.str()] = std::make_pair(true, std::string());
             return true;
         }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
@@ -164,11 +201,13 @@ protected:
 
 public:
     bool TxnBegin();
-    bool TxnCommit();
+    bool TxnCommit(bool fSync = false);
     bool TxnAbort()
     {
         delete activeBatch;
         activeBatch = NULL;
+        mapTxnTxIndex.clear();
+        mapTxnWrites.clear();
         return true;
     }
 
@@ -183,8 +222,27 @@ public:
         return Write(std::string("version"), nVersion);
     }
 
-    bool ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes);
-    bool WriteAddrIndex(uint160 addrHash, uint256 txHash);
+    // Read up to nCount entries of addrHash, starting at keyStart and ending
+    // with height nHeightEnd. A negative nSkip counts back from the end of
+    // that range. fMore tells whether entries follow the ones returned.
+    bool ReadAddrIndex(const CAddrIndexKey& keyStart, unsigned int nHeightEnd, int nSkip, unsigned int nCount,
+                       std::vector<CAddrIndexEntry>& vEntries, bool& fMore);
+    bool WriteAddrIndex(const CAddrIndexEntry& entry);
+    bool EraseAddrIndex(const CAddrIndexKey& key);
+    // Write entries in sorted key order through large write batches outside
+    // any transaction. Used by the -reindexaddr loader.
+    bool WriteAddrIndexBatch(std::vector<CAddrIndexEntry>& vEntries);
+    // Drop the whole address index, old format included
+    bool EraseAddrIndex();
+    bool ReadAddrIndexVersion(int& nVersion)
+    {
+        nVersion = 0;
+        return Read(std::string("addrindexversion"), nVersion);
+    }
+    bool WriteAddrIndexVersion(int nVersion)
+    {
+        return Write(std::string("addrindexversion"), nVersion);
+    }
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -204,5 +262,18 @@ private:
     bool LoadBlockIndexGuts();
 };
 
+/** Verify the last nCheckDepth blocks of the best chain at nCheckLevel on
+ *  the script check threads, and move the best chain back before the lowest
+ *  bad block. With fBackground the node is already running, so a bad block
+ *  only counts if it is still in the best chain and fails again under
+ *  cs_main. The caller must not hold cs_main, CheckBlock takes it on the
+ *  worker threads. */
+bool VerifyBestChain(int nCheckLevel, int nCheckDepth, bool fBackground);
+/** Run VerifyBestChain in the background, for -checkblocksbackground */
+void ThreadVerifyBestChain(int nCheckLevel, int nCheckDepth);
+/** Save the block index to blkindex.snap in the data directory, for the
+ *  next CTxDB::LoadBlockIndex to read instead of scanning the database */
+bool WriteBlockIndexSnapshot();
+
 
 #endif // BITCOIN_DB_H
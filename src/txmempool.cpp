@@ -9,7 +9,72 @@
 
 using namespace std;
 
-CTxMemPool::CTxMemPool()
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nTimeIn, double dPriorityIn,
+                                 unsigned int nHeightIn, int64_t nInChainValueIn, unsigned int nSigOpsIn) :
+    tx(txIn), nFee(nFeeIn), nTime(nTimeIn), dPriority(dPriorityIn), nHeight(nHeightIn),
+    nInChainValue(nInChainValueIn), nSigOps(nSigOpsIn), nSequence(0)
+{
+    hash = tx.GetHash();
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    nUsageSize = tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsageSize += txin.scriptSig.capacity();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsageSize += txout.scriptPubKey.capacity();
+
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nFeesWithAncestors = nFee;
+    nSigOpsWithAncestors = nSigOps;
+}
+
+double CTxMemPoolEntry::GetPriority(unsigned int nCurrentHeight) const
+{
+    // Every block since entry adds one confirmation to each input in the chain
+    if (nCurrentHeight <= nHeight)
+        return dPriority;
+    return dPriority + ((double)(nCurrentHeight - nHeight) * nInChainValue) / nTxSize;
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nModifySize, int64_t nModifyFee, int64_t nModifyCount, int nModifySigOps)
+{
+    nSizeWithAncestors += nModifySize;
+    nFeesWithAncestors += nModifyFee;
+    nCountWithAncestors += nModifyCount;
+    nSigOpsWithAncestors += nModifySigOps;
+}
+
+// Functor for indexed_transaction_set::modify(), which keeps the indexes in order
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t nModifySizeIn, int64_t nModifyFeeIn, int64_t nModifyCountIn, int nModifySigOpsIn) :
+        nModifySize(nModifySizeIn), nModifyFee(nModifyFeeIn), nModifyCount(nModifyCountIn), nModifySigOps(nModifySigOpsIn)
+    {}
+
+    void operator()(CTxMemPoolEntry& e)
+    {
+        e.UpdateAncestorState(nModifySize, nModifyFee, nModifyCount, nModifySigOps);
+    }
+
+private:
+    int64_t nModifySize;
+    int64_t nModifyFee;
+    int64_t nModifyCount;
+    int nModifySigOps;
+};
+
+struct set_entry_sequence
+{
+    set_entry_sequence(uint64_t nSequenceIn) : nSequence(nSequenceIn) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.SetSequence(nSequence); }
+
+private:
+    uint64_t nSequence;
+};
+
+CTxMemPool::CTxMemPool() : nTransactionsUpdated(0), nLastSequence(0), nTransactionsRemoved(0), nTotalTxSize(0), cachedInnerUsage(0)
 {
 }
 
@@ -25,40 +90,133 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+unsigned int CTxMemPool::GetTransactionsRemoved() const
+{
+    LOCK(cs);
+    return nTransactionsRemoved;
+}
+
+uint64_t CTxMemPool::GetLastSequence() const
+{
+    LOCK(cs);
+    return nLastSequence;
+}
+
+void CTxMemPool::CalculateAncestors(const CTransaction& tx, setEntries& setAncestors) const
+{
+    vector<const CTransaction*> vStack(1, &tx);
+    while (!vStack.empty())
+    {
+        const CTransaction* ptx = vStack.back();
+        vStack.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, ptx->vin)
+        {
+            txiter it = mapTx.find(txin.prevout.hash);
+            if (it != mapTx.end() && setAncestors.insert(it).second)
+                vStack.push_back(&it->GetTx());
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter itEntry, setEntries& setDescendants) const
+{
+    vector<txiter> vStack(1, itEntry);
+    while (!vStack.empty())
+    {
+        txiter it = vStack.back();
+        vStack.pop_back();
+        if (!setDescendants.insert(it).second)
+            continue;
+
+        // mapNextTx is ordered by outpoint, so the spends of one transaction are adjacent
+        const uint256& hash = it->GetHash();
+        map<COutPoint, CInPoint>::const_iterator itNext = mapNextTx.lower_bound(COutPoint(hash, 0));
+        for (; itNext != mapNextTx.end() && itNext->first.hash == hash; ++itNext)
+        {
+            txiter itChild = mapTx.find(itNext->second.ptx->GetHash());
+            if (itChild != mapTx.end())
+                vStack.push_back(itChild);
+        }
+    }
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = tx;
+        setEntries setAncestors;
+        CalculateAncestors(entry.GetTx(), setAncestors);
+
+        txiter it = mapTx.insert(entry).first;
+        const CTransaction& tx = it->GetTx();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+
+        int64_t nSize = 0, nFees = 0;
+        int nSigOps = 0;
+        BOOST_FOREACH(txiter itAncestor, setAncestors)
+        {
+            nSize += itAncestor->GetTxSize();
+            nFees += itAncestor->GetFee();
+            nSigOps += itAncestor->GetSigOps();
+        }
+        mapTx.modify(it, update_ancestor_state(nSize, nFees, setAncestors.size(), nSigOps));
+        mapTx.modify(it, set_entry_sequence(++nLastSequence));
+
+        nTotalTxSize += it->GetTxSize();
+        cachedInnerUsage += it->GetUsageSize();
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::removeUnchecked(txiter it)
+{
+    BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
+        mapNextTx.erase(txin.prevout);
+
+    nTotalTxSize -= it->GetTxSize();
+    cachedInnerUsage -= it->GetUsageSize();
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+    nTransactionsRemoved++;
+}
+
+void CTxMemPool::RemoveStaged(const setEntries& stage)
+{
+    // Whatever stays behind no longer has the staged entries as ancestors
+    BOOST_FOREACH(txiter it, stage)
+    {
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        BOOST_FOREACH(txiter itDescendant, setDescendants)
+        {
+            if (stage.count(itDescendant))
+                continue;
+            mapTx.modify(itDescendant, update_ancestor_state(-(int64_t)it->GetTxSize(), -it->GetFee(), -1, -(int)it->GetSigOps()));
+        }
+    }
+    BOOST_FOREACH(txiter it, stage)
+        removeUnchecked(it);
+}
+
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        txiter it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
         {
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
-                }
-            }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            setEntries stage;
+            if (fRecursive)
+                CalculateDescendants(it, stage);
+            else
+                stage.insert(it);
+            RemoveStaged(stage);
         }
     }
     return true;
@@ -84,7 +242,10 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    nTotalTxSize = 0;
+    cachedInnerUsage = 0;
     ++nTransactionsUpdated;
+    ++nTransactionsRemoved;
 }
 
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
@@ -93,15 +254,75 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (txiter mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    txiter i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second;
+    result = i->GetTx();
     return true;
 }
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Tree nodes cost about three pointers per index on top of the element
+    return cachedInnerUsage +
+           mapTx.size() * (sizeof(CTxMemPoolEntry) + 4 * 3 * sizeof(void*)) +
+           mapNextTx.size() * (sizeof(std::pair<const COutPoint, CInPoint>) + 3 * sizeof(void*));
+}
+
+bool CTxMemPool::HasRoomFor(const CTxMemPoolEntry& entry, size_t nSizeLimit) const
+{
+    LOCK(cs);
+    size_t nEntryUsage = entry.GetUsageSize() + sizeof(CTxMemPoolEntry) + 4 * 3 * sizeof(void*);
+    if (mapTx.empty() || DynamicMemoryUsage() + nEntryUsage <= nSizeLimit)
+        return true;
+
+    // It would only be evicted again straight away
+    return CompareTxMemPoolEntryByFeeRate()(*mapTx.get<mempool_feerate>().begin(), entry);
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+
+    unsigned int nRemoved = 0;
+    double dFeePerKbRemoved = 0;
+    while (!mapTx.empty() && DynamicMemoryUsage() > nSizeLimit)
+    {
+        indexed_transaction_set::index<mempool_feerate>::type::iterator it = mapTx.get<mempool_feerate>().begin();
+        dFeePerKbRemoved = it->GetFeePerKb();
+
+        setEntries stage;
+        CalculateDescendants(mapTx.project<0>(it), stage);
+        nRemoved += stage.size();
+        RemoveStaged(stage);
+    }
+
+    if (nRemoved > 0)
+        LogPrint("mempool", "Removed %u txn to stay under the size limit, last at %.1f satoshis per kB\n", nRemoved, dFeePerKbRemoved);
+}
+
+int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+
+    indexed_transaction_set::index<mempool_entry_time>::type::iterator it = mapTx.get<mempool_entry_time>().begin();
+    setEntries toremove;
+    while (it != mapTx.get<mempool_entry_time>().end() && it->GetTime() < nTime)
+    {
+        toremove.insert(mapTx.project<0>(it));
+        it++;
+    }
+
+    setEntries stage;
+    BOOST_FOREACH(txiter removeit, toremove)
+        CalculateDescendants(removeit, stage);
+    RemoveStaged(stage);
+    return stage.size();
+}
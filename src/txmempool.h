@@ -6,6 +6,110 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include "core.h"
+#include "main.h" // for CTransaction
+
+#include <set>
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/mem_fun.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
+/** A transaction in the memory pool, with the values the miner and the
+ * size limit need cached at the time it was accepted.
+ *
+ * The ancestor totals cover this transaction and every in-pool
+ * transaction it spends from, directly or not, so its package can be
+ * sized up without walking the pool.
+ */
+class CTxMemPoolEntry
+{
+private:
+    CTransaction tx;
+    uint256 hash;
+    int64_t nFee;           // Cached to avoid fetching the inputs again
+    unsigned int nTxSize;   // Serialized size
+    size_t nUsageSize;      // Heap memory held by tx
+    int64_t nTime;          // Local time when entering the pool
+    double dPriority;       // Priority when entering the pool
+    unsigned int nHeight;   // Best chain height when entering the pool
+    int64_t nInChainValue;  // Sum of the inputs already in the chain
+    unsigned int nSigOps;   // Legacy and P2SH sigops
+    uint64_t nSequence;     // Order of arrival, set by the pool
+
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    unsigned int nSigOpsWithAncestors;
+
+public:
+    CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nTimeIn, double dPriorityIn,
+                    unsigned int nHeightIn, int64_t nInChainValueIn, unsigned int nSigOpsIn);
+
+    const CTransaction& GetTx() const { return tx; }
+    const uint256& GetHash() const { return hash; }
+    int64_t GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    size_t GetUsageSize() const { return nUsageSize; }
+    int64_t GetTime() const { return nTime; }
+    unsigned int GetHeight() const { return nHeight; }
+    unsigned int GetSigOps() const { return nSigOps; }
+    uint64_t GetSequence() const { return nSequence; }
+    void SetSequence(uint64_t nSequenceIn) { nSequence = nSequenceIn; }
+
+    /** Coin age priority at a later best chain height */
+    double GetPriority(unsigned int nCurrentHeight) const;
+
+    /** Fee in satoshis per 1000 bytes */
+    double GetFeePerKb() const { return (double)nFee * 1000 / nTxSize; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    unsigned int GetSigOpsWithAncestors() const { return nSigOpsWithAncestors; }
+
+    void UpdateAncestorState(int64_t nModifySize, int64_t nModifyFee, int64_t nModifyCount, int nModifySigOps);
+};
+
+/** Orders entries by fee per byte, the cheapest and then the newest first */
+class CompareTxMemPoolEntryByFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        // a.nFee / a.nTxSize < b.nFee / b.nTxSize without the division
+        double f1 = (double)a.GetFee() * b.GetTxSize();
+        double f2 = (double)b.GetFee() * a.GetTxSize();
+        if (f1 == f2)
+            return a.GetTime() > b.GetTime();
+        return f1 < f2;
+    }
+};
+
+// Index tags for CTxMemPool::mapTx
+struct mempool_feerate {};
+struct mempool_entry_time {};
+
+typedef boost::multi_index_container<
+    CTxMemPoolEntry,
+    boost::multi_index::indexed_by<
+        // by txid
+        boost::multi_index::ordered_unique<
+            boost::multi_index::const_mem_fun<CTxMemPoolEntry, const uint256&, &CTxMemPoolEntry::GetHash>
+        >,
+        // by fee rate, for eviction
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<mempool_feerate>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByFeeRate
+        >,
+        // by entry time, for expiry
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<mempool_entry_time>,
+            boost::multi_index::const_mem_fun<CTxMemPoolEntry, int64_t, &CTxMemPoolEntry::GetTime>
+        >
+    >
+> indexed_transaction_set;
 
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
@@ -16,20 +120,43 @@
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * The pool is kept under -maxmempool by evicting the transactions
+ * paying the lowest fee per byte, together with anything spending them.
  */
 class CTxMemPool
 {
+public:
+    typedef indexed_transaction_set::nth_index<0>::type::const_iterator txiter;
+
+    struct CompareIteratorByHash {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            return a->GetHash() < b->GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
 private:
     unsigned int nTransactionsUpdated;
+    uint64_t nLastSequence;    // Sequence of the newest entry
+    unsigned int nTransactionsRemoved;
+    uint64_t nTotalTxSize;     // Sum of the serialized sizes
+    size_t cachedInnerUsage;   // Sum of the entries' heap usage
+
+    void CalculateAncestors(const CTransaction& tx, setEntries& setAncestors) const;
+    void CalculateDescendants(txiter it, setEntries& setDescendants) const;
+    void RemoveStaged(const setEntries& stage);
+    void removeUnchecked(txiter it);
 
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
@@ -37,12 +164,37 @@ public:
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    /** Number of transactions removed so far, for callers caching a view of the pool */
+    unsigned int GetTransactionsRemoved() const;
+
+    /** Sequence number of the newest entry */
+    uint64_t GetLastSequence() const;
+
+    /** Whether entry could be added without pushing the pool over
+     *  nSizeLimit bytes, or pays enough to evict what it would displace */
+    bool HasRoomFor(const CTxMemPoolEntry& entry, size_t nSizeLimit) const;
+
+    /** Evict the lowest fee rate transactions until the pool fits in nSizeLimit bytes */
+    void TrimToSize(size_t nSizeLimit);
+
+    /** Remove transactions that entered the pool before nTime, returns how many */
+    int Expire(int64_t nTime);
+
+    /** Approximate heap memory used by the pool */
+    size_t DynamicMemoryUsage() const;
+
     unsigned long size() const
     {
         LOCK(cs);
         return mapTx.size();
     }
 
+    uint64_t GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
     bool exists(uint256 hash) const
     {
         LOCK(cs);
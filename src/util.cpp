@@ -18,6 +18,7 @@
 //#include "random.h"
 
 #include <algorithm>
+#include <atomic>
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 
@@ -297,6 +298,198 @@ bool LogAcceptCategory(const char* category)
     return true;
 }
 
+// Append str to strOut, stamped if it starts a new line. Needs mutexDebugLog.
+static void AppendDebugLog(std::string& strOut, int64_t nTime, const std::string& str)
+{
+    static bool fStartedNewLine = true;
+
+    // Debug print useful for profiling
+    if (fLogTimestamps && fStartedNewLine)
+        strOut += DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nTime) + " ";
+    fStartedNewLine = !str.empty() && str[str.size()-1] == '\n';
+    strOut += str;
+}
+
+// Reopen the log file, if requested. Needs mutexDebugLog.
+static void ReopenDebugLogIfRequested()
+{
+    if (fReopenDebugLog) {
+        fReopenDebugLog = false;
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
+            setbuf(fileout, NULL); // unbuffered
+    }
+}
+
+/** Bounded queue of log lines from any number of threads to the writer,
+ * after Dmitry Vyukov's. A producer claims a slot with a compare-and-swap
+ * on the write position and publishes it by bumping the slot's sequence
+ * number, so queueing a line never takes a lock. Only the writer pops.
+ */
+class CLogRing
+{
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> nSequence;
+        int64_t nTime;
+        std::string str;
+    };
+
+    Slot* pSlots;
+    const uint64_t nMask;
+    std::atomic<uint64_t> nWritePos;
+    uint64_t nReadPos;
+
+public:
+    // nSize must be a power of two
+    CLogRing(uint64_t nSize) : pSlots(new Slot[nSize]), nMask(nSize - 1), nWritePos(0), nReadPos(0)
+    {
+        for (uint64_t i = 0; i < nSize; i++)
+            pSlots[i].nSequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Returns false if the ring is full
+    bool Push(int64_t nTime, const std::string& str)
+    {
+        uint64_t nPos = nWritePos.load(std::memory_order_relaxed);
+        Slot* pSlot;
+        while (true)
+        {
+            pSlot = &pSlots[nPos & nMask];
+            int64_t nDiff = (int64_t)(pSlot->nSequence.load(std::memory_order_acquire) - nPos);
+            if (nDiff == 0)
+            {
+                if (nWritePos.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (nDiff < 0)
+                return false;
+            else
+                nPos = nWritePos.load(std::memory_order_relaxed);
+        }
+        pSlot->nTime = nTime;
+        pSlot->str = str;
+        pSlot->nSequence.store(nPos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the ring is empty
+    bool Pop(int64_t& nTime, std::string& str)
+    {
+        Slot* pSlot = &pSlots[nReadPos & nMask];
+        if (pSlot->nSequence.load(std::memory_order_acquire) != nReadPos + 1)
+            return false;
+        nTime = pSlot->nTime;
+        str.swap(pSlot->str);
+        pSlot->str.clear();
+        pSlot->nSequence.store(nReadPos + nMask + 1, std::memory_order_release);
+        nReadPos++;
+        return true;
+    }
+};
+
+// The writer's state is never freed, like mutexDebugLog, as global
+// destructors may still log once it has stopped
+static const uint64_t LOG_RING_SIZE = 8192;
+static const size_t LOG_BATCH_SIZE = 65536;
+static CLogRing* logRing = NULL;
+static boost::thread* threadLogWriter = NULL;
+static boost::mutex* mutexLogWriter = NULL;
+static boost::condition_variable* condLogWriter = NULL;
+static std::atomic<bool> fLogAsync(false);
+static std::atomic<bool> fLogWriterIdle(false);
+static std::atomic<bool> fLogWriterStop(false);
+static std::atomic<int> nLogProducers(0);
+
+static void WakeLogWriter()
+{
+    if (fLogWriterIdle.exchange(false))
+    {
+        boost::mutex::scoped_lock lock(*mutexLogWriter);
+        condLogWriter->notify_one();
+    }
+}
+
+// Write out the queued lines, a batch at a time. Returns false if there were none.
+static bool DrainLogRing()
+{
+    boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+    ReopenDebugLogIfRequested();
+
+    bool fAny = false;
+    int64_t nTime;
+    std::string str, strBatch;
+    strBatch.reserve(LOG_BATCH_SIZE);
+    while (logRing->Pop(nTime, str))
+    {
+        fAny = true;
+        AppendDebugLog(strBatch, nTime, str);
+        if (strBatch.size() >= LOG_BATCH_SIZE)
+        {
+            fwrite(strBatch.data(), 1, strBatch.size(), fileout);
+            strBatch.clear();
+        }
+    }
+    if (!strBatch.empty())
+        fwrite(strBatch.data(), 1, strBatch.size(), fileout);
+    return fAny;
+}
+
+static void ThreadLogWriter()
+{
+    RenameThread("SocietyG-log");
+
+    while (!fLogWriterStop)
+    {
+        if (DrainLogRing())
+            continue;
+
+        // Producers wake us when they find us idle, the timeout covers a
+        // line queued between the drain and setting the flag
+        boost::mutex::scoped_lock lock(*mutexLogWriter);
+        fLogWriterIdle = true;
+        if (!fLogWriterStop)
+            condLogWriter->timed_wait(lock, boost::posix_time::milliseconds(100));
+        fLogWriterIdle = false;
+    }
+}
+
+void StartLogWriter()
+{
+    if (fPrintToConsole || !fPrintToDebugLog || threadLogWriter != NULL)
+        return;
+
+    boost::call_once(&DebugPrintInit, debugPrintInitFlag);
+    if (fileout == NULL)
+        return;
+
+    logRing = new CLogRing(LOG_RING_SIZE);
+    mutexLogWriter = new boost::mutex();
+    condLogWriter = new boost::condition_variable();
+    threadLogWriter = new boost::thread(&ThreadLogWriter);
+    fLogAsync = true;
+}
+
+void StopLogWriter()
+{
+    if (threadLogWriter == NULL || !fLogAsync)
+        return;
+
+    // Let the lines already on their way in land before the last drain
+    fLogAsync = false;
+    while (nLogProducers > 0)
+        boost::this_thread::yield();
+
+    fLogWriterStop = true;
+    {
+        boost::mutex::scoped_lock lock(*mutexLogWriter);
+        condLogWriter->notify_one();
+    }
+    threadLogWriter->join();
+    DrainLogRing();
+}
+
 int LogPrintStr(const std::string &str)
 {
     int ret = 0; // Returns total number of characters written
@@ -307,31 +500,34 @@ int LogPrintStr(const std::string &str)
     }
     else if (fPrintToDebugLog)
     {
-        static bool fStartedNewLine = true;
+        // With the writer running the line only has to be queued
+        nLogProducers++;
+        if (fLogAsync)
+        {
+            int64_t nTime = GetTime();
+            while (!logRing->Push(nTime, str))
+            {
+                // Full, wait for the writer to catch up rather than lose lines
+                WakeLogWriter();
+                boost::this_thread::yield();
+            }
+            nLogProducers--;
+            WakeLogWriter();
+            return str.size();
+        }
+        nLogProducers--;
+
         boost::call_once(&DebugPrintInit, debugPrintInitFlag);
 
         if (fileout == NULL)
             return ret;
 
         boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+        ReopenDebugLogIfRequested();
 
-        // reopen the log file, if requested
-        if (fReopenDebugLog) {
-            fReopenDebugLog = false;
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
-                setbuf(fileout, NULL); // unbuffered
-        }
-
-        // Debug print useful for profiling
-        if (fLogTimestamps && fStartedNewLine)
-            ret += fprintf(fileout, "%s ", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
-        if (!str.empty() && str[str.size()-1] == '\n')
-            fStartedNewLine = true;
-        else
-            fStartedNewLine = false;
-
-        ret = fwrite(str.data(), 1, str.size(), fileout);
+        std::string strOut;
+        AppendDebugLog(strOut, GetTime(), str);
+        ret = fwrite(strOut.data(), 1, strOut.size(), fileout);
     }
 
     return ret;
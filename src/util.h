@@ -160,19 +160,32 @@ void RandAddSeedPerfmon();
 bool LogAcceptCategory(const char* category);
 /* Send a string to the log output */
 int LogPrintStr(const std::string &str);
+/* Hand debug.log writes to a background thread from now on */
+void StartLogWriter();
+/* Write out whatever is queued and go back to writing synchronously */
+void StopLogWriter();
+
+/* LogPrint and LogPrintf are macros so the arguments, often ToString()
+ * calls, are only evaluated when the message is going to be logged.
+ * Building with DISABLE_DEBUG_LOG drops every categorized LogPrint.
+ */
+#define LogPrintf(...) do { LogPrintStr(LogFormat(__VA_ARGS__)); } while (0)
 
-#define LogPrintf(...) LogPrint(NULL, __VA_ARGS__)
+#ifdef DISABLE_DEBUG_LOG
+#define LogPrint(category, ...) do { } while (0)
+#else
+#define LogPrint(category, ...) do { if (LogAcceptCategory(category)) LogPrintStr(LogFormat(__VA_ARGS__)); } while (0)
+#endif
 
 /* When we switch to C++11, this can be switched to variadic templates instead
  * of this macro-based construction (see tinyformat.h).
  */
 #define MAKE_ERROR_AND_LOG_FUNC(n)                                        \
-    /*   Print to debug.log if -debug=category switch is given OR category is NULL. */ \
-    template<TINYFORMAT_ARGTYPES(n)>                                          \
-    static inline int LogPrint(const char* category, const char* format, TINYFORMAT_VARARGS(n))  \
+    /*   Format a message for LogPrint and LogPrintf */                              \
+    template<TINYFORMAT_ARGTYPES(n)>                                                 \
+    static inline std::string LogFormat(const char* format, TINYFORMAT_VARARGS(n))   \
     {                                                                                \
-        if(!LogAcceptCategory(category)) return 0;                                   \
-        return LogPrintStr(tfm::format(format, TINYFORMAT_PASSARGS(n)));             \
+        return tfm::format(format, TINYFORMAT_PASSARGS(n));                          \
     }                                                                                \
     /*   Log error and return false */                                               \
     template<TINYFORMAT_ARGTYPES(n)>                                                 \
@@ -195,10 +208,9 @@ TINYFORMAT_FOREACH_ARGNUM(MAKE_ERROR_AND_LOG_FUNC)
 /* Zero-arg versions of logging and error, these are not covered by
  * TINYFORMAT_FOREACH_ARGNUM
  */
-static inline int LogPrint(const char* category, const char* format)
+static inline std::string LogFormat(const char* format)
 {
-    if(!LogAcceptCategory(category)) return 0;
-    return LogPrintStr(format);
+    return format;
 }
 static inline bool error(const char* format)
 {
@@ -33,7 +33,7 @@ static const int DATABASE_VERSION = 70000;
 /* --------------------------------------------------
    -- RGP, JIRA BSG-182 PROTOCOL_VERSION was 10006 --
    -------------------------------------------------- */
-static const int PROTOCOL_VERSION = 10007;
+static const int PROTOCOL_VERSION = 10008;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -77,4 +77,7 @@ static const int BIP0031_VERSION = 60000;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// "cmpctblock", "getblocktxn" and "blocktxn" commands start with this version
+static const int COMPACT_BLOCKS_VERSION = 10008;
+
 #endif
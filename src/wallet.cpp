@@ -23,9 +23,12 @@
 #include "masternode-payments.h"
 #include "chainparams.h"
 #include "smessage.h"
+#include "init.h"
 
 //#include "random.h"
 
+#include <atomic>
+
 #include <boost/algorithm/string/replace.hpp>
 
 using namespace std;
@@ -604,6 +607,8 @@ LogPrintf("RGP MarkDirty start \n");
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fBalancesValid = false;
+        fCoinsValid = false;
     }
 }
 
@@ -618,6 +623,8 @@ LogPrintf("RGP AddToWallet start \n");
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+        fBalancesValid = false;
+        fCoinsValid = false;
     }
     else
     {
@@ -713,6 +720,9 @@ LogPrintf("RGP AddToWallet start \n");
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        MarkTxDirty(hash);
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            MarkTxDirty(txin.prevout.hash);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -775,9 +785,11 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
         if (mapWallet.count(txin.prevout.hash))
+        {
             mapWallet[txin.prevout.hash].MarkDirty();
+            MarkTxDirty(txin.prevout.hash);
+        }
 
-        MilliSleep( 1 ); /* RGP Optimise */
     }
 
     if (!fConnect)
@@ -801,7 +813,10 @@ void CWallet::EraseFromWallet(const uint256 &hash)
     {
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
+        {
+            MarkTxDirty(hash);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -1184,35 +1199,210 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
-// Scan the block chain (starting in pindexStart) for transactions
-// from or to us. If fUpdate is true, found transactions that already
-// exist in the wallet will be updated.
+bool CWalletScanFilter::IsRelevant(const CTransaction& tx) const
+{
+    vector<valtype> vSolutions;
+    txnouttype whichType;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        const CScript& script = txout.scriptPubKey;
+
+        // Stealth payments announce themselves in an OP_RETURN output
+        if (!script.empty() && script[0] == OP_RETURN)
+            return true;
+
+        if (Solver(script, whichType, vSolutions))
+        {
+            switch (whichType)
+            {
+            case TX_PUBKEY:
+                if (setIds.count(CPubKey(vSolutions[0]).GetID()))
+                    return true;
+                break;
+            case TX_PUBKEYHASH:
+            case TX_SCRIPTHASH:
+                if (setIds.count(uint160(vSolutions[0])))
+                    return true;
+                break;
+            case TX_MULTISIG:
+                for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                    if (setIds.count(CPubKey(vSolutions[i]).GetID()))
+                        return true;
+                break;
+            default:
+                break;
+            }
+        }
+        if (!setWatchOnly.empty() && setWatchOnly.count(script))
+            return true;
+    }
+    return false;
+}
+
+unsigned int CWallet::GetKeyStoreSize() const
+{
+    LOCK(cs_KeyStore);
+    return mapKeys.size() + mapCryptedKeys.size() + mapScripts.size() + setWatchOnly.size();
+}
+
+void CWallet::GetScanFilter(CWalletScanFilter& filter) const
+{
+    LOCK(cs_KeyStore);
+    filter.setIds.clear();
+    for (KeyMap::const_iterator it = mapKeys.begin(); it != mapKeys.end(); ++it)
+        filter.setIds.insert((*it).first);
+    for (CryptedKeyMap::const_iterator it = mapCryptedKeys.begin(); it != mapCryptedKeys.end(); ++it)
+        filter.setIds.insert((*it).first);
+    for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+        filter.setIds.insert((*it).first);
+    filter.setWatchOnly = setWatchOnly;
+    filter.nKeyStoreSize = mapKeys.size() + mapCryptedKeys.size() + mapScripts.size() + setWatchOnly.size();
+}
+
+// Blocks read and filtered ahead of the thread adding them to the wallet
+static const int RESCAN_WINDOW = 500;
+
+struct CRescanBlock
+{
+    CBlock block;
+    std::vector<char> vRelevant;
+    bool fOk;
+};
+
+// Reads and filters the blocks of a window, taking the next unclaimed slot
+// until none are left. Every worker writes only the slots it claimed.
+static void ThreadRescanBlocks(const std::vector<CBlockIndex*>* pvWindow, std::vector<CRescanBlock>* pvBlocks,
+                               const CWalletScanFilter* pfilter, std::atomic<int>* pnNext)
+{
+    int i;
+    while ((i = pnNext->fetch_add(1)) < (int)pvWindow->size())
+    {
+        CRescanBlock& rescan = (*pvBlocks)[i];
+        rescan.fOk = rescan.block.ReadFromDisk((*pvWindow)[i], true);
+        rescan.vRelevant.resize(rescan.block.vtx.size());
+        for (unsigned int j = 0; j < rescan.block.vtx.size(); j++)
+            rescan.vRelevant[j] = pfilter->IsRelevant(rescan.block.vtx[j]);
+    }
+}
+
+/** Scan the best chain from pindexStart for wallet transactions.
+ *
+ * Worker threads read a window of blocks ahead and match their outputs
+ * against a snapshot of the wallet's ids, then the transactions that match,
+ * or spend from the wallet, are added in chain order. The locks are only
+ * held while a window is added, and a scan that starts at or below the
+ * wallet's best block moves it along after each window, so a rescan that
+ * is stopped by a shutdown resumes from there on the next start.
+ */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
-LogPrintf("RGP ScanForWalletTransactions start \n");
+    if (pindexStart == NULL)
+        return ret;
+
+    int64_t nStart = GetTimeMillis();
+    bool fCheckpoint = false;
+    int nStartHeight = pindexStart->nHeight;
+    int nEndHeight;
+    {
+        LOCK(cs_main);
+        nEndHeight = std::max(nBestHeight, nStartHeight + 1);
+        CBlockLocator locator;
+        if (fFileBacked && CWalletDB(strWalletFile).ReadBestBlock(locator))
+        {
+            CBlockIndex* pindexWallet = locator.GetBlockIndex();
+            fCheckpoint = pindexWallet && pindexWallet->nHeight >= nStartHeight;
+        }
+        else
+            fCheckpoint = fFileBacked && pindexStart == pindexGenesisBlock;
+    }
+
+    CWalletScanFilter filter;
+    GetScanFilter(filter);
+
+    int nThreads = std::max(nScriptCheckThreads, 1);
+    std::vector<CBlockIndex*> vWindow;
+    vWindow.reserve(RESCAN_WINDOW);
+    std::vector<CRescanBlock> vBlocks(RESCAN_WINDOW);
+
+    ShowProgress(_("Rescanning..."), 0);
     CBlockIndex* pindex = pindexStart;
+    while (pindex && !ShutdownRequested())
     {
-        LOCK2(cs_main, cs_wallet);
-        while (pindex)
         {
+            LOCK(cs_main);
+            // Blocks may have been disconnected since the last window, go on from the fork
+            while (pindex->pprev && !pindex->IsInMainChain())
+                pindex = pindex->pprev;
+
             // no need to read and scan block, if block was created before
             // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
-                continue;
-            }
+            vWindow.clear();
+            for (; pindex && vWindow.size() < (size_t)RESCAN_WINDOW; pindex = pindex->pnext)
+                if (!nTimeFirstKey || pindex->nTime >= nTimeFirstKey - 7200)
+                    vWindow.push_back(pindex);
+        }
+        if (vWindow.empty())
+            continue;
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        std::atomic<int> nNext(0);
+        boost::thread_group workers;
+        for (int i = 0; i < nThreads; i++)
+            workers.create_thread(boost::bind(&ThreadRescanBlocks, &vWindow, &vBlocks, &filter, &nNext));
+        workers.join_all();
+
+        bool fFilterStale = false;
+        CBlockIndex* pindexLast = NULL;
+        {
+            LOCK2(cs_main, cs_wallet);
+            for (unsigned int i = 0; i < vWindow.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                if (!vWindow[i]->IsInMainChain())
+                {
+                    pindex = vWindow[i];
+                    break;
+                }
+                pindexLast = vWindow[i];
+
+                CRescanBlock& rescan = vBlocks[i];
+                if (!rescan.fOk)
+                    LogPrintf("ScanForWalletTransactions() : cannot read block %d\n", vWindow[i]->nHeight);
+                for (unsigned int j = 0; j < rescan.block.vtx.size(); j++)
+                {
+                    const CTransaction& tx = rescan.block.vtx[j];
+                    bool fCheck = fFilterStale || rescan.vRelevant[j] || mapWallet.count(tx.GetHash());
+                    for (unsigned int k = 0; !fCheck && k < tx.vin.size(); k++)
+                        fCheck = mapWallet.count(tx.vin[k].prevout.hash);
+                    if (!fCheck)
+                        continue;
+
+                    if (AddToWalletIfInvolvingMe(tx, &rescan.block, fUpdate))
+                    {
+                        ret++;
+                        // New keys are not in the filter, check everything until it is rebuilt
+                        if (!fFilterStale && GetKeyStoreSize() != filter.nKeyStoreSize)
+                            fFilterStale = true;
+                    }
+                }
+                std::vector<CTransaction>().swap(rescan.block.vtx);
             }
-            pindex = pindex->pnext;
+        }
+
+        if (fFilterStale)
+            GetScanFilter(filter);
+
+        if (pindexLast)
+        {
+            if (fCheckpoint)
+                SetBestChain(CBlockLocator(pindexLast));
+            ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (pindexLast->nHeight - nStartHeight) * 100 / (nEndHeight - nStartHeight))));
+            LogPrint("wallet", "ScanForWalletTransactions() : scanned up to block %d, %d found\n", pindexLast->nHeight, ret);
         }
     }
+    ShowProgress(_("Rescanning..."), 100);
+
+    LogPrintf("ScanForWalletTransactions() : %s, %d transactions found in %dms\n",
+              pindex ? "interrupted" : "done", ret, GetTimeMillis() - nStart);
     return ret;
 }
 
@@ -1271,6 +1461,7 @@ LogPrintf("RGP ReacceptWalletTransactions start \n");
                 {
                     LogPrintf("ReacceptWalletTransactions found spent coin %s SocietyG %s\n", FormatMoney(wtx.GetCredit(ISMINE_ALL)), wtx.GetHash().ToString());
                     wtx.MarkDirty();
+                    MarkTxDirty(wtxid);
                     wtx.WriteToDisk();
                 }
             }
@@ -1320,7 +1511,6 @@ LogPrintf("RGP RelayWalletTransaction debug 001 %d  \n", GetTime() - start_time
 
     }
 
-    MilliSleep( 2 );
 
 }
 
@@ -1417,86 +1607,35 @@ LogPrintf("RGP ResendWalletTransactions debug 002 %d \n", GetTime() - start_time
 
 CAmount CWallet::GetBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return UpdateBalances().nAvailable;
 }
 
 // ppcoin: total coins staked (non-spendable until maturity)
 CAmount CWallet::GetStake() const
 {
-    CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-
-LogPrintf("RGP GetStake start \n");
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, ISMINE_ALL);
-    }
-    return nTotal;
+    return UpdateBalances().nStake;
 }
 
 CAmount CWallet::GetNewMint() const
 {
-LogPrintf("RGP GetNewMint start \n");
-    CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, ISMINE_ALL);
-    }
-    return nTotal;
+    return UpdateBalances().nNewMint;
 }
 
 CAmount CWallet::GetAnonymizableBalance() const
 {
     if(fLiteMode) return 0;
-LogPrintf("RGP GetAnonymizableBalance start \n");
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-               nTotal += pcoin->GetAnonymizableCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return UpdateBalances().nAnonymizable;
 }
 
 CAmount CWallet::GetAnonymizedBalance() const
 {
     if(fLiteMode) return 0;
-LogPrintf("RGP GetAnonymizedBalance start \n");
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizedCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return UpdateBalances().nAnonymized;
 }
 
 // Note: calculated including unconfirmed,
@@ -1569,110 +1708,206 @@ LogPrintf("RGP GetNormalizedAnonymizedBalance start \n");
 CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 {
     if(fLiteMode) return 0;
-LogPrintf("RGP GetDenominatedBalance start \n");
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    const CWalletBalances& total = UpdateBalances();
+    return unconfirmed ? total.nDenominatedUnconf : total.nDenominatedConf;
 }
+
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-LogPrintf("RGP GetUnconfirmedBalance start \n");
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return UpdateBalances().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-LogPrintf("RGP GetImmatureBalance start \n");
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return UpdateBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-LogPrintf("RGP GetWatchOnlyBalance start \n");
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return UpdateBalances().nWatchAvailable;
 }
 
 CAmount CWallet::GetWatchOnlyStake() const
 {
-LogPrintf("RGP GetWatchOnlyStake start \n");
-    CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    return UpdateBalances().nWatchStake;
+}
+
+CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return UpdateBalances().nWatchUnconfirmed;
+}
+
+CAmount CWallet::GetImmatureWatchOnlyBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return UpdateBalances().nWatchImmature;
+}
+
+// What a single transaction adds to each balance, the same tests the
+// balance queries used to apply while walking mapWallet
+void CWallet::GetTxBalances(const CWalletTx& wtx, CWalletBalances& txBalances) const
+{
+    txBalances.SetNull();
+
+    int nDepth = wtx.GetDepthInMainChain();
+    bool fTrusted = wtx.IsTrusted();
+    if (fTrusted)
+    {
+        txBalances.nAvailable = wtx.GetAvailableCredit();
+        txBalances.nWatchAvailable = wtx.GetAvailableWatchOnlyCredit();
+        if (!fLiteMode)
+        {
+            txBalances.nAnonymizable = wtx.GetAnonymizableCredit();
+            txBalances.nAnonymized = wtx.GetAnonymizedCredit();
+        }
+    }
+    if (!IsFinalTx(wtx) || (!fTrusted && nDepth == 0))
     {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, ISMINE_WATCH_ONLY);
+        txBalances.nUnconfirmed = wtx.GetAvailableCredit();
+        txBalances.nWatchUnconfirmed = wtx.GetAvailableWatchOnlyCredit();
+    }
+    txBalances.nImmature = wtx.GetImmatureCredit();
+    txBalances.nWatchImmature = wtx.GetImmatureWatchOnlyCredit();
+    if ((wtx.IsCoinStake() || wtx.IsCoinBase()) && wtx.GetBlocksToMaturity() > 0 && nDepth > 0)
+    {
+        if (wtx.IsCoinStake())
+        {
+            txBalances.nStake = GetCredit(wtx, ISMINE_ALL);
+            txBalances.nWatchStake = GetCredit(wtx, ISMINE_WATCH_ONLY);
+        }
+        else
+            txBalances.nNewMint = GetCredit(wtx, ISMINE_ALL);
+    }
+    if (!fLiteMode)
+    {
+        txBalances.nDenominatedConf = wtx.GetDenominatedCredit(false);
+        txBalances.nDenominatedUnconf = wtx.GetDenominatedCredit(true);
     }
-    return nTotal;
 }
 
-CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
+void CWallet::MarkTxDirty(const uint256& hash) const
 {
-LogPrintf("RGP GetUnconfirmedWatchOnlyBalance start \n");
-    CAmount nTotal = 0;
+    AssertLockHeld(cs_wallet);
+    if (fBalancesValid)
+        setBalancesDirty.insert(hash);
+    if (fCoinsValid)
+        setCoinsDirty.insert(hash);
+}
+
+void CWallet::UpdateCoinIndex() const
+{
+    AssertLockHeld(cs_wallet);
+
+    if (!fCoinsValid)
     {
-        LOCK2(cs_main, cs_wallet);
+        mapWalletCoins.clear();
+        setCoinsDirty.clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setCoinsDirty.insert(it->first);
+        fCoinsValid = true;
+    }
+
+    BOOST_FOREACH(const uint256& hash, setCoinsDirty)
+    {
+        mapWalletCoins.erase(hash);
+
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it == mapWallet.end())
+            continue;
+        const CWalletTx& wtx = it->second;
+
+        vector<pair<unsigned int, isminetype> > vOutputs;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
+            if (wtx.IsSpent(i))
+                continue;
+            isminetype mine = IsMine(wtx.vout[i]);
+            if (mine != ISMINE_NO)
+                vOutputs.push_back(make_pair(i, mine));
         }
+        if (!vOutputs.empty())
+            mapWalletCoins.insert(make_pair(hash, vOutputs));
     }
-    return nTotal;
+    setCoinsDirty.clear();
 }
 
-CAmount CWallet::GetImmatureWatchOnlyBalance() const
+// Bring the balance totals up to date with mapWallet and the best chain
+const CWalletBalances& CWallet::UpdateBalances() const
 {
-    CAmount nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (fBalancesValid && pindexBalances != pindexBest)
     {
-        LOCK2(cs_main, cs_wallet);
+        // Depths only changed for everything if the old tip was left,
+        // otherwise only the transactions whose depth still matters
+        const CBlockIndex* pindex = pindexBest;
+        while (pindex && pindexBalances && pindex->nHeight > pindexBalances->nHeight)
+            pindex = pindex->pprev;
+        if (pindex == NULL || pindex != pindexBalances)
+            fBalancesValid = false;
+        else
+            setBalancesDirty.insert(setBalancesVolatile.begin(), setBalancesVolatile.end());
+    }
+
+    if (!fBalancesValid)
+    {
+        balances.SetNull();
+        mapTxBalances.clear();
+        setBalancesVolatile.clear();
+        setBalancesDirty.clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setBalancesDirty.insert(it->first);
+        fBalancesValid = true;
+    }
+    pindexBalances = pindexBest;
+
+    set<uint256> setDone;
+    while (!setBalancesDirty.empty())
+    {
+        uint256 hash = *setBalancesDirty.begin();
+        setBalancesDirty.erase(setBalancesDirty.begin());
+        setDone.insert(hash);
+
+        map<uint256, CWalletBalances>::iterator mi = mapTxBalances.find(hash);
+        if (mi != mapTxBalances.end())
         {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
+            balances -= mi->second;
+            mapTxBalances.erase(mi);
+        }
+        setBalancesVolatile.erase(hash);
+
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it == mapWallet.end())
+            continue;
+        const CWalletTx& wtx = it->second;
+
+        CWalletBalances txBalances;
+        GetTxBalances(wtx, txBalances);
+        balances += txBalances;
+        mapTxBalances.insert(make_pair(hash, txBalances));
+
+        int nDepth = wtx.GetDepthInMainChain();
+        if (nDepth < 1 || !IsFinalTx(wtx) || ((wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0))
+            setBalancesVolatile.insert(hash);
+
+        // An unconfirmed or conflicted spend decides whether the outputs
+        // it spends count as spent
+        if (nDepth <= 0 && !wtx.IsCoinBase())
+        {
+            BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+                if (!setDone.count(txin.prevout.hash) && mapWallet.count(txin.prevout.hash))
+                    setBalancesDirty.insert(txin.prevout.hash);
         }
     }
-    return nTotal;
+
+    return balances;
 }
 
 // populate vCoins with vector of available COutputs.
@@ -1682,9 +1917,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 LogPrintf("RGP AvailableCoins start \n");
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateCoinIndex();
+        for (map<uint256, vector<pair<unsigned int, isminetype> > >::const_iterator it = mapWalletCoins.begin(); it != mapWalletCoins.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find((*it).first)->second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1706,7 +1942,8 @@ LogPrintf("RGP AvailableCoins start \n");
             if (useIX && nDepth < 100)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+            BOOST_FOREACH(const PAIRTYPE(unsigned int, isminetype)& output, (*it).second) {
+                unsigned int i = output.first;
                 bool found = false;
                 if(coin_type == ONLY_DENOMINATED) {
                     found = IsDenominatedAmount(pcoin->vout[i].nValue);
@@ -1721,9 +1958,8 @@ LogPrintf("RGP AvailableCoins start \n");
                 }
                 if(!found) continue;
 
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(pcoin->IsSpent(i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
+                isminetype mine = output.second;
+                if (!IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
                     (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
                 {
                     vCoins.push_back(COutput(pcoin, i, nDepth, mine & ISMINE_SPENDABLE));
@@ -1746,12 +1982,14 @@ LogPrintf("RGP AvailableCoinsMN start \n");
 
         // RGP is this causing a block?
         //LOCK2(cs_main, cs_wallet);
+        LOCK(cs_wallet);
+        UpdateCoinIndex();
 
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it )
+        for (map<uint256, vector<pair<unsigned int, isminetype> > >::const_iterator it = mapWalletCoins.begin(); it != mapWalletCoins.end(); ++it )
         {
 
 
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find((*it).first)->second;
 
             if (!IsFinalTx(*pcoin))
             {
@@ -1794,8 +2032,9 @@ LogPrintf("RGP AvailableCoinsMN less than 10 confirms \n");
                 continue;
             }            
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+            BOOST_FOREACH(const PAIRTYPE(unsigned int, isminetype)& output, (*it).second)
             {
+                unsigned int i = output.first;
                 bool found = false;
                 if(coin_type == ONLY_DENOMINATED)
                 {
@@ -1834,10 +2073,9 @@ LogPrintf("RGP AvailableCoinsMN found, HotMN Funds %d \n", pcoin->vout[i].nValue
 
                 if(!found) continue;
 
-                isminetype mine = IsMine(pcoin->vout[i]);
+                isminetype mine = output.second;
 
-                if (!(pcoin->IsSpent(i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
+                if (!IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
                     (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
                 {
                     /* RGP, We found a masternode collatoral entry, push back to vCoins */
@@ -1864,9 +2102,10 @@ LogPrintf("RGP AvailableCoinsForStaking start \n");
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateCoinIndex();
+        for (map<uint256, vector<pair<unsigned int, isminetype> > >::const_iterator it = mapWalletCoins.begin(); it != mapWalletCoins.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find((*it).first)->second;
 
             int nDepth = pcoin->GetDepthInMainChain();
             if (nDepth < 1)
@@ -1903,10 +2142,9 @@ LogPrintf("RGP AvailableCoinsForStaking start \n");
 
             if(found) continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(pcoin->IsSpent(i)) && mine != ISMINE_NO && pcoin->vout[i].nValue >= nMinimumInputValue)
-                    vCoins.push_back(COutput(pcoin, i, nDepth, mine & ISMINE_SPENDABLE));
+            BOOST_FOREACH(const PAIRTYPE(unsigned int, isminetype)& output, (*it).second) {
+                if (pcoin->vout[output.first].nValue >= nMinimumInputValue)
+                    vCoins.push_back(COutput(pcoin, output.first, nDepth, output.second & ISMINE_SPENDABLE));
             }
         }
     }
@@ -3246,7 +3484,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
         if (!txout.scriptPubKey.GetOp(itTxA, opCode, vchEphemPK)
             || opCode != OP_RETURN)
         {
-            MilliSleep( 2 );
             continue;
         }
         else
@@ -3272,7 +3509,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
                     printf("Warning: FindStealthTransactions() tx: %s, Could not extract plaintext narration.\n", tx.GetHash().GetHex().c_str());
                 };
             }
-            MilliSleep( 2 );
             continue;
         }
 
@@ -3284,7 +3520,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
 
             if (&txoutB == &txout)
             {
-                MilliSleep( 1 );
                 continue;
             }
 
@@ -3297,7 +3532,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
 
             if (address.type() != typeid(CKeyID))
             {
-                MilliSleep( 1 );
                 continue;
             }
 
@@ -3309,10 +3543,8 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
             std::set<CStealthAddress>::iterator it;
             for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
             {
-                MilliSleep( 2 );
                 if (it->scan_secret.size() != ec_secret_size)
                 {
-                    MilliSleep( 1 );
                     continue; // stealth address is not owned
                 }
 
@@ -3322,7 +3554,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
                 if (StealthSecret(sScan, vchEphemPK, it->spend_pubkey, sShared, pkExtracted) != 0)
                 {
                     printf("StealthSecret failed.\n");                
-                    MilliSleep( 1 );
                     continue;
                 };
                 //printf("pkExtracted %"PRIszu": %s\n", pkExtracted.size(), HexStr(pkExtracted).c_str());
@@ -3331,14 +3562,12 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
 
                 if (!cpkE.IsValid())
                 {
-                    MilliSleep( 1 );
                     continue;
                 }
                 CKeyID ckidE = cpkE.GetID();
 
                 if (ckidMatch != ckidE)
                 {
-                    MilliSleep( 1 );
                     continue;
                 }
 
@@ -3371,7 +3600,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
                 {
                     if (it->spend_secret.size() != ec_secret_size)
                     {
-                        MilliSleep( 1 );
                         continue;
                     }
                     memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
@@ -3381,7 +3609,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
                     {
                         printf("StealthSharedToSecretSpend() failed.\n");
 
-                        MilliSleep( 1 );
                         continue;
                     };
 
@@ -3389,7 +3616,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
                     if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
                     {
                         printf("SecretToPublicKey() failed.\n");
-                        MilliSleep( 1 );
                         continue;
                     };
 
@@ -3405,7 +3631,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
                     } catch (std::exception& e) {
                         printf("ckey.SetSecret() threw: %s.\n", e.what());
                         
-                        MilliSleep( 1 );
                         continue;
                     };
 
@@ -3414,14 +3639,12 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
                     {
                         printf("cpkT is invalid.\n");
                     
-                        MilliSleep( 1 );
                         continue;
                     };
 
                     if (!ckey.IsValid())
                     {
                         printf("Reconstructed key is invalid.\n");
-                        MilliSleep( 1 );
                         continue;
                     };
 
@@ -3435,7 +3658,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
                     if (!AddKey(ckey))
                     {
                         printf("AddKey failed.\n");
-                        MilliSleep( 1 );
                         continue;
                     };
 
@@ -3455,7 +3677,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
                     if (!crypter.Decrypt(&vchENarr[0], vchENarr.size(), vchNarr))
                     {
                         printf("Decrypt narration failed.\n");
-                        MilliSleep( 1 );
                         continue;
                     };
                     std::string sNarr = std::string(vchNarr.begin(), vchNarr.end());
@@ -3472,9 +3693,7 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
             if (txnMatch)
                 break;
 
-            MilliSleep( 2 );
         }
-        MilliSleep( 2 );
     }
 
     return true;
@@ -3561,102 +3780,101 @@ LogPrintf("RGP CreateCoinStake start \n");
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
     CTxDB txdb("r");
+    // Prepare the kernel of every output that can stake a block, then
+    // search their timestamps on -stakethreads threads
+    static int nMaxStakeSearchInterval = 60;
+    vector<PAIRTYPE(const CWalletTx*, unsigned int)> vKernelCoins;
+    vector<CStakeKernel> vKernels;
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+        // Only pay to public key and pay to address kernels we hold the key for
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        if (!Solver(pcoin.first->vout[pcoin.second].scriptPubKey, whichType, vSolutions))
+            continue;
+        if (whichType == TX_PUBKEYHASH)
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
-            {
-                // Found a kernel                
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    //LogPrintf("coinstake, CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                //LogPrintf("coinstake, CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    //LogPrintf("coinstake, CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    //LogPrintf("coinstake, CreateCoinStake : TX_PUBKEYHASH =%d\n", whichType);
-
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        //LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    //LogPrintf("coinstake, CreateCoinStake : TX_PUBKEY =%d\n", whichType);
-
-                    valtype& vchPubKey = vSolutions[0];
-
-                    //LogPrintf("coinstake, CreateCoinStake : TX_PUBKEY DEBUG 001 \n" );
-
-
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    //LogPrintf("coinstake, CreateCoinStake : TX_PUBKEY DEBUG 002 \n" );
-
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        //LogPrintf("coinstake, CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    //LogPrintf("coinstake, CreateCoinStake : TX_PUBKEY DEBUG 003 \n" );
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
-
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-
-                //LogPrintf("coinstake, CreateCoinStake : DEBUG 004 \n" );
-
-                if(nCredit > GetStakeSplitThreshold())
-                {
-                    //LogPrintf("coinstake, CreateCoinStake : DEBUG 005 \n" );
-
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-                }
-
-                //LogPrintf("coinstake, CreateCoinStake :  DEBUG 006 \n" );
+            if (!keystore.HaveKey(CKeyID(uint160(vSolutions[0]))))
+                continue;
+        }
+        else if (whichType == TX_PUBKEY)
+        {
+            if (!keystore.HaveKey(CKeyID(Hash160(vSolutions[0]))))
+                continue;
+        }
+        else
+            continue;
 
-                fKernelFound = true;
-                break;
+        // Time of the block holding the output, read from disk like
+        // CheckKernel does when it is not in the block index
+        int64_t nBlockTime;
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(pcoin.first->hashBlock);
+        if (mi != mapBlockIndex.end())
+            nBlockTime = mi->second->GetBlockTime();
+        else
+        {
+            CTxIndex txindex;
+            CBlock block;
+            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex) ||
+                !block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                continue;
+            nBlockTime = block.GetBlockTime();
+        }
+        if (nBlockTime + nStakeMinAge > txNew.nTime)
+            continue; // only count coins meeting min age requirement
+
+        CStakeKernel kernel;
+        PrepareStakeKernel(pindexPrev, nBits, nBlockTime, pcoin.first->nTime, COutPoint(pcoin.first->GetHash(), pcoin.second),
+                           pcoin.first->vout[pcoin.second].nValue, kernel);
+        vKernelCoins.push_back(pcoin);
+        vKernels.push_back(kernel);
+    }
+
+    int nKernel;
+    unsigned int nTimeKernel;
+    uint256 hashProofOfStake;
+    if (SearchStakeKernels(pindexPrev, vKernels, txNew.nTime, min(nSearchInterval, (int64_t)nMaxStakeSearchInterval),
+                           GetStakeSearchThreads(), nKernel, nTimeKernel, hashProofOfStake))
+    {
+        // Found a kernel
+        const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin = vKernelCoins[nKernel];
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+            return false;
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false;  // unable to find corresponding public key
             }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
         }
-
-        if (fKernelFound)
+        else
         {
-            //LogPrintf("coinstake, CreateCoinStake : Kernel found DEBUG 007 \n" );
-            break; // if kernel is found stop searching
+            valtype& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false;  // unable to find corresponding public key
+            }
+            if (key.GetPubKey() != vchPubKey)
+                return false; // keys mismatch
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
+
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        if(nCredit > GetStakeSplitThreshold())
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -3938,6 +4156,7 @@ LogPrintf("RGP CommitTransaction start \n");
                 CWalletTx &coin = mapWallet[txin.prevout.hash];
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
+                MarkTxDirty(txin.prevout.hash);
                 coin.WriteToDisk();
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
@@ -4602,6 +4821,7 @@ LogPrintf("RGP FixSpentCoins start \n");
                 if (!fCheckOnly)
                 {
                     pcoin->MarkUnspent(n);
+                    MarkTxDirty(pcoin->GetHash());
                     pcoin->WriteToDisk();
                 }
             }
@@ -4614,6 +4834,7 @@ LogPrintf("RGP FixSpentCoins start \n");
                 if (!fCheckOnly)
                 {
                     pcoin->MarkSpent(n);
+                    MarkTxDirty(pcoin->GetHash());
                     pcoin->WriteToDisk();
                 }
             }
@@ -4637,6 +4858,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             if (txin.prevout.n < prev.vout.size() && IsMine(prev.vout[txin.prevout.n]))
             {
                 prev.MarkUnspent(txin.prevout.n);
+                MarkTxDirty(txin.prevout.hash);
                 prev.WriteToDisk();
             }
         }
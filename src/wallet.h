@@ -84,6 +84,90 @@ public:
     )
 };
 
+/** Amounts each balance query of CWallet adds up. Kept per wallet
+ * transaction and as a running total, so the queries do not walk mapWallet.
+ */
+struct CWalletBalances
+{
+    CAmount nAvailable;
+    CAmount nUnconfirmed;
+    CAmount nImmature;
+    CAmount nStake;
+    CAmount nNewMint;
+    CAmount nAnonymizable;
+    CAmount nAnonymized;
+    CAmount nDenominatedConf;
+    CAmount nDenominatedUnconf;
+    CAmount nWatchAvailable;
+    CAmount nWatchUnconfirmed;
+    CAmount nWatchImmature;
+    CAmount nWatchStake;
+
+    CWalletBalances()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nAvailable = nUnconfirmed = nImmature = nStake = nNewMint = 0;
+        nAnonymizable = nAnonymized = nDenominatedConf = nDenominatedUnconf = 0;
+        nWatchAvailable = nWatchUnconfirmed = nWatchImmature = nWatchStake = 0;
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nAvailable += b.nAvailable;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nStake += b.nStake;
+        nNewMint += b.nNewMint;
+        nAnonymizable += b.nAnonymizable;
+        nAnonymized += b.nAnonymized;
+        nDenominatedConf += b.nDenominatedConf;
+        nDenominatedUnconf += b.nDenominatedUnconf;
+        nWatchAvailable += b.nWatchAvailable;
+        nWatchUnconfirmed += b.nWatchUnconfirmed;
+        nWatchImmature += b.nWatchImmature;
+        nWatchStake += b.nWatchStake;
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nAvailable -= b.nAvailable;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nStake -= b.nStake;
+        nNewMint -= b.nNewMint;
+        nAnonymizable -= b.nAnonymizable;
+        nAnonymized -= b.nAnonymized;
+        nDenominatedConf -= b.nDenominatedConf;
+        nDenominatedUnconf -= b.nDenominatedUnconf;
+        nWatchAvailable -= b.nWatchAvailable;
+        nWatchUnconfirmed -= b.nWatchUnconfirmed;
+        nWatchImmature -= b.nWatchImmature;
+        nWatchStake -= b.nWatchStake;
+        return *this;
+    }
+};
+
+/** Snapshot of the key and script ids a wallet can own outputs through.
+ * Rescan worker threads match blocks against it without taking any wallet
+ * lock; a match only makes a transaction worth the full IsMine check.
+ */
+class CWalletScanFilter
+{
+public:
+    std::set<uint160> setIds;
+    std::set<CScript> setWatchOnly;
+    unsigned int nKeyStoreSize;
+
+    CWalletScanFilter() : nKeyStoreSize(0) {}
+
+    bool IsRelevant(const CTransaction& tx) const;
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -95,6 +179,10 @@ private:
     bool SelectCoins(CAmount nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = false) const;
     CWalletDB *pwalletdbEncryption;
 
+    // Keys, scripts and watch-only scripts held, grows when a rescan finds stealth payments
+    unsigned int GetKeyStoreSize() const;
+    void GetScanFilter(CWalletScanFilter& filter) const;
+
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -111,6 +199,29 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Balance totals, and what each wallet transaction adds to them. Only
+    // transactions marked dirty, and on a new tip the ones whose depth
+    // still matters (unconfirmed, immature or not final), are recomputed.
+    mutable CWalletBalances balances;
+    mutable std::map<uint256, CWalletBalances> mapTxBalances;
+    mutable std::set<uint256> setBalancesDirty;
+    mutable std::set<uint256> setBalancesVolatile;
+    mutable const CBlockIndex* pindexBalances;
+    mutable bool fBalancesValid;
+    void GetTxBalances(const CWalletTx& wtx, CWalletBalances& txBalances) const;
+    const CWalletBalances& UpdateBalances() const;
+
+    // Outputs of each wallet transaction that are ours, not spent, and
+    // whether they are spendable. Coin selection and staking start from
+    // these instead of testing every output in mapWallet.
+    mutable std::map<uint256, std::vector<std::pair<unsigned int, isminetype> > > mapWalletCoins;
+    mutable std::set<uint256> setCoinsDirty;
+    mutable bool fCoinsValid;
+    void UpdateCoinIndex() const;
+
+    // Recompute the balances and coins of a changed wallet transaction
+    void MarkTxDirty(const uint256& hash) const;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -172,6 +283,9 @@ public:
         nTimeFirstKey = 0;
         nLastFilteredHeight = 0;
         fWalletUnlockAnonymizeOnly = false;
+        pindexBalances = NULL;
+        fBalancesValid = false;
+        fCoinsValid = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;